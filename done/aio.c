@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "aio.h"
+#include "sector.h"
+#include "error.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#define AIO_URING 1
+#endif
+
+struct aio_queue {
+  const struct unix_filesystem *u;
+  unsigned depth;
+  unsigned inflight;            // requests given to the io_uring, not yet reaped
+  unsigned queued;              // requests in the submission ring, not yet submitted
+  struct aio_request **done;    // completed requests, not yet returned by aio_poll()
+  unsigned ndone;
+  int ring_fd;                  // -1 when the requests are synchronous
+#ifdef AIO_URING
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+#ifdef AIO_URING
+/**
+ * @brief release the io_uring of a queue
+ */
+static void aio_uring_teardown(struct aio_queue *q) {
+  if (q->sqes != NULL && q->sqes != MAP_FAILED) munmap(q->sqes, q->sqes_len);
+  if (q->cq_ring != NULL && q->cq_ring != MAP_FAILED && q->cq_ring != q->sq_ring) munmap(q->cq_ring, q->cq_ring_len);
+  if (q->sq_ring != NULL && q->sq_ring != MAP_FAILED) munmap(q->sq_ring, q->sq_ring_len);
+  q->sqes = NULL;
+  q->cq_ring = NULL;
+  q->sq_ring = NULL;
+  if (q->ring_fd >= 0) close(q->ring_fd);
+  q->ring_fd = -1;
+}
+
+/**
+ * @brief try to create the io_uring of a queue; on failure the queue stays synchronous
+ */
+static void aio_uring_setup(struct aio_queue *q) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, q->depth, &p);
+  if (fd < 0) return;
+  q->ring_fd = fd;
+
+  // IORING_OP_READ/WRITE came with IORING_FEAT_RW_CUR_POS (Linux 5.6)
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+    aio_uring_teardown(q);
+    return;
+  }
+
+  // Map the submission and completion rings (a single mapping on recent kernels)
+  q->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  q->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (q->cq_ring_len > q->sq_ring_len) q->sq_ring_len = q->cq_ring_len;
+    q->cq_ring_len = q->sq_ring_len;
+  }
+  q->sq_ring = mmap(NULL, q->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (q->sq_ring == MAP_FAILED) {
+    aio_uring_teardown(q);
+    return;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) q->cq_ring = q->sq_ring;
+  else q->cq_ring = mmap(NULL, q->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  q->sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (q->cq_ring == MAP_FAILED || q->sqes == MAP_FAILED) {
+    aio_uring_teardown(q);
+    return;
+  }
+
+  char *sq = q->sq_ring;
+  char *cq = q->cq_ring;
+  q->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  q->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  q->sq_array = (unsigned *) (sq + p.sq_off.array);
+  q->cq_head = (unsigned *) (cq + p.cq_off.head);
+  q->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  q->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+}
+
+/**
+ * @brief submit the queued requests and wait for min_complete completions
+ * @return 0 on success; <0 on error
+ */
+static int aio_uring_enter(struct aio_queue *q, unsigned min_complete) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, q->ring_fd, q->queued, min_complete,
+                  min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) return ERR_IO;
+
+  // ret is the number of requests taken from the submission ring
+  q->queued -= ret;
+  return 0;
+}
+
+/**
+ * @brief move every completion of the io_uring to the done list
+ */
+static void aio_uring_reap(struct aio_queue *q) {
+  unsigned head = *q->cq_head;
+  unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+    struct aio_request *req = (struct aio_request *) (uintptr_t) cqe->user_data;
+
+    // Only a complete sector counts as a success; keep it in the cache
+    req->result = (cqe->res == SECTOR_SIZE) ? 0 : ERR_IO;
+    if (req->result == 0) sector_update(q->u, req->sector, req->buf);
+
+    // Charge it to the subsystem that submitted it, as sector_read() would have
+    if (req->result == 0 && q->u->stats != NULL) {
+      iostat_record_class(q->u->stats, req->tag, req->write, SECTOR_SIZE, iostat_clock() - req->start);
+    }
+
+    q->done[q->ndone++] = req;
+    --q->inflight;
+    ++head;
+  }
+  __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief put a request in the submission ring
+ */
+static void aio_uring_queue(struct aio_queue *q, struct aio_request *req, int fd) {
+  unsigned tail = *q->sq_tail;
+  unsigned index = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &q->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = (uint64_t) req->sector * SECTOR_SIZE;
+  sqe->addr = (uint64_t) (uintptr_t) req->buf;
+  sqe->len = SECTOR_SIZE;
+  sqe->user_data = (uint64_t) (uintptr_t) req;
+  q->sq_array[index] = index;
+
+  // The kernel must see the request before the new tail
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++q->queued;
+  ++q->inflight;
+}
+#endif
+
+struct aio_queue *aio_open(const struct unix_filesystem *u, unsigned depth) {
+  if (u == NULL || (u->f == NULL && u->backend == NULL) || depth == 0) return NULL;
+
+  struct aio_queue *q = calloc(1, sizeof(struct aio_queue));
+  if (q == NULL) return NULL;
+  q->done = calloc(depth, sizeof(struct aio_request *));
+  if (q->done == NULL) {
+    free(q);
+    return NULL;
+  }
+  q->u = u;
+  q->depth = depth;
+  q->ring_fd = -1;
+
+#ifdef AIO_URING
+  aio_uring_setup(q);
+#endif
+  return q;
+}
+
+int aio_is_async(const struct aio_queue *q) {
+  return q != NULL && q->ring_fd >= 0;
+}
+
+unsigned aio_pending(const struct aio_queue *q) {
+  return q == NULL ? 0 : q->inflight + q->ndone;
+}
+
+int aio_submit(struct aio_queue *q, struct aio_request *req) {
+  M_REQUIRE_NON_NULL(q);
+  M_REQUIRE_NON_NULL(req);
+  M_REQUIRE_NON_NULL(req->buf);
+
+  // Every request must find a place in the done list
+  if (q->inflight + q->ndone >= q->depth) return 0;
+
+  // Sectors already in memory need no I/O, but count like sector_read() does
+  uint64_t start = (q->u->stats != NULL) ? iostat_clock() : 0;
+  if (!req->write && sector_lookup(q->u, req->sector, req->buf)) {
+    if (q->u->stats != NULL) iostat_record(q->u->stats, 0, SECTOR_SIZE, iostat_clock() - start);
+    req->result = 0;
+    q->done[q->ndone++] = req;
+    return 1;
+  }
+
+#ifdef AIO_URING
+  if (q->ring_fd >= 0) {
+    int fd = sector_fileno(q->u, req->write);
+    if (fd >= 0) {
+      if (q->u->stats != NULL) {
+        req->tag = q->u->stats->current;
+        req->start = start;
+      }
+      aio_uring_queue(q, req, fd);
+      return 1;
+    }
+  }
+#endif
+
+  // No io_uring (or not usable for this request): do it now
+  req->result = req->write ? sector_write(q->u, req->sector, req->buf)
+                           : sector_read(q->u, req->sector, req->buf);
+  q->done[q->ndone++] = req;
+  return 1;
+}
+
+int aio_poll(struct aio_queue *q, struct aio_request **done, unsigned max, int wait) {
+  M_REQUIRE_NON_NULL(q);
+  M_REQUIRE_NON_NULL(done);
+
+#ifdef AIO_URING
+  if (q->ring_fd >= 0 && q->inflight > 0) {
+    // Only block if there is nothing to return yet
+    unsigned minComplete = (wait && q->ndone == 0) ? 1 : 0;
+    if (q->queued > 0 || minComplete > 0) {
+      int enter = aio_uring_enter(q, minComplete);
+      if (enter != 0) return enter;
+    }
+    aio_uring_reap(q);
+  }
+#endif
+
+  // Hand over the oldest completed requests
+  unsigned n = (max < q->ndone) ? max : q->ndone;
+  memcpy(done, q->done, n * sizeof(struct aio_request *));
+  memmove(q->done, q->done + n, (q->ndone - n) * sizeof(struct aio_request *));
+  q->ndone -= n;
+  return n;
+}
+
+int aio_read_all(struct aio_queue *q, const uint32_t *sectors, size_t count, void * const *bufs) {
+  M_REQUIRE_NON_NULL(q);
+  M_REQUIRE_NON_NULL(sectors);
+  if (aio_pending(q) > 0) return ERR_BAD_PARAMETER;
+  if (count == 0) return 0;
+
+  // One request (and one scratch sector when prefetching) per slot of the queue
+  struct aio_request *reqs = calloc(q->depth, sizeof(struct aio_request));
+  struct aio_request **done = calloc(q->depth, sizeof(struct aio_request *));
+  unsigned *freeSlots = calloc(q->depth, sizeof(unsigned));
+  uint8_t *scratch = (bufs == NULL) ? malloc((size_t) q->depth * SECTOR_SIZE) : NULL;
+  if (reqs == NULL || done == NULL || freeSlots == NULL || (bufs == NULL && scratch == NULL)) {
+    free(reqs);
+    free(done);
+    free(freeSlots);
+    free(scratch);
+    return ERR_NOMEM;
+  }
+  unsigned nbFree = q->depth;
+  for (unsigned i = 0; i < q->depth; ++i) freeSlots[i] = i;
+
+  int result = 0;
+  size_t next = 0;
+  while (next < count || aio_pending(q) > 0) {
+    // Fill every free slot
+    while (result == 0 && next < count && nbFree > 0) {
+      unsigned slot = freeSlots[--nbFree];
+      reqs[slot].sector = sectors[next];
+      reqs[slot].buf = (bufs != NULL) ? bufs[next] : scratch + (size_t) slot * SECTOR_SIZE;
+      reqs[slot].write = 0;
+      reqs[slot].result = 0;
+      reqs[slot].user = (void *) (uintptr_t) slot;
+      int submit = aio_submit(q, &reqs[slot]);
+      if (submit < 0) result = submit;
+      if (submit <= 0) {
+        freeSlots[nbFree++] = slot;
+        break;
+      }
+      ++next;
+    }
+    if (result != 0 && aio_pending(q) == 0) break;
+
+    // Collect what is finished, the slots become free again
+    int n = aio_poll(q, done, q->depth, 1);
+    if (n < 0) {
+      // Requests may still be in flight: leak their memory rather than free it under the kernel
+      return n;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (result == 0 && done[i]->result < 0) result = done[i]->result;
+      freeSlots[nbFree++] = (unsigned) (uintptr_t) done[i]->user;
+    }
+  }
+
+  free(reqs);
+  free(done);
+  free(freeSlots);
+  free(scratch);
+  return result;
+}
+
+void aio_close(struct aio_queue *q) {
+  if (q == NULL) return;
+
+#ifdef AIO_URING
+  // The kernel may still write in the buffers: wait for everything
+  while (q->ring_fd >= 0 && q->inflight > 0) {
+    if (aio_uring_enter(q, q->inflight) != 0) break;
+    q->ndone = 0;
+    aio_uring_reap(q);
+  }
+  aio_uring_teardown(q);
+#endif
+
+  free(q->done);
+  free(q);
+}
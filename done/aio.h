@@ -0,0 +1,98 @@
+#pragma once
+
+/**
+ * @file aio.h
+ * @brief asynchronous sector I/O: submit many sector reads/writes, then
+ *        poll for their completion.
+ *
+ * On Linux the requests go through an io_uring: the queued requests are
+ * handed to the kernel and the finished ones are reaped with one system
+ * call per aio_poll(). When io_uring is not available, every request is
+ * done synchronously by aio_submit() and simply returned by aio_poll().
+ */
+
+#include <stdint.h>
+#include "mount.h"
+#include "iostat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct aio_request {
+    uint32_t sector;      /* the sector to read or write (IN) */
+    void *buf;            /* 512 bytes of memory (OUT for reads, IN for writes) */
+    int write;            /* 1 to write the sector, 0 to read it (IN) */
+    int result;           /* 0 on success; <0 on error (OUT, once completed) */
+    void *user;           /* free for the caller */
+    enum iostat_class tag; /* subsystem charged for it in u->stats (set by aio_submit()) */
+    uint64_t start;       /* when it was handed to the io_uring (set by aio_submit()) */
+};
+
+struct aio_queue;
+
+/**
+ * @brief create a queue of asynchronous requests on a mounted filesystem
+ * @param u the mounted filesystem (must stay mounted while the queue is used)
+ * @param depth the maximal number of requests in the queue at the same time
+ * @return the new queue, NULL on failure
+ */
+struct aio_queue *aio_open(const struct unix_filesystem *u, unsigned depth);
+
+/**
+ * @brief tell whether the queue really works asynchronously
+ * @param q the queue
+ * @return 1 if the requests go through an io_uring; 0 if they are synchronous
+ */
+int aio_is_async(const struct aio_queue *q);
+
+/**
+ * @brief number of requests submitted and not yet returned by aio_poll()
+ * @param q the queue
+ */
+unsigned aio_pending(const struct aio_queue *q);
+
+/**
+ * @brief add a request to the queue. Sectors already in memory complete
+ *        immediately. The request must stay valid until aio_poll() returns it.
+ *        It is counted in u->stats under the subsystem tagged when it is submitted.
+ *        Writes are only asynchronous on disks using SECTOR_IO_PREAD, and
+ *        the sector cache is only updated when the request completes.
+ * @param q the queue
+ * @param req the request
+ * @return 1 if queued; 0 if the queue is full (call aio_poll() first); <0 on error
+ */
+int aio_submit(struct aio_queue *q, struct aio_request *req);
+
+/**
+ * @brief start the queued requests and collect the completed ones
+ * @param q the queue
+ * @param done the completed requests (OUT)
+ * @param max the size of done
+ * @param wait 1 to wait for at least one completion if none is available
+ * @return the number of requests put in done; <0 on error
+ */
+int aio_poll(struct aio_queue *q, struct aio_request **done, unsigned max, int wait);
+
+/**
+ * @brief read a list of sectors, keeping as many requests in flight as
+ *        the queue allows, and wait until all of them are done.
+ *        The queue must be empty (aio_pending() == 0).
+ * @param q the queue
+ * @param sectors the sectors to read
+ * @param count the number of sectors
+ * @param bufs bufs[i] points to 512 bytes receiving sectors[i] (OUT);
+ *        NULL to only bring the sectors into the sector cache
+ * @return 0 on success; <0 on error (the first error met)
+ */
+int aio_read_all(struct aio_queue *q, const uint32_t *sectors, size_t count, void * const *bufs);
+
+/**
+ * @brief wait for all the requests and destroy the queue
+ * @param q the queue (may be NULL)
+ */
+void aio_close(struct aio_queue *q);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,100 @@
+/**
+ * @file bench-aio.c
+ * @brief queue-depth sweep of the asynchronous sector I/O
+ *
+ * The same random list of sectors is read with sector_read(), then with
+ * aio_read_all() for every queue depth. The disk uses SECTOR_IO_PREAD and
+ * no cache, so every sector is really read from the underlying file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "mount.h"
+#include "sector.h"
+#include "aio.h"
+#include "error.h"
+
+#define USAGE "bench-aio <diskname> [passes]"
+#define DEFAULT_PASSES 50
+#define MAX_DEPTH 256
+
+/**
+ * @brief current time in seconds
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fputs("Usage: " USAGE "\n", stderr);
+    return 1;
+  }
+  int passes = (argc == 3) ? atoi(argv[2]) : DEFAULT_PASSES;
+  if (passes <= 0) passes = DEFAULT_PASSES;
+
+  struct mount_options opts;
+  mountv6_default_options(&opts);
+  opts.cache_sectors = 0;
+  opts.io = SECTOR_IO_PREAD;
+
+  struct unix_filesystem u;
+  int error = mountv6_opts(argv[1], &opts, &u);
+  if (error != 0) {
+    fprintf(stderr, "mount failed: %s\n", ERR_MESSAGES[error - ERR_FIRST]);
+    return 1;
+  }
+
+  // Images may be shorter than s_fsize: only draw sectors really in the file
+  uint32_t nb_sectors = (u.s).s_fsize;
+  if (fseek(u.f, 0, SEEK_END) == 0 && ftell(u.f) / SECTOR_SIZE < nb_sectors) {
+    nb_sectors = (uint32_t) (ftell(u.f) / SECTOR_SIZE);
+  }
+
+  // The same random sectors for every run
+  size_t count = (size_t) passes * nb_sectors;
+  uint32_t *sectors = malloc(count * sizeof(uint32_t));
+  if (sectors == NULL) {
+    umountv6(&u);
+    return 1;
+  }
+  uint32_t seed = 12345;
+  for (size_t i = 0; i < count; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    sectors[i] = (seed >> 8) % nb_sectors;
+  }
+
+  printf("%-10s %6s %12s\n", "engine", "depth", "sectors/s");
+
+  // Reference: one synchronous read at a time
+  unsigned char data[SECTOR_SIZE];
+  double start = now();
+  for (size_t i = 0; i < count; ++i) {
+    if (sector_read(&u, sectors[i], data) != 0) {
+      fprintf(stderr, "read error\n");
+      break;
+    }
+  }
+  printf("%-10s %6d %12.0f\n", "sync", 1, count / (now() - start));
+
+  for (unsigned depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+    struct aio_queue *q = aio_open(&u, depth);
+    if (q == NULL) {
+      fprintf(stderr, "aio_open failed\n");
+      break;
+    }
+    start = now();
+    int read = aio_read_all(q, sectors, count, NULL);
+    double elapsed = now() - start;
+    if (read != 0) fprintf(stderr, "read error: %s\n", ERR_MESSAGES[read - ERR_FIRST]);
+    else printf("%-10s %6u %12.0f\n", aio_is_async(q) ? "io_uring" : "fallback", depth, count / elapsed);
+    aio_close(q);
+  }
+
+  free(sectors);
+  umountv6(&u);
+  return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * @file bench-bitmap-mt.c
+ * @brief stress test of the thread-safe bitmap allocation
+ *
+ * N threads share one bitmap. Each one claims a batch of bits, then
+ * releases them, over and over: with bm_claim_next() and bm_release(),
+ * then with bm_find_next() + bm_set() and bm_clear() under a mutex, for
+ * comparison. Every bit claimed is checked not to be held by another
+ * thread already, and the bitmap must be empty again at the end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "bmblock.h"
+#include "error.h"
+
+#define USAGE "bench-bitmap-mt [max threads] [rounds]"
+#define DEFAULT_THREADS 8
+#define MAX_THREADS 64
+#define DEFAULT_ROUNDS 2000
+#define BENCH_BITS 4096
+#define BENCH_BATCH 256
+
+struct bench {
+  struct bmblock_array *bm;
+  pthread_mutex_t lock;
+  int locked;                      // 1 to use the mutex and the plain functions
+  int rounds;
+  unsigned char owners[BENCH_BITS]; // number of threads holding every bit
+  unsigned long errors;            // bits claimed twice or out of range
+};
+
+/**
+ * @brief current time in seconds
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief take one bit for the calling thread
+ * @return the value of the bit, <0 if there is none
+ */
+static int take(struct bench *b) {
+  if (!b->locked) return bm_claim_next(b->bm);
+
+  pthread_mutex_lock(&b->lock);
+  int x = bm_find_next(b->bm);
+  if (x >= 0) bm_set(b->bm, x);
+  pthread_mutex_unlock(&b->lock);
+  return x;
+}
+
+/**
+ * @brief give back a bit taken by the calling thread
+ */
+static void give(struct bench *b, int x) {
+  if (!b->locked) {
+    bm_release(b->bm, x);
+    return;
+  }
+  pthread_mutex_lock(&b->lock);
+  bm_clear(b->bm, x);
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void *worker(void *arg) {
+  struct bench *b = arg;
+  int held[BENCH_BATCH];
+
+  for (int r = 0; r < b->rounds; ++r) {
+    int n = 0;
+    while (n < BENCH_BATCH) {
+      int x = take(b);
+      if (x < 0) break;
+      // Nobody else may hold it
+      if (x >= BENCH_BITS || __atomic_fetch_add(&b->owners[x], 1, __ATOMIC_RELAXED) != 0) {
+        __atomic_fetch_add(&b->errors, 1, __ATOMIC_RELAXED);
+      }
+      held[n++] = x;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (held[i] < BENCH_BITS) __atomic_fetch_sub(&b->owners[held[i]], 1, __ATOMIC_RELAXED);
+      give(b, held[i]);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief run the threads on an empty bitmap
+ * @return the number of nanoseconds per claim + release, <0 on error
+ */
+static double run(struct bench *b, int threads) {
+  memset(b->bm->bm, 0, b->bm->length * sizeof(b->bm->bm[0]));
+  bm_rebuild(b->bm);
+  b->errors = 0;
+
+  pthread_t ids[MAX_THREADS];
+  double start = now();
+  for (int t = 0; t < threads; ++t) {
+    if (pthread_create(&ids[t], NULL, worker, b) != 0) return -1;
+  }
+  for (int t = 0; t < threads; ++t) pthread_join(ids[t], NULL);
+  double elapsed = now() - start;
+
+  // Everything was given back
+  if (b->bm->free_count != BENCH_BITS || bm_count_free(b->bm) != BENCH_BITS) ++b->errors;
+  return elapsed * 1e9 / ((double) threads * b->rounds * BENCH_BATCH);
+}
+
+int main(int argc, char *argv[]) {
+  int maxThreads = (argc > 1) ? atoi(argv[1]) : DEFAULT_THREADS;
+  int rounds = (argc > 2) ? atoi(argv[2]) : DEFAULT_ROUNDS;
+  if (maxThreads <= 0 || maxThreads > MAX_THREADS || rounds <= 0) {
+    fprintf(stderr, "Usage: %s\n", USAGE);
+    return 1;
+  }
+
+  static struct bench b;
+  b.bm = bm_alloc(0, BENCH_BITS - 1);
+  if (b.bm == NULL) {
+    fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ERR_NOMEM - ERR_FIRST]);
+    return 1;
+  }
+  pthread_mutex_init(&b.lock, NULL);
+  b.rounds = rounds;
+
+  printf("%d bits, batches of %d, %d rounds per thread\n", BENCH_BITS, BENCH_BATCH, rounds);
+  printf("%-8s %16s %16s %8s\n", "threads", "CAS", "mutex", "errors");
+  int failed = 0;
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    b.locked = 0;
+    double cas = run(&b, threads);
+    unsigned long errors = b.errors;
+    b.locked = 1;
+    double mutex = run(&b, threads);
+    errors += b.errors;
+
+    printf("%-8d %13.1f ns %13.1f ns %8lu\n", threads, cas, mutex, errors);
+    if (cas < 0 || mutex < 0 || errors != 0) failed = 1;
+  }
+
+  pthread_mutex_destroy(&b.lock);
+  bm_free(b.bm);
+  return failed;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file bench-bitmap.c
+ * @brief measure the cost of allocating blocks with bm_find_next()
+ *
+ * A bitmap of BENCH_SECTORS sectors is emptied, or partly filled, then
+ * every free block is allocated with bm_find_next() + bm_set(), as
+ * filev6_writesector() does. The same is done with a bit-by-bit search
+ * (the previous implementation of bm_find_next()) for comparison.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bmblock.h"
+#include "error.h"
+
+#define USAGE "bench-bitmap [passes]"
+#define DEFAULT_PASSES 50
+#define BENCH_SECTORS 65536
+
+/**
+ * @brief current time in seconds
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief find the next free bit by testing every bit after the cursor
+ */
+static int find_next_bitwise(struct bmblock_array *bm) {
+  while (bm->cursor <= bm->max) {
+    if (bm_get(bm, bm->cursor) == 0) return (int) bm->cursor;
+    ++bm->cursor;
+  }
+  return ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief empty the bitmap, then use one block out of every `used` blocks
+ *        (none if used is 0)
+ */
+static void prepare(struct bmblock_array *bm, int used) {
+  memset(bm->bm, 0, bm->length * sizeof(bm->bm[0]));
+  bm_rebuild(bm);
+  if (used == 0) return;
+
+  // Small LCG, always the same pattern for both searches
+  uint32_t seed = 12345;
+  for (uint64_t i = bm->min; i <= bm->max; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    if ((seed >> 8) % used != 0) bm_set(bm, i);
+  }
+}
+
+/**
+ * @brief allocate every free block, passes times
+ * @return the number of nanoseconds per allocation, <0 on error
+ */
+static double bench(struct bmblock_array *bm, int passes, int used, int bitwise) {
+  double elapsed = 0;
+  uint64_t allocated = 0;
+
+  for (int p = 0; p < passes; ++p) {
+    prepare(bm, used);
+
+    double start = now();
+    while (1) {
+      int block = bitwise ? find_next_bitwise(bm) : bm_find_next(bm);
+      if (block < 0) break;
+      bm_set(bm, block);
+      ++allocated;
+    }
+    elapsed += now() - start;
+  }
+  if (allocated == 0) return -1;
+
+  return elapsed * 1e9 / allocated;
+}
+
+int main(int argc, char *argv[]) {
+  int passes = (argc > 1) ? atoi(argv[1]) : DEFAULT_PASSES;
+  if (passes <= 0) {
+    fprintf(stderr, "Usage: %s\n", USAGE);
+    return 1;
+  }
+
+  struct bmblock_array *bm = bm_alloc(0, BENCH_SECTORS - 1);
+  if (bm == NULL) {
+    fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[ERR_NOMEM - ERR_FIRST]);
+    return 1;
+  }
+
+  // Empty bitmap, then 1 block out of 2, 8, 64 and 1024 free before the allocations
+  const int patterns[] = {0, 2, 8, 64, 1024};
+  printf("%d sectors, %d passes\n", BENCH_SECTORS, passes);
+  printf("%-12s %16s %16s\n", "free blocks", "bm_find_next", "bit by bit");
+  for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); ++i) {
+    double words = bench(bm, passes, patterns[i], 0);
+    double bits = bench(bm, passes, patterns[i], 1);
+
+    char label[16];
+    if (patterns[i] == 0) snprintf(label, sizeof(label), "all");
+    else snprintf(label, sizeof(label), "1/%d", patterns[i]);
+    printf("%-12s %13.1f ns %13.1f ns\n", label, words, bits);
+  }
+
+  bm_free(bm);
+  return 0;
+}
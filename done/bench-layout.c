@@ -0,0 +1,119 @@
+/**
+ * @file bench-layout.c
+ * @brief effect of the locality of the sector allocation on the layout
+ *
+ * The disk is copied in memory (nothing is written back), then a few
+ * directories are made and files are added to them in turn. Each file gets
+ * its first sector when it is added, then all of them grow together, one
+ * sector at a time, like files written at the same time (each one takes
+ * its sectors from its own allocation window). The layout of the
+ * whole disk is measured with filev6_layout(), with and without locality
+ * (without it, every sector goes to the smallest free extent that fits).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "mount.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "error.h"
+
+#define USAGE "bench-layout <diskname> [files]"
+#define DEFAULT_FILES 24
+#define MAX_FILES 256
+#define BENCH_DIRS 4
+
+/**
+ * @brief print one line of results
+ */
+static void print_layout(const char *label, const struct filev6_layout *layout) {
+  uint64_t pairs = layout->sectors - layout->files;
+  printf("%-14s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %12.2f\n", label, layout->files, layout->sectors,
+         layout->seeks, pairs > 0 ? (double) layout->distance / pairs : 0.0);
+}
+
+/**
+ * @brief add the files to the disk, then make them grow together
+ * @param u the filesystem
+ * @param nb_files the number of files
+ * @return 0 on success; <0 on error
+ */
+static int workload(struct unix_filesystem *u, int nb_files) {
+  struct filev6 files[MAX_FILES];
+  int sizes[MAX_FILES];
+  uint8_t data[SECTOR_SIZE];
+  memset(data, 'x', sizeof(data));
+  char path[64];
+
+  for (int d = 0; d < BENCH_DIRS; ++d) {
+    snprintf(path, sizeof(path), "/layout%d", d);
+    int error = direntv6_create(u, path, IALLOC | IFDIR);
+    if (error < 0) return error;
+  }
+
+  // Every file gets its first sector when it is added; same sizes for every run
+  uint32_t seed = 12345;
+  for (int i = 0; i < nb_files; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    sizes[i] = 1 + (seed >> 8) % ADDR_SMALL_LENGTH;
+
+    snprintf(path, sizeof(path), "/layout%d/file%d", i % BENCH_DIRS, i);
+    int error = direntv6_create(u, path, IALLOC);
+    if (error < 0) return error;
+    int inr = direntv6_dirlookup(u, ROOT_INUMBER, path);
+    if (inr < 0) return inr;
+    error = filev6_open(u, inr, &files[i]);
+    if (error == 0) error = filev6_writebytes(u, &files[i], data, SECTOR_SIZE);
+    if (error < 0) return error;
+  }
+
+  // Then they all grow a sector at a time
+  for (int s = 1; s < ADDR_SMALL_LENGTH; ++s) {
+    for (int i = 0; i < nb_files; ++i) {
+      if (s >= sizes[i]) continue;
+      int error = filev6_writebytes(u, &files[i], data, SECTOR_SIZE);
+      if (error < 0) return error;
+    }
+  }
+
+  // Their unused allocation windows go back to the fbm
+  for (int i = 0; i < nb_files; ++i) filev6_close(u, &files[i]);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fputs("Usage: " USAGE "\n", stderr);
+    return 1;
+  }
+  int nb_files = (argc == 3) ? atoi(argv[2]) : DEFAULT_FILES;
+  if (nb_files <= 0 || nb_files > MAX_FILES) nb_files = DEFAULT_FILES;
+
+  printf("%d files in %d directories\n", nb_files, BENCH_DIRS);
+  printf("%-14s %8s %8s %8s %12s\n", "allocation", "files", "sectors", "seeks", "avg distance");
+  for (int locality = -1; locality <= 1; ++locality) {
+    // Always start from the image itself
+    struct mount_options opts;
+    mountv6_default_options(&opts);
+    opts.ram_disk = 1;
+    opts.locality = locality > 0;
+
+    struct unix_filesystem u;
+    int error = mountv6_opts(argv[1], &opts, &u);
+    // The image as it is, before the first run
+    if (error == 0 && locality >= 0) error = workload(&u, nb_files);
+
+    struct filev6_layout layout;
+    if (error == 0) error = filev6_layout(&u, &layout);
+    if (error != 0) {
+      fprintf(stderr, "ERROR: %s\n", ERR_MESSAGES[error - ERR_FIRST]);
+      if (u.f != NULL) umountv6(&u);
+      return 1;
+    }
+    print_layout(locality < 0 ? "image" : (locality ? "near" : "best fit"), &layout);
+    umountv6(&u);
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+/**
+ * @file bench-scan.c
+ * @brief time of a scan of the whole inode table
+ *
+ * A disk with the largest inode table of the format (4096 sectors, 65536
+ * inodes, every other one allocated) is written to the given file, then
+ * its inode table is scanned: one sector at a time with sector_read(), as
+ * the scans were written before inode_scan(), then with inode_scan() and
+ * more and more threads. The cache is disabled and the file is read with
+ * pread() so that every read goes to the file and the threads read it at
+ * the same time; the "ram" runs copy the disk in memory first, where the
+ * threads read one at a time.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mount.h"
+#include "inode.h"
+#include "sector.h"
+#include "error.h"
+
+#define USAGE "bench-scan <new diskname> [passes]"
+#define DEFAULT_PASSES 20
+#define BENCH_ISIZE 4096
+#define MAX_THREADS 8
+
+/**
+ * @brief current time in seconds
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief write the disk: boot sector, superblock and inode table (the
+ *        data sectors are never read, the file stops after the inodes)
+ * @return 0 on success; <0 on error
+ */
+static int make_disk(const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) return ERR_IO;
+
+  uint8_t boot[SECTOR_SIZE];
+  memset(boot, 0, sizeof(boot));
+  boot[BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM;
+
+  struct superblock su;
+  memset(&su, 0, sizeof(su));
+  su.s_isize = BENCH_ISIZE;
+  su.s_fsize = UINT16_MAX;
+  su.s_inode_start = SUPERBLOCK_SECTOR + 1;
+  su.s_block_start = su.s_inode_start + su.s_isize;
+
+  int error = fwrite(boot, SECTOR_SIZE, 1, f) == 1 && fwrite(&su, SECTOR_SIZE, 1, f) == 1 ? 0 : ERR_IO;
+  for (uint32_t s = 0; error == 0 && s < BENCH_ISIZE; ++s) {
+    struct inode inodes[INODES_PER_SECTOR];
+    memset(inodes, 0, sizeof(inodes));
+    for (uint32_t j = 0; j < INODES_PER_SECTOR; ++j) {
+      uint32_t inr = s * INODES_PER_SECTOR + j;
+      if (inr % 2 == 0) continue;
+      // Empty files, with a size to add up; the root is a directory
+      inodes[j].i_mode = IALLOC | (inr == ROOT_INUMBER ? IFDIR : 0);
+      if (inr != ROOT_INUMBER) inodes[j].i_size1 = inr % 4096;
+    }
+    if (fwrite(inodes, SECTOR_SIZE, 1, f) != 1) error = ERR_IO;
+  }
+  if (fclose(f) != 0 && error == 0) error = ERR_IO;
+  return error;
+}
+
+// What the callback adds up, from any thread
+struct tally {
+  unsigned long inodes;
+  unsigned long bytes;
+};
+
+static int count_one(void *ctx, uint16_t inr, const struct inode *inode) {
+  struct tally *t = ctx;
+  (void) inr;
+  __atomic_fetch_add(&t->inodes, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->bytes, (unsigned long) inode_getsize(inode), __ATOMIC_RELAXED);
+  return 0;
+}
+
+/**
+ * @brief the scan as it was written before inode_scan(): one sector at a time
+ * @return 0 on success; <0 on error
+ */
+static int scan_by_sector(const struct unix_filesystem *u, struct tally *t) {
+  for (uint32_t s = 0; s < (u->s).s_isize; ++s) {
+    struct inode inodes[INODES_PER_SECTOR];
+    int read = sector_read(u, (u->s).s_inode_start + s, inodes);
+    if (read != 0) return read;
+    for (uint32_t j = 0; j < INODES_PER_SECTOR; ++j) {
+      if (inodes[j].i_mode & IALLOC) count_one(t, (uint16_t) (s * INODES_PER_SECTOR + j), &inodes[j]);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief scan passes times, by sector if threads is 0, else with inode_scan()
+ * @return the milliseconds per scan, <0 on error
+ */
+static double bench(const struct unix_filesystem *u, int passes, int threads, struct tally *t) {
+  double start = now();
+  for (int p = 0; p < passes; ++p) {
+    memset(t, 0, sizeof(*t));
+    int error = (threads == 0) ? scan_by_sector(u, t) : inode_scan(u, 0, count_one, t, threads);
+    if (error != 0) return -1;
+  }
+  return (now() - start) * 1e3 / passes;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fputs("Usage: " USAGE "\n", stderr);
+    return 1;
+  }
+  int passes = (argc == 3) ? atoi(argv[2]) : DEFAULT_PASSES;
+  if (passes <= 0) passes = DEFAULT_PASSES;
+
+  int error = make_disk(argv[1]);
+  if (error != 0) {
+    fprintf(stderr, "can't write the disk: %s\n", ERR_MESSAGES[error - ERR_FIRST]);
+    return 1;
+  }
+
+  printf("%d inodes in %d sectors, %d passes\n", (int) (BENCH_ISIZE * INODES_PER_SECTOR), BENCH_ISIZE, passes);
+  printf("%-6s %-10s %12s %14s %10s\n", "disk", "scan", "ms/scan", "inodes/s", "allocated");
+  unsigned long expected = 0;
+  int failed = 0;
+  for (int ram = 0; ram <= 1; ++ram) {
+    struct mount_options opts;
+    mountv6_default_options(&opts);
+    opts.cache_sectors = 0;
+    opts.io = SECTOR_IO_PREAD;
+    opts.ram_disk = ram;
+
+    struct unix_filesystem u;
+    error = mountv6_opts(argv[1], &opts, &u);
+    if (error != 0) {
+      fprintf(stderr, "mount failed: %s\n", ERR_MESSAGES[error - ERR_FIRST]);
+      return 1;
+    }
+
+    for (int threads = 0; threads <= MAX_THREADS; threads = threads == 0 ? 1 : threads * 2) {
+      struct tally t;
+      double ms = bench(&u, passes, threads, &t);
+      char name[16];
+      if (threads == 0) snprintf(name, sizeof(name), "by sector");
+      else snprintf(name, sizeof(name), "%d thr", threads);
+      if (ms < 0) {
+        fprintf(stderr, "scan error\n");
+        failed = 1;
+        continue;
+      }
+      printf("%-6s %-10s %12.2f %14.0f %10lu\n", ram ? "ram" : "file", name, ms,
+             BENCH_ISIZE * INODES_PER_SECTOR / (ms / 1e3), t.inodes);
+
+      // Every scan must find the same inodes
+      if (expected == 0) expected = t.inodes;
+      if (t.inodes != expected) failed = 1;
+    }
+    umountv6(&u);
+  }
+  return failed;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file bench-sector.c
+ * @brief compare the sectors/s of the I/O methods of sector_read()
+ *
+ * Every sector of the disk is read sequentially, then the same number of
+ * sectors is read in a random order, then sequentially again but
+ * RANGE_SECTORS at a time with sector_read_range(), once per method.
+ * The cache is disabled so that every read goes to the underlying file;
+ * the "ram" method copies the disk in memory first, which measures the
+ * cost of the sector layer alone.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "mount.h"
+#include "sector.h"
+#include "error.h"
+
+#define USAGE "bench-sector <diskname> [passes]"
+#define DEFAULT_PASSES 200
+#define RANGE_SECTORS 64
+
+/**
+ * @brief current time in seconds
+ */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief read passes times every sector of the disk, sequentially or not
+ * @return the number of sectors per second, <0 on error
+ */
+static double bench(struct unix_filesystem *u, int passes, int random, unsigned long *checksum) {
+  uint32_t nb_sectors = (u->s).s_fsize;
+  unsigned char data[SECTOR_SIZE];
+  uint32_t seed = 12345;
+
+  double start = now();
+  for (int p = 0; p < passes; ++p) {
+    for (uint32_t i = 0; i < nb_sectors; ++i) {
+      uint32_t sector = i;
+      if (random) {
+        // Small LCG, always the same sequence for every method
+        seed = seed * 1103515245u + 12345u;
+        sector = (seed >> 8) % nb_sectors;
+      }
+      if (sector_read(u, sector, data) != 0) return -1;
+      *checksum += data[sector % SECTOR_SIZE];
+    }
+  }
+  double elapsed = now() - start;
+
+  return (double) passes * nb_sectors / elapsed;
+}
+
+/**
+ * @brief read passes times the whole disk, RANGE_SECTORS at a time
+ * @return the number of sectors per second, <0 on error
+ */
+static double bench_range(struct unix_filesystem *u, int passes, unsigned long *checksum) {
+  uint32_t nb_sectors = (u->s).s_fsize;
+  unsigned char data[RANGE_SECTORS * SECTOR_SIZE];
+
+  double start = now();
+  for (int p = 0; p < passes; ++p) {
+    for (uint32_t first = 0; first < nb_sectors; first += RANGE_SECTORS) {
+      uint32_t count = nb_sectors - first < RANGE_SECTORS ? nb_sectors - first : RANGE_SECTORS;
+      if (sector_read_range(u, first, count, data) != 0) return -1;
+      for (uint32_t i = 0; i < count; ++i) {
+        *checksum += data[i * SECTOR_SIZE + (first + i) % SECTOR_SIZE];
+      }
+    }
+  }
+  double elapsed = now() - start;
+
+  return (double) passes * nb_sectors / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fputs("Usage: " USAGE "\n", stderr);
+    return 1;
+  }
+  int passes = (argc == 3) ? atoi(argv[2]) : DEFAULT_PASSES;
+  if (passes <= 0) passes = DEFAULT_PASSES;
+
+  const struct {
+    const char *name;
+    enum sector_io io;
+    int ram_disk;
+  } methods[] = {
+    {"stdio", SECTOR_IO_STDIO, 0},
+    {"pread", SECTOR_IO_PREAD, 0},
+    {"direct", SECTOR_IO_DIRECT, 0},
+    {"ram", SECTOR_IO_STDIO, 1}
+  };
+
+  printf("%-8s %-12s %12s %10s\n", "io", "pattern", "sectors/s", "checksum");
+  for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m) {
+    struct mount_options opts;
+    mountv6_default_options(&opts);
+    opts.cache_sectors = 0;
+    opts.io = methods[m].io;
+    opts.ram_disk = methods[m].ram_disk;
+
+    struct unix_filesystem u;
+    int error = mountv6_opts(argv[1], &opts, &u);
+    if (error != 0) {
+      fprintf(stderr, "mount failed: %s\n", ERR_MESSAGES[error - ERR_FIRST]);
+      return 1;
+    }
+
+    const char *patterns[] = {"sequential", "random", "range"};
+    for (int pattern = 0; pattern < 3; ++pattern) {
+      unsigned long checksum = 0;
+      double rate = (pattern == 2) ? bench_range(&u, passes, &checksum)
+                                   : bench(&u, passes, pattern, &checksum);
+      if (rate < 0) {
+        fprintf(stderr, "read error\n");
+        umountv6(&u);
+        return 1;
+      }
+      printf("%-8s %-12s %12.0f %10lu\n", methods[m].name, patterns[pattern], rate, checksum);
+    }
+    umountv6(&u);
+  }
+  return 0;
+}
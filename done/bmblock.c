@@ -3,33 +3,173 @@
 #include <inttypes.h>
 #include "bmblock.h"
 #include <stdlib.h>
+#include <string.h>
+#include "bmchunk.h"
 #include "error.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #define BITS 64
+// Number of rows bm_find_next() tests at once when skipping full rows
+#define BM_BLOCK_WORDS 4
 
 
+/**
+ * @brief number of chunks of a compressed array
+ */
+static size_t bm_chunk_count(const struct bmblock_array *bmblock_array) {
+  return (size_t) ((bmblock_array->max - bmblock_array->min) / BM_CHUNK_BITS + 1);
+}
+
+/**
+ * @brief the chunk of a value of a compressed array, and the value in it
+ * @param v the value in the chunk (OUT)
+ */
+static struct bm_chunk *bm_chunk_of(const struct bmblock_array *bmblock_array, uint64_t x, uint32_t *v) {
+  *v = (uint32_t) ((x - bmblock_array->min) % BM_CHUNK_BITS);
+  return &bmblock_array->chunks[(x - bmblock_array->min) / BM_CHUNK_BITS];
+}
+
+/**
+ * @brief bm_alloc() for an array of at least BM_COMPRESSED_MIN_BITS values:
+ *        every chunk starts as an empty array container
+ */
+static struct bmblock_array *bm_alloc_compressed(uint64_t min, uint64_t max) {
+  struct bmblock_array *ba = calloc(1, sizeof(struct bmblock_array));
+  if (ba == NULL) return NULL;
+  ba->min = min;
+  ba->max = max;
+  ba->cursor = min;
+  // No rows and no summary
+  ba->length = 0;
+
+  size_t count = bm_chunk_count(ba);
+  ba->chunks = calloc(count, sizeof(struct bm_chunk));
+  if (ba->chunks == NULL) {
+    free(ba);
+    return NULL;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t left = max - min + 1 - (uint64_t) i * BM_CHUNK_BITS;
+    bm_chunk_init(&ba->chunks[i], left < BM_CHUNK_BITS ? (uint32_t) left : BM_CHUNK_BITS);
+  }
+  ba->free_count = max - min + 1;
+  return ba;
+}
+
 struct bmblock_array *bm_alloc(uint64_t min, uint64_t max) {
   // Check parameters
   if (min > max) return NULL;
   uint64_t length = max - min + 1;
+  // Large volumes are compressed
+  if (length >= BM_COMPRESSED_MIN_BITS) return bm_alloc_compressed(min, max);
   //  How manay more entries in the array we have to add
   size_t toAdd = (length - 1)/ 64;
 
-  struct bmblock_array* ba = malloc(sizeof(struct bmblock_array) + toAdd*BITS);
+  // Words of every level of summary, only above rows long enough to need it
+  size_t summaryWords[BM_SUMMARY_LEVELS];
+  size_t totalSummary = 0;
+  size_t under = toAdd + 1;
+  for (int l = 0; l < BM_SUMMARY_LEVELS; ++l) {
+    summaryWords[l] = (under >= BM_SUMMARY_MIN_WORDS) ? (under + BITS - 1) / BITS : 0;
+    totalSummary += summaryWords[l];
+    under = summaryWords[l];
+  }
+
+  // The struct already has one row
+  struct bmblock_array* ba = malloc(sizeof(struct bmblock_array) + (toAdd + totalSummary) * sizeof(uint64_t));
   if (ba != NULL){
     // If the allocation worked, we update the parameters
     ba->min = min;
     ba->max = max;
     ba->length = toAdd+1;
     ba->cursor = min;
+    ba->chunks = NULL;
+    // Every bit starts unused
+    memset(ba->bm, 0, ba->length * sizeof(uint64_t));
+    ba->free_count = length;
+
+    // The summary lives right after the rows; every row may have an unused bit
+    uint64_t *next = &ba->bm[ba->length];
+    for (int l = 0; l < BM_SUMMARY_LEVELS; ++l) {
+      ba->summary[l] = (summaryWords[l] > 0) ? next : NULL;
+      for (size_t i = 0; i < summaryWords[l]; ++i) next[i] = UINT64_MAX;
+      next += summaryWords[l];
+    }
   }
   return ba;
 }
+
+void bm_free(struct bmblock_array *bmblock_array) {
+  if (bmblock_array == NULL) return;
+  if (bmblock_array->chunks != NULL) {
+    for (size_t i = 0; i < bm_chunk_count(bmblock_array); ++i) bm_chunk_free(&bmblock_array->chunks[i]);
+    free(bmblock_array->chunks);
+  }
+  free(bmblock_array);
+}
+
+/**
+ * @brief number of words of a level of summary
+ */
+static size_t bm_summary_words(const struct bmblock_array *bmblock_array, int level) {
+  size_t words = bmblock_array->length;
+  for (int l = 0; l <= level; ++l) words = (words + BITS - 1) / BITS;
+  return words;
+}
+
+/**
+ * @brief clear a bit of a level of summary, and the bit above it if its
+ *        word becomes zero
+ */
+static void bm_summary_clear(struct bmblock_array *bmblock_array, int level, size_t index) {
+  while (level < BM_SUMMARY_LEVELS && bmblock_array->summary[level] != NULL) {
+    uint64_t *word = &bmblock_array->summary[level][index / BITS];
+    *word &= ~(UINT64_C(1) << (index % BITS));
+    // The level above only changes when the whole word becomes zero
+    if (*word != 0) return;
+    index /= BITS;
+    ++level;
+  }
+}
+
+void bm_rebuild(struct bmblock_array *bmblock_array) {
+  if (bmblock_array == NULL) return;
+
+  bmblock_array->cursor = bmblock_array->min;
+  bmblock_array->free_count = bm_count_free(bmblock_array);
+  if (bmblock_array->chunks != NULL || bmblock_array->summary[0] == NULL) return;
+
+  // Exact first level: the rows that are not full
+  size_t words = bm_summary_words(bmblock_array, 0);
+  for (size_t w = 0; w < words; ++w) bmblock_array->summary[0][w] = 0;
+  for (size_t row = 0; row < bmblock_array->length; ++row) {
+    if (bmblock_array->bm[row] != UINT64_MAX) bmblock_array->summary[0][row / BITS] |= UINT64_C(1) << (row % BITS);
+  }
+
+  // Every other level from the one under it
+  for (int l = 1; l < BM_SUMMARY_LEVELS && bmblock_array->summary[l] != NULL; ++l) {
+    size_t underWords = words;
+    words = bm_summary_words(bmblock_array, l);
+    for (size_t w = 0; w < words; ++w) bmblock_array->summary[l][w] = 0;
+    for (size_t i = 0; i < underWords; ++i) {
+      if (bmblock_array->summary[l - 1][i] != 0) bmblock_array->summary[l][i / BITS] |= UINT64_C(1) << (i % BITS);
+    }
+  }
+}
+
 int bm_get(struct bmblock_array *bmblock_array, uint64_t x) {
   M_REQUIRE_NON_NULL(bmblock_array);
 
   // Check parameters
   if (x < bmblock_array->min || bmblock_array->max < x) return ERR_BAD_PARAMETER;
 
+  if (bmblock_array->chunks != NULL) {
+    uint32_t v;
+    const struct bm_chunk *chunk = bm_chunk_of(bmblock_array, x, &v);
+    return bm_chunk_get(chunk, v);
+  }
+
   // Which row 
   size_t bm_index = (x - bmblock_array->min) / BITS;
   // Where in the row
@@ -40,27 +180,63 @@ int bm_get(struct bmblock_array *bmblock_array, uint64_t x) {
   // get the value at the positon
   return (int)((correctUInt >> shift) & UINT64_C(1));
 }
-void bm_set(struct bmblock_array *bmblock_array, uint64_t x) {
+int bm_set(struct bmblock_array *bmblock_array, uint64_t x) {
+  M_REQUIRE_NON_NULL(bmblock_array);
   // Check parameters
-  if (x < bmblock_array->min || bmblock_array->max < x) return;
+  if (x < bmblock_array->min || bmblock_array->max < x) return ERR_BAD_PARAMETER;
+  if (bmblock_array->chunks != NULL) {
+    uint32_t v;
+    struct bm_chunk *chunk = bm_chunk_of(bmblock_array, x, &v);
+    // The container may need more memory
+    int changed = bm_chunk_change(chunk, v, 1);
+    if (changed < 0) return changed;
+    if (changed == 1) --bmblock_array->free_count;
+    return 0;
+  }
   // Which row 
   size_t bm_index = (x - bmblock_array->min) / BITS;
   // Where in the row
   size_t shift = (x - bmblock_array->min) % BITS;
+  // Nothing changes if it is already used
+  if (bmblock_array->bm[bm_index] & (UINT64_C(1) << shift)) return 0;
   // set the value at the positon
   bmblock_array->bm[bm_index] = bmblock_array->bm[bm_index] | (UINT64_C(1) << shift);
+  --bmblock_array->free_count;
+  // A full row disappears from the summary
+  if (bmblock_array->bm[bm_index] == UINT64_MAX && bmblock_array->summary[0] != NULL) {
+    bm_summary_clear(bmblock_array, 0, bm_index);
+  }
+  return 0;
 }
-void bm_clear(struct bmblock_array *bmblock_array, uint64_t x) {
+int bm_clear(struct bmblock_array *bmblock_array, uint64_t x) {
+  M_REQUIRE_NON_NULL(bmblock_array);
   // Check parameters
-  if (x < bmblock_array->min || bmblock_array->max < x) return;
+  if (x < bmblock_array->min || bmblock_array->max < x) return ERR_BAD_PARAMETER;
+  if (bmblock_array->chunks != NULL) {
+    uint32_t v;
+    struct bm_chunk *chunk = bm_chunk_of(bmblock_array, x, &v);
+    // Clearing a value may also need memory (a run split in two)
+    int changed = bm_chunk_change(chunk, v, 0);
+    if (changed < 0) return changed;
+    if (changed == 1) ++bmblock_array->free_count;
+    if (bmblock_array->cursor > x) bmblock_array->cursor = x;
+    return 0;
+  }
   // Which row 
   size_t bm_index = (x - bmblock_array->min) / BITS;
   // Where in the row
   size_t shift = (x - bmblock_array->min) % BITS;
-  // clear the value at the positon
+  // clear the value at the positon, counting it if it was used
+  if (bmblock_array->bm[bm_index] & (UINT64_C(1) << shift)) ++bmblock_array->free_count;
   bmblock_array->bm[bm_index] = bmblock_array->bm[bm_index] & ~(UINT64_C(1) << shift);
+  // The row, and every level of summary above it, now has an unused bit
+  for (int l = 0; l < BM_SUMMARY_LEVELS && bmblock_array->summary[l] != NULL; ++l) {
+    bmblock_array->summary[l][bm_index / BITS] |= UINT64_C(1) << (bm_index % BITS);
+    bm_index /= BITS;
+  }
   // Move the cursor back if needed
   if(bmblock_array->cursor > x) bmblock_array->cursor = x;
+  return 0;
 }
 
 void bm_print(struct bmblock_array *bmblock_array){
@@ -69,6 +245,18 @@ void bm_print(struct bmblock_array *bmblock_array){
   printf("min: %" PRIu64 "\n", bmblock_array->min);
   printf("max: %" PRIu64 "\n", bmblock_array->max);
   printf("cursor: %" PRIu64 "\n", bmblock_array->cursor);
+  if (bmblock_array->chunks != NULL) {
+    // One line per chunk: the kind of its container and its used values
+    static const char *kinds[] = {"array", "bitset", "run"};
+    printf("chunks:\n");
+    for (size_t i = 0; i < bm_chunk_count(bmblock_array); ++i) {
+      const struct bm_chunk *chunk = &bmblock_array->chunks[i];
+      printf("%zu: %s, %" PRIu32 "/%" PRIu32 " used, %zu bytes\n", i, kinds[chunk->kind], chunk->card,
+             chunk->span, bm_chunk_bytes(chunk));
+    }
+    printf("**********BitMap Block END************\n");
+    return;
+  }
   printf("content:\n");
   // For each row
   for (int i = 0; i < bmblock_array->length; ++i) {
@@ -85,30 +273,493 @@ void bm_print(struct bmblock_array *bmblock_array){
 
 }
 
+/**
+ * @brief index of the lowest bit set in a word
+ * @param word the word, not 0
+ */
+static int bm_ctz(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#else
+  int n = 0;
+  while (!(word & UINT64_C(1))) {
+    word >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+/**
+ * @brief number of bits set in a word
+ */
+static int bm_popcount(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(word);
+#else
+  // Count by pairs, nibbles, then add the bytes together
+  word = word - ((word >> 1) & UINT64_C(0x5555555555555555));
+  word = (word & UINT64_C(0x3333333333333333)) + ((word >> 2) & UINT64_C(0x3333333333333333));
+  word = (word + (word >> 4)) & UINT64_C(0x0F0F0F0F0F0F0F0F);
+  return (int) ((word * UINT64_C(0x0101010101010101)) >> 56);
+#endif
+}
+
+/**
+ * @brief the bits of a row that stand for values between min and max (the
+ *        last row may end with padding bits)
+ */
+static uint64_t bm_row_mask(const struct bmblock_array *bmblock_array, size_t row) {
+  size_t used = (bmblock_array->max - bmblock_array->min + 1) % BITS;
+  if (row + 1 < bmblock_array->length || used == 0) return UINT64_MAX;
+  return (UINT64_C(1) << used) - 1;
+}
+
+uint64_t bm_count_free(const struct bmblock_array *bmblock_array) {
+  if (bmblock_array == NULL) return 0;
+
+  // Every chunk knows how many of its values are used
+  uint64_t count = 0;
+  if (bmblock_array->chunks != NULL) {
+    for (size_t i = 0; i < bm_chunk_count(bmblock_array); ++i) {
+      count += bmblock_array->chunks[i].span - bmblock_array->chunks[i].card;
+    }
+    return count;
+  }
+
+  // A word at a time, ignoring the padding bits
+  for (size_t row = 0; row < bmblock_array->length; ++row) {
+    count += bm_popcount(~bmblock_array->bm[row] & bm_row_mask(bmblock_array, row));
+  }
+  return count;
+}
+
+/**
+ * @brief set or clear the bits between first and last (included), a row at a time
+ * @param value 1 to set them, 0 to clear them
+ * @return 0 on success; ERR_NOMEM if a container of a compressed array
+ *         could not grow (the values before it did change)
+ */
+static int bm_change_range(struct bmblock_array *bmblock_array, uint64_t first, uint64_t last, int value) {
+  M_REQUIRE_NON_NULL(bmblock_array);
+
+  // Keep only the values inside the array
+  if (first < bmblock_array->min) first = bmblock_array->min;
+  if (last > bmblock_array->max) last = bmblock_array->max;
+  if (first > last) return 0;
+
+  if (bmblock_array->chunks != NULL) {
+    // Chunk by chunk
+    int result = 0;
+    for (uint64_t x = first; x <= last && result == 0;) {
+      uint32_t v;
+      struct bm_chunk *chunk = bm_chunk_of(bmblock_array, x, &v);
+      uint64_t end = x + (chunk->span - 1 - v) < last ? x + (chunk->span - 1 - v) : last;
+      int changed = bm_chunk_change_range(chunk, v, v + (uint32_t) (end - x), value);
+      // Without memory for the chunk, one value at a time, until one needs memory too
+      if (changed < 0) {
+        changed = 0;
+        for (uint32_t i = v; i <= v + (uint32_t) (end - x) && result == 0; ++i) {
+          int one = bm_chunk_change(chunk, i, value);
+          if (one < 0) result = one;
+          else changed += one;
+        }
+      }
+      if (value) bmblock_array->free_count -= changed;
+      else bmblock_array->free_count += changed;
+      x = end + 1;
+    }
+    if (!value && bmblock_array->cursor > first) bmblock_array->cursor = first;
+    return result;
+  }
+
+  size_t firstRow = (first - bmblock_array->min) / BITS;
+  size_t lastRow = (last - bmblock_array->min) / BITS;
+  for (size_t row = firstRow; row <= lastRow; ++row) {
+    // The bits of the range in this row
+    uint64_t mask = UINT64_MAX;
+    if (row == firstRow) mask &= UINT64_MAX << ((first - bmblock_array->min) % BITS);
+    if (row == lastRow) mask &= UINT64_MAX >> (BITS - 1 - (last - bmblock_array->min) % BITS);
+
+    if (value) {
+      // Only the bits that were unused change the count
+      bmblock_array->free_count -= bm_popcount(mask & ~bmblock_array->bm[row]);
+      bmblock_array->bm[row] |= mask;
+      // A full row disappears from the summary
+      if (bmblock_array->bm[row] == UINT64_MAX && bmblock_array->summary[0] != NULL) {
+        bm_summary_clear(bmblock_array, 0, row);
+      }
+    }
+    else {
+      // Only the bits that were used change the count
+      bmblock_array->free_count += bm_popcount(mask & bmblock_array->bm[row]);
+      bmblock_array->bm[row] &= ~mask;
+      // The row, and every level of summary above it, now has an unused bit
+      size_t index = row;
+      for (int l = 0; l < BM_SUMMARY_LEVELS && bmblock_array->summary[l] != NULL; ++l) {
+        bmblock_array->summary[l][index / BITS] |= UINT64_C(1) << (index % BITS);
+        index /= BITS;
+      }
+    }
+  }
+
+  // Move the cursor back if needed
+  if (!value && bmblock_array->cursor > first) bmblock_array->cursor = first;
+  return 0;
+}
+
+int bm_set_range(struct bmblock_array *bmblock_array, uint64_t first, uint64_t last) {
+  return bm_change_range(bmblock_array, first, last, 1);
+}
+
+int bm_clear_range(struct bmblock_array *bmblock_array, uint64_t first, uint64_t last) {
+  return bm_change_range(bmblock_array, first, last, 0);
+}
+
+/**
+ * @brief tell if BM_BLOCK_WORDS consecutive words are all equal to a pattern
+ * @param words the first of the words
+ * @param pattern the value of every word, all ones or all zeros
+ * @return 1 if they are all equal to it, 0 otherwise
+ */
+static int bm_block_equal(const uint64_t *words, uint64_t pattern) {
+#if defined(__SSE2__)
+  // Compare the four words two by two, then check the 16 bytes of both at once
+  __m128i p = _mm_set1_epi32((int) (uint32_t) pattern);
+  __m128i equal = _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) words), p),
+                                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (words + 2)), p));
+  return _mm_movemask_epi8(equal) == 0xFFFF;
+#else
+  return words[0] == pattern && words[1] == pattern && words[2] == pattern && words[3] == pattern;
+#endif
+}
+
+/**
+ * @brief find the first bit set at or after a position in a level of summary
+ * @param bmblock_array the array to search
+ * @param level the level of summary (its summary[level] is not NULL)
+ * @param pos where to start
+ * @return the position of the bit, at least the number of bits of the level if there is none
+ */
+static size_t bm_summary_next(struct bmblock_array *bmblock_array, int level, size_t pos) {
+  size_t words = bm_summary_words(bmblock_array, level);
+  size_t w = pos / BITS;
+  if (w >= words) return words * BITS;
+  uint64_t bits = bmblock_array->summary[level][w] & (UINT64_MAX << (pos % BITS));
+
+  int above = level + 1 < BM_SUMMARY_LEVELS && bmblock_array->summary[level + 1] != NULL;
+  while (bits == 0) {
+    ++w;
+    // Jump directly to the next word that may not be zero
+    if (above) w = bm_summary_next(bmblock_array, level + 1, w);
+    if (w >= words) return words * BITS;
+    bits = bmblock_array->summary[level][w];
+    // The level above was too optimistic about this word
+    if (bits == 0 && above) bm_summary_clear(bmblock_array, level + 1, w);
+  }
+  return w * BITS + bm_ctz(bits);
+}
+
+/**
+ * @brief find the first bit with the given value at or after a position
+ * @param bmblock_array the array to search
+ * @param from where to start (>= min)
+ * @param value 0 to look for a free bit, 1 for a used one
+ * @param limit where to stop (excluded)
+ * @return the position of the bit, min(limit, max+1) if there is none
+ */
+static uint64_t bm_next_bit(struct bmblock_array *bmblock_array, uint64_t from, int value, uint64_t limit) {
+  if (limit > bmblock_array->max + 1) limit = bmblock_array->max + 1;
+  if (from >= limit) return limit;
+
+  if (bmblock_array->chunks != NULL) {
+    // Chunk by chunk, skipping the ones without the value
+    for (uint64_t x = from; x < limit;) {
+      uint32_t v;
+      const struct bm_chunk *chunk = bm_chunk_of(bmblock_array, x, &v);
+      uint64_t chunkEnd = x - v + chunk->span;
+      if (chunk->card != (value ? 0 : chunk->span)) {
+        uint32_t stop = limit < chunkEnd ? (uint32_t) (limit - (x - v)) : chunk->span;
+        uint32_t found = bm_chunk_next(chunk, v, value, stop);
+        if (found < stop) return x - v + found;
+      }
+      x = chunkEnd;
+    }
+    return limit;
+  }
+
+  // Rows equal to skip have no bit of the value; XOR with it sets the wanted bits
+  uint64_t skip = value ? 0 : UINT64_MAX;
+  // Unused bits can be found with the summary, when there is one
+  int summary = !value && bmblock_array->summary[0] != NULL;
+  uint64_t offset = from - bmblock_array->min;
+  size_t row = offset / BITS;
+  size_t lastRow = (limit - 1 - bmblock_array->min) / BITS;
+  // Ignore the bits before from
+  uint64_t bits = (bmblock_array->bm[row] ^ skip) & (UINT64_MAX << (offset % BITS));
+
+  // Skip the rows without the value
+  while (bits == 0) {
+    ++row;
+    if (summary) {
+      // Jump directly to the next row that may have an unused bit
+      row = bm_summary_next(bmblock_array, 0, row);
+    }
+    else {
+      // A whole block of rows at a time when possible
+      while (row + BM_BLOCK_WORDS <= lastRow + 1 && bm_block_equal(&bmblock_array->bm[row], skip)) {
+        row += BM_BLOCK_WORDS;
+      }
+    }
+    if (row > lastRow) return limit;
+    bits = bmblock_array->bm[row] ^ skip;
+    // The summary was too optimistic about this row
+    if (bits == 0 && summary) bm_summary_clear(bmblock_array, 0, row);
+  }
+
+  // The lowest wanted bit, unless it is past the limit (or one of the padding bits after max)
+  uint64_t found = bmblock_array->min + row * BITS + bm_ctz(bits);
+  return found < limit ? found : limit;
+}
+
+uint64_t bm_find_value(struct bmblock_array *bmblock_array, uint64_t from, int value) {
+  if (from < bmblock_array->min) from = bmblock_array->min;
+  return bm_next_bit(bmblock_array, from, value != 0, bmblock_array->max + 1);
+}
+
 int bm_find_next(struct bmblock_array *bmblock_array) {
   M_REQUIRE_NON_NULL(bmblock_array);
   // Our cursor correspond to a bit and not a row (It was said in the forum taht since it was an intertnal representation it was ok)
-  while (1) {
-    // get the row
-    uint64_t bm_index = bmblock_array->bm[(bmblock_array->cursor - bmblock_array->min) / BITS];
-    // If every bit of the row is assigned
-    if (bm_index == UINT64_C(-1)){
-      // If we are at the end of the bm_block, return err_full
-      if((bmblock_array->cursor - bmblock_array->min) / BITS + 1 == bmblock_array->length){
-        return ERR_BITMAP_FULL;
+  if (bmblock_array->cursor > bmblock_array->max) return ERR_BITMAP_FULL;
+
+  uint64_t found = bm_next_bit(bmblock_array, bmblock_array->cursor, 0, bmblock_array->max + 1);
+  if (found > bmblock_array->max) {
+    // Nothing to find until bm_clear() moves the cursor back
+    bmblock_array->cursor = bmblock_array->max + 1;
+    return ERR_BITMAP_FULL;
+  }
+  bmblock_array->cursor = found;
+  return (int) found;
+}
+
+/**
+ * @brief look for a run of n unused bits starting between from and limit
+ *        (excluded), remembering the longest shorter one
+ * @param best_start the start of the longest run found so far (IN-OUT)
+ * @param best_length its length, n once a run is long enough (IN-OUT)
+ */
+static void bm_search_run(struct bmblock_array *bmblock_array, uint64_t from, uint64_t limit, size_t n,
+                          uint64_t *best_start, uint64_t *best_length) {
+  uint64_t x = from;
+  while (x < limit && *best_length < n) {
+    uint64_t first = bm_next_bit(bmblock_array, x, 0, limit);
+    if (first >= limit) break;
+    // No need to measure the run further than n bits
+    uint64_t end = bm_next_bit(bmblock_array, first, 1, first + n);
+    if (end - first > *best_length) {
+      *best_start = first;
+      *best_length = end - first;
+    }
+    x = end;
+  }
+}
+
+int bm_find_run(struct bmblock_array *bmblock_array, size_t n, uint64_t *start) {
+  M_REQUIRE_NON_NULL(bmblock_array);
+  return bm_find_run_near(bmblock_array, bmblock_array->cursor, n, start);
+}
+
+int bm_find_run_near(struct bmblock_array *bmblock_array, uint64_t goal, size_t n, uint64_t *start) {
+  M_REQUIRE_NON_NULL(bmblock_array);
+  M_REQUIRE_NON_NULL(start);
+  if (n == 0) return ERR_BAD_PARAMETER;
+
+  // Every bit before the cursor is used: start at the goal only if it is after it
+  if (goal < bmblock_array->cursor || goal > bmblock_array->max) goal = bmblock_array->cursor;
+
+  // First run of n free bits from the goal to the end, then from the cursor to the goal
+  uint64_t bestStart = 0;
+  uint64_t bestLength = 0;
+  bm_search_run(bmblock_array, goal, bmblock_array->max + 1, n, &bestStart, &bestLength);
+  bm_search_run(bmblock_array, bmblock_array->cursor, goal, n, &bestStart, &bestLength);
+  if (bestLength == 0) return ERR_BITMAP_FULL;
+
+  // Reserve the run, all of it or none
+  int set = bm_set_range(bmblock_array, bestStart, bestStart + bestLength - 1);
+  if (set != 0) {
+    bm_clear_range(bmblock_array, bestStart, bestStart + bestLength - 1);
+    return set;
+  }
+  *start = bestStart;
+  return (int) bestLength;
+}
+
+/*
+ * Thread-safe variant: every word is only changed by an atomic operation,
+ * and the cursor is only a hint. Without the GCC atomic builtins, these are
+ * the plain operations (and the functions are not thread-safe).
+ */
+#if defined(__GNUC__)
+#define BM_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define BM_CAS(p, expected, desired) \
+  __atomic_compare_exchange_n((p), (expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define BM_OR(p, bits) __atomic_fetch_or((p), (bits), __ATOMIC_ACQ_REL)
+#define BM_AND(p, bits) __atomic_fetch_and((p), (bits), __ATOMIC_ACQ_REL)
+#define BM_ADD(p, n) ((void) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED))
+#else
+static int bm_cas_plain(uint64_t *p, uint64_t *expected, uint64_t desired) {
+  if (*p != *expected) {
+    *expected = *p;
+    return 0;
+  }
+  *p = desired;
+  return 1;
+}
+static uint64_t bm_or_plain(uint64_t *p, uint64_t bits) { uint64_t old = *p; *p |= bits; return old; }
+static uint64_t bm_and_plain(uint64_t *p, uint64_t bits) { uint64_t old = *p; *p &= bits; return old; }
+#define BM_LOAD(p) (*(p))
+#define BM_CAS(p, expected, desired) bm_cas_plain((p), (expected), (desired))
+#define BM_OR(p, bits) bm_or_plain((p), (bits))
+#define BM_AND(p, bits) bm_and_plain((p), (bits))
+#define BM_ADD(p, n) ((void) (*(p) += (n)))
+#endif
+
+/**
+ * @brief take a full row out of the summary. Another thread may free a bit
+ *        of it meanwhile: every level is checked again once cleared, and
+ *        put back if it was wrong, since bm_release() frees the bit first
+ *        and fills the summary from the bottom up.
+ */
+static void bm_summary_retire(struct bmblock_array *bmblock_array, size_t row) {
+  size_t index = row;
+  for (int l = 0; l < BM_SUMMARY_LEVELS && bmblock_array->summary[l] != NULL; ++l) {
+    uint64_t *word = &bmblock_array->summary[l][index / BITS];
+    uint64_t bit = UINT64_C(1) << (index % BITS);
+    BM_AND(word, ~bit);
+
+    // What the bit stands for: the row itself, or a word of the level under
+    int empty = (l == 0) ? BM_LOAD(&bmblock_array->bm[index]) == UINT64_MAX
+                         : BM_LOAD(&bmblock_array->summary[l - 1][index]) == 0;
+    if (!empty) {
+      BM_OR(word, bit);
+      return;
+    }
+
+    // The level above only changes once the whole word is zero
+    if (BM_LOAD(word) != 0) return;
+    index /= BITS;
+  }
+}
+
+/**
+ * @brief claim, with a compare-and-swap, one unused bit of a row
+ * @param row the row
+ * @param mask the bits of the row that may be claimed
+ * @return the offset of the bit in the row, <0 if none of the mask is unused
+ */
+static int bm_claim_in_row(struct bmblock_array *bmblock_array, size_t row, uint64_t mask) {
+  uint64_t *word = &bmblock_array->bm[row];
+  uint64_t old = BM_LOAD(word);
+  uint64_t bits = ~old & mask;
+  while (bits != 0) {
+    uint64_t bit = bits & (~bits + 1);
+    // On failure old is the new value of the word: try again with it
+    if (BM_CAS(word, &old, old | bit)) {
+      BM_ADD(&bmblock_array->free_count, (uint64_t) -1);
+      if ((old | bit) == UINT64_MAX) bm_summary_retire(bmblock_array, row);
+      return bm_ctz(bit);
+    }
+    bits = ~old & mask;
+  }
+  return -1;
+}
+
+/**
+ * @brief claim the first unused bit between first and last (included)
+ * @return the value of the bit, > max if there is none
+ */
+static uint64_t bm_claim_between(struct bmblock_array *bmblock_array, uint64_t first, uint64_t last) {
+  if (first > last) return bmblock_array->max + 1;
+
+  size_t row = (first - bmblock_array->min) / BITS;
+  size_t lastRow = (last - bmblock_array->min) / BITS;
+  uint64_t mask = UINT64_MAX << ((first - bmblock_array->min) % BITS);
+  for (; row <= lastRow; ++row, mask = UINT64_MAX) {
+    // Skip the rows the summary knows to be full, 64 at a time when it can
+    if (bmblock_array->summary[0] != NULL) {
+      uint64_t summary = BM_LOAD(&bmblock_array->summary[0][row / BITS]) >> (row % BITS);
+      if (summary == 0) {
+        row = (row / BITS + 1) * BITS - 1;
+        continue;
       }
-      // Else got to the next row
-      bmblock_array->cursor += BITS;
-	  } else break; // If the row is not full, got to the next part to find which bit is available
+      if (!(summary & UINT64_C(1))) continue;
+    }
+
+    if (row == lastRow) mask &= UINT64_MAX >> (BITS - 1 - (last - bmblock_array->min) % BITS);
+    int bit = bm_claim_in_row(bmblock_array, row, mask & bm_row_mask(bmblock_array, row));
+    if (bit >= 0) return bmblock_array->min + row * BITS + bit;
+  }
+  return bmblock_array->max + 1;
+}
+
+int bm_claim_next(struct bmblock_array *bmblock_array) {
+  M_REQUIRE_NON_NULL(bmblock_array);
+  // The containers of a compressed array move: no lock-free claim there
+  if (bmblock_array->chunks != NULL) {
+    int x = bm_find_next(bmblock_array);
+    if (x < 0) return x;
+    int set = bm_set(bmblock_array, x);
+    return set != 0 ? set : x;
+  }
+
+  // From the cursor to the end, then from the beginning: the cursor is only a hint
+  uint64_t hint = BM_LOAD(&bmblock_array->cursor);
+  uint64_t start = (hint < bmblock_array->min || hint > bmblock_array->max) ? bmblock_array->min : hint;
+  uint64_t found = bm_claim_between(bmblock_array, start, bmblock_array->max);
+  if (found > bmblock_array->max && start > bmblock_array->min) {
+    found = bm_claim_between(bmblock_array, bmblock_array->min, start - 1);
+  }
+  if (found > bmblock_array->max) return ERR_BITMAP_FULL;
+
+  // Move the hint after the bit, unless another thread already moved it
+  (void) BM_CAS(&bmblock_array->cursor, &hint, found + 1);
+  return (int) found;
+}
+
+int bm_claim(struct bmblock_array *bmblock_array, uint64_t x) {
+  M_REQUIRE_NON_NULL(bmblock_array);
+  if (x < bmblock_array->min || bmblock_array->max < x) return ERR_BAD_PARAMETER;
+  if (bmblock_array->chunks != NULL) {
+    int used = bm_get(bmblock_array, x);
+    if (used != 0) return used < 0 ? used : 0;
+    int set = bm_set(bmblock_array, x);
+    return set != 0 ? set : 1;
   }
 
-  uint8_t curr_bit = 1;
+  size_t row = (x - bmblock_array->min) / BITS;
+  uint64_t bit = UINT64_C(1) << ((x - bmblock_array->min) % BITS);
+  return bm_claim_in_row(bmblock_array, row, bit) >= 0;
+}
+
+void bm_release(struct bmblock_array *bmblock_array, uint64_t x) {
+  if (bmblock_array == NULL || x < bmblock_array->min || bmblock_array->max < x) return;
+  if (bmblock_array->chunks != NULL) {
+    bm_clear(bmblock_array, x);
+    return;
+  }
+
+  size_t row = (x - bmblock_array->min) / BITS;
+  uint64_t bit = UINT64_C(1) << ((x - bmblock_array->min) % BITS);
+  // Free the bit first, then tell the summary from the bottom up
+  if (!(BM_AND(&bmblock_array->bm[row], ~bit) & bit)) return;
+  BM_ADD(&bmblock_array->free_count, 1);
+  size_t index = row;
+  for (int l = 0; l < BM_SUMMARY_LEVELS && bmblock_array->summary[l] != NULL; ++l) {
+    BM_OR(&bmblock_array->summary[l][index / BITS], UINT64_C(1) << (index % BITS));
+    index /= BITS;
+  }
 
-  do {
-    // Get the bit at the cursor position and move by 1
-    curr_bit = bm_get(bmblock_array, bmblock_array->cursor);
-    (bmblock_array->cursor)++;
-  } while(curr_bit != 0 && bmblock_array->cursor <= bmblock_array->max); // Until the bit = 0 or we are out of range (We normaly should never be out of range but we check anyways in case of a problem)
-  // Return either the bit we found or an error if we went out of range
-  return (curr_bit == 0) ? --(bmblock_array->cursor) : ERR_BITMAP_FULL; // --cursor because we moved by one when we read a bit
+  // Move the hint back if needed
+  uint64_t hint = BM_LOAD(&bmblock_array->cursor);
+  while (hint > x && !BM_CAS(&bmblock_array->cursor, &hint, x)) {}
 }
@@ -15,11 +15,26 @@
 extern "C" {
 #endif
 
+/* levels of summary above the bits, each one 64 times smaller than the one under it */
+#define BM_SUMMARY_LEVELS 2
+/* a level of summary is only added above at least that many words */
+#define BM_SUMMARY_MIN_WORDS 64
+/* arrays of at least that many values are compressed (see bmchunk.h) */
+#define BM_COMPRESSED_MIN_BITS (UINT64_C(1) << 20)
+
+struct bm_chunk;
+
 struct bmblock_array {
     size_t length;
     uint64_t cursor;
     uint64_t min;
     uint64_t max;
+    uint64_t free_count;                  /* number of unused bits between min and max */
+    uint64_t *summary[BM_SUMMARY_LEVELS]; /* summary[0]: one bit per row of bm, set if the row may have
+                                           * an unused bit; summary[1]: one bit per word of summary[0],
+                                           * set if the word may be non-zero. NULL when not needed */
+    struct bm_chunk *chunks;              /* compressed: one container per BM_CHUNK_BITS values, and
+                                           * no rows (length 0) nor summary. NULL for the flat rows */
     uint64_t bm[1];
 };
 
@@ -28,12 +43,21 @@ struct bmblock_array {
 /**
  * @brief allocate a new bmblock_array to handle elements indexed
  * between min and may (included, thus (max-min+1) elements).
+ * Every element starts unused. From BM_COMPRESSED_MIN_BITS elements on,
+ * the array is compressed; bm_set() and bm_clear() then need memory, and
+ * fail with ERR_NOMEM, leaving the bit as it was, when there is none left.
  * @param min the mininum value supported by our bmblock_array
  * @param max the maxinum value supported by our bmblock_array
  * @return a pointer of the newly created bmblock_array or NULL on failure
  */
 struct bmblock_array *bm_alloc(uint64_t min, uint64_t max);
 
+/**
+ * @brief release a bmblock_array and everything it allocated
+ * @param bmblock_array the array, may be NULL
+ */
+void bm_free(struct bmblock_array *bmblock_array);
+
 /**
  * @brief return the bit associated to the given value
  * @param bmblock_array the array containing the value we want to read
@@ -46,15 +70,58 @@ int bm_get(struct bmblock_array *bmblock_array, uint64_t x);
  * @brief set to true (or 1) the bit associated to the given value
  * @param bmblock_array the array containing the value we want to set
  * @param x an integer corresponding to the number of the value we are looking for
+ * @return 0 on success; <0 on error (ERR_NOMEM if a compressed array has no memory left)
  */
-void bm_set(struct bmblock_array *bmblock_array, uint64_t x);
+int bm_set(struct bmblock_array *bmblock_array, uint64_t x);
 
 /**
  * @brief set to false (or 0) the bit associated to the given value
  * @param bmblock_array the array containing the value we want to clear
  * @param x an integer corresponding to the number of the value we are looking for
+ * @return 0 on success; <0 on error (ERR_NOMEM if a compressed array has no memory left)
+ */
+int bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
+
+/**
+ * @brief set to true (or 1) every bit between first and last (included);
+ *        the values outside of the array are ignored
+ * @param bmblock_array the array containing the values we want to set
+ * @param first the first value to set
+ * @param last the last value to set
+ * @return 0 on success; ERR_NOMEM if a compressed array has no memory left
+ *         (the values before the one that failed are set)
+ */
+int bm_set_range(struct bmblock_array *bmblock_array, uint64_t first, uint64_t last);
+
+/**
+ * @brief set to false (or 0) every bit between first and last (included);
+ *        the values outside of the array are ignored
+ * @param bmblock_array the array containing the values we want to clear
+ * @param first the first value to clear
+ * @param last the last value to clear
+ * @return 0 on success; ERR_NOMEM if a compressed array has no memory left
+ *         (the values before the one that failed are cleared)
+ */
+int bm_clear_range(struct bmblock_array *bmblock_array, uint64_t first, uint64_t last);
+
+/**
+ * @brief count the unused bits by going through the whole array. The
+ *        same number is kept up to date in free_count, which is cheaper
+ *        to read: this is for checking it, or after changing the bits
+ *        without the functions of this file (see bm_rebuild())
+ * @param bmblock_array the array to count
+ * @return the number of unused bits between min and max
+ */
+uint64_t bm_count_free(const struct bmblock_array *bmblock_array);
+
+/**
+ * @brief find the first value at or after from whose bit is the given one
+ * @param bmblock_array the array to search
+ * @param from where to start
+ * @param value 0 to look for an unused value, 1 for a used one
+ * @return the value, max+1 if there is none
  */
-void bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
+uint64_t bm_find_value(struct bmblock_array *bmblock_array, uint64_t from, int value);
 
 /**
  * @brief return the next unused bit
@@ -63,6 +130,68 @@ void bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
  */
 int bm_find_next(struct bmblock_array *bmblock_array);
 
+/**
+ * @brief find n consecutive unused bits after the cursor and mark them
+ *        used; if there are none, the longest shorter run is used instead
+ * @param bmblock_array the array we want to search for place
+ * @param n the number of bits wanted (> 0)
+ * @param start the value of the first bit of the run (OUT)
+ * @return <0 on failure (ERR_BITMAP_FULL if no bit is unused), the length
+ *         of the run otherwise (between 1 and n)
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, size_t n, uint64_t *start);
+
+/**
+ * @brief same as bm_find_run(), but look from the given goal first: the
+ *        first run of n unused bits at or after it, else before it, else
+ *        the longest shorter run
+ * @param bmblock_array the array we want to search for place
+ * @param goal where the run should ideally start (the cursor if it is outside the array)
+ * @param n the number of bits wanted (> 0)
+ * @param start the value of the first bit of the run (OUT)
+ * @return <0 on failure (ERR_BITMAP_FULL if no bit is unused), the length
+ *         of the run otherwise (between 1 and n)
+ */
+int bm_find_run_near(struct bmblock_array *bmblock_array, uint64_t goal, size_t n, uint64_t *start);
+
+/**
+ * @brief recompute what is derived from the bits (the summary, the free
+ *        count and the cursor), after they were changed without bm_set()/bm_clear()
+ * @param bmblock_array the array whose bits were changed
+ */
+void bm_rebuild(struct bmblock_array *bmblock_array);
+
+/*
+ * Thread-safe variant: bm_claim_next(), bm_claim() and bm_release() may be
+ * called by any number of threads at once, and with bm_get(). Claiming a bit
+ * is a compare-and-swap on its word and the cursor is only a hint, so they
+ * never take a lock. They must not run at the same time as the other
+ * functions that change the array. On a compressed array they are the
+ * plain functions, and not thread-safe.
+ */
+
+/**
+ * @brief find an unused bit, from the cursor then from min, and mark it used
+ * @param bmblock_array the array we want to search for place
+ * @return <0 on failure (ERR_BITMAP_FULL if no bit is unused), the value of the bit otherwise
+ */
+int bm_claim_next(struct bmblock_array *bmblock_array);
+
+/**
+ * @brief mark the bit associated to the given value used, if it is not already
+ * @param bmblock_array the array containing the value we want to claim
+ * @param x the value
+ * @return <0 on failure, 1 if this call marked it used, 0 if it already was
+ */
+int bm_claim(struct bmblock_array *bmblock_array, uint64_t x);
+
+/**
+ * @brief mark the bit associated to the given value unused (same as bm_clear())
+ * @param bmblock_array the array containing the value we want to release
+ * @param x the value
+ */
+void bm_release(struct bmblock_array *bmblock_array, uint64_t x);
+
 /**
  * @brief usefull to see (and debug) content of a bmblock_array
  * @param bmblock_array the array we want to see
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bmchunk.h"
+#include "error.h"
+
+#define BITS 64
+// Words of a bitset container
+#define BITSET_WORDS (BM_CHUNK_BITS / BITS)
+
+/**
+ * @brief index of the lowest bit set in a word
+ * @param word the word, not 0
+ */
+static int chunk_ctz(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#else
+  int n = 0;
+  while (!(word & UINT64_C(1))) {
+    word >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+/**
+ * @brief number of bits set in a word
+ */
+static int chunk_popcount(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(word);
+#else
+  int n = 0;
+  for (; word != 0; word &= word - 1) ++n;
+  return n;
+#endif
+}
+
+void bm_chunk_init(struct bm_chunk *chunk, uint32_t span) {
+  if (chunk == NULL) return;
+  memset(chunk, 0, sizeof(*chunk));
+  chunk->kind = BM_CHUNK_ARRAY;
+  chunk->span = span;
+}
+
+void bm_chunk_free(struct bm_chunk *chunk) {
+  if (chunk == NULL) return;
+  free(chunk->data);
+  chunk->data = NULL;
+  chunk->size = 0;
+  chunk->capacity = 0;
+}
+
+/**
+ * @brief index of the first value of an array at least v
+ */
+static uint32_t array_lower(const uint16_t *values, uint32_t size, uint32_t v) {
+  uint32_t low = 0;
+  uint32_t high = size;
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (values[mid] < v) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+/**
+ * @brief index of the first run ending at v or after it
+ */
+static uint32_t run_lower(const struct bm_run *runs, uint32_t size, uint32_t v) {
+  uint32_t low = 0;
+  uint32_t high = size;
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (runs[mid].last < v) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+/**
+ * @brief set or clear the bits between first and last (included) of a bitset
+ * @return the number of bits that changed
+ */
+static uint32_t words_change_range(uint64_t *words, uint32_t first, uint32_t last, int value) {
+  uint32_t changed = 0;
+  for (uint32_t w = first / BITS; w <= last / BITS; ++w) {
+    uint64_t mask = UINT64_MAX;
+    if (w == first / BITS) mask &= UINT64_MAX << (first % BITS);
+    if (w == last / BITS) mask &= UINT64_MAX >> (BITS - 1 - last % BITS);
+    if (value) {
+      changed += chunk_popcount(mask & ~words[w]);
+      words[w] |= mask;
+    }
+    else {
+      changed += chunk_popcount(mask & words[w]);
+      words[w] &= ~mask;
+    }
+  }
+  return changed;
+}
+
+/**
+ * @brief a new bitset with the bits of a chunk
+ * @return the bitset, NULL if there is not enough memory
+ */
+static uint64_t *chunk_to_words(const struct bm_chunk *chunk) {
+  uint64_t *words = calloc(BITSET_WORDS, sizeof(uint64_t));
+  if (words == NULL) return NULL;
+
+  if (chunk->kind == BM_CHUNK_BITSET) {
+    memcpy(words, chunk->data, BITSET_WORDS * sizeof(uint64_t));
+  }
+  else if (chunk->kind == BM_CHUNK_ARRAY) {
+    const uint16_t *values = chunk->data;
+    for (uint32_t i = 0; i < chunk->size; ++i) words[values[i] / BITS] |= UINT64_C(1) << (values[i] % BITS);
+  }
+  else {
+    const struct bm_run *runs = chunk->data;
+    for (uint32_t i = 0; i < chunk->size; ++i) (void) words_change_range(words, runs[i].start, runs[i].last, 1);
+  }
+  return words;
+}
+
+/**
+ * @brief give a bitset to a chunk, whose card is already right, in the
+ *        smallest kind of container. Keeps the bitset if there is not
+ *        enough memory for another kind.
+ * @param words the bitset, owned by the chunk afterwards
+ */
+static void chunk_from_words(struct bm_chunk *chunk, uint64_t *words) {
+  free(chunk->data == words ? NULL : chunk->data);
+  chunk->data = words;
+  chunk->kind = BM_CHUNK_BITSET;
+  chunk->size = 0;
+  chunk->capacity = 0;
+
+  if (chunk->card == 0) {
+    free(words);
+    chunk->data = NULL;
+    chunk->kind = BM_CHUNK_ARRAY;
+    return;
+  }
+
+  // A run starts at every bit set whose previous bit is not
+  uint32_t nbRuns = 0;
+  uint64_t carry = 0;
+  for (uint32_t w = 0; w < BITSET_WORDS; ++w) {
+    nbRuns += chunk_popcount(words[w] & ~((words[w] << 1) | carry));
+    carry = words[w] >> (BITS - 1);
+  }
+
+  size_t arrayBytes = (size_t) chunk->card * sizeof(uint16_t);
+  size_t runBytes = (size_t) nbRuns * sizeof(struct bm_run);
+  size_t bitsetBytes = BITSET_WORDS * sizeof(uint64_t);
+
+  if (runBytes < bitsetBytes && runBytes <= arrayBytes) {
+    struct bm_run *runs = malloc(runBytes);
+    if (runs == NULL) return;
+    uint32_t n = 0;
+    uint32_t v = 0;
+    while (n < nbRuns) {
+      // Start at the next used value, end before the next unused one
+      while (!(words[v / BITS] >> (v % BITS) & 1)) ++v;
+      runs[n].start = (uint16_t) v;
+      while (v < BM_CHUNK_BITS && (words[v / BITS] >> (v % BITS) & 1)) ++v;
+      runs[n++].last = (uint16_t) (v - 1);
+    }
+    free(words);
+    chunk->data = runs;
+    chunk->kind = BM_CHUNK_RUN;
+    chunk->size = chunk->capacity = nbRuns;
+  }
+  else if (arrayBytes < bitsetBytes) {
+    uint16_t *values = malloc(arrayBytes);
+    if (values == NULL) return;
+    uint32_t n = 0;
+    for (uint32_t w = 0; w < BITSET_WORDS; ++w) {
+      for (uint64_t bits = words[w]; bits != 0; bits &= bits - 1) values[n++] = (uint16_t) (w * BITS + chunk_ctz(bits));
+    }
+    free(words);
+    chunk->data = values;
+    chunk->kind = BM_CHUNK_ARRAY;
+    chunk->size = chunk->capacity = n;
+  }
+}
+
+/**
+ * @brief turn a chunk into a bitset container
+ * @return 0 on success; <0 on error (then nothing changed)
+ */
+static int chunk_make_bitset(struct bm_chunk *chunk) {
+  uint64_t *words = chunk_to_words(chunk);
+  if (words == NULL) return ERR_NOMEM;
+  free(chunk->data);
+  chunk->data = words;
+  chunk->kind = BM_CHUNK_BITSET;
+  chunk->size = 0;
+  chunk->capacity = 0;
+  return 0;
+}
+
+/**
+ * @brief make room in data for one more element
+ * @param element the size of an element
+ * @return 0 on success; <0 on error
+ */
+static int chunk_grow(struct bm_chunk *chunk, size_t element) {
+  if (chunk->size < chunk->capacity) return 0;
+  uint32_t capacity = chunk->capacity < 4 ? 4 : chunk->capacity * 2;
+  void *data = realloc(chunk->data, capacity * element);
+  if (data == NULL) return ERR_NOMEM;
+  chunk->data = data;
+  chunk->capacity = capacity;
+  return 0;
+}
+
+int bm_chunk_get(const struct bm_chunk *chunk, uint32_t v) {
+  if (chunk->kind == BM_CHUNK_BITSET) {
+    const uint64_t *words = chunk->data;
+    return (int) (words[v / BITS] >> (v % BITS) & 1);
+  }
+  if (chunk->kind == BM_CHUNK_ARRAY) {
+    uint32_t i = array_lower(chunk->data, chunk->size, v);
+    return i < chunk->size && ((const uint16_t *) chunk->data)[i] == v;
+  }
+  const struct bm_run *runs = chunk->data;
+  uint32_t i = run_lower(runs, chunk->size, v);
+  return i < chunk->size && runs[i].start <= v;
+}
+
+/**
+ * @brief bm_chunk_change() for an array container
+ */
+static int array_change(struct bm_chunk *chunk, uint32_t v, int value) {
+  uint32_t i = array_lower(chunk->data, chunk->size, v);
+  if (value) {
+    if (chunk_grow(chunk, sizeof(uint16_t)) != 0) return ERR_NOMEM;
+    uint16_t *values = chunk->data;
+    memmove(&values[i + 1], &values[i], (chunk->size - i) * sizeof(uint16_t));
+    values[i] = (uint16_t) v;
+    ++chunk->size;
+  }
+  else {
+    uint16_t *values = chunk->data;
+    memmove(&values[i], &values[i + 1], (chunk->size - i - 1) * sizeof(uint16_t));
+    --chunk->size;
+  }
+  return 1;
+}
+
+/**
+ * @brief bm_chunk_change() for a run container, whose runs are never adjacent
+ */
+static int run_change(struct bm_chunk *chunk, uint32_t v, int value) {
+  // Only a new run or the split of one needs room
+  if (chunk_grow(chunk, sizeof(struct bm_run)) != 0) return ERR_NOMEM;
+  struct bm_run *runs = chunk->data;
+  uint32_t i = run_lower(runs, chunk->size, v);
+
+  if (value) {
+    int withPrevious = i > 0 && runs[i - 1].last + 1 == v;
+    int withNext = i < chunk->size && runs[i].start == v + 1;
+    if (withPrevious && withNext) {
+      // v joins two runs
+      runs[i - 1].last = runs[i].last;
+      memmove(&runs[i], &runs[i + 1], (chunk->size - i - 1) * sizeof(struct bm_run));
+      --chunk->size;
+    }
+    else if (withPrevious) runs[i - 1].last = (uint16_t) v;
+    else if (withNext) runs[i].start = (uint16_t) v;
+    else {
+      memmove(&runs[i + 1], &runs[i], (chunk->size - i) * sizeof(struct bm_run));
+      runs[i].start = runs[i].last = (uint16_t) v;
+      ++chunk->size;
+    }
+  }
+  else {
+    // v is in runs[i]
+    if (runs[i].start == v && runs[i].last == v) {
+      memmove(&runs[i], &runs[i + 1], (chunk->size - i - 1) * sizeof(struct bm_run));
+      --chunk->size;
+    }
+    else if (runs[i].start == v) ++runs[i].start;
+    else if (runs[i].last == v) --runs[i].last;
+    else {
+      memmove(&runs[i + 2], &runs[i + 1], (chunk->size - i - 1) * sizeof(struct bm_run));
+      runs[i + 1].start = (uint16_t) (v + 1);
+      runs[i + 1].last = runs[i].last;
+      runs[i].last = (uint16_t) (v - 1);
+      ++chunk->size;
+    }
+  }
+  return 1;
+}
+
+int bm_chunk_change(struct bm_chunk *chunk, uint32_t v, int value) {
+  M_REQUIRE_NON_NULL(chunk);
+  if (v >= chunk->span) return ERR_BAD_PARAMETER;
+  if (bm_chunk_get(chunk, v) == value) return 0;
+
+  // A full array or run container becomes a bitset first
+  if ((chunk->kind == BM_CHUNK_ARRAY && value && chunk->size >= BM_CHUNK_ARRAY_MAX)
+      || (chunk->kind == BM_CHUNK_RUN && chunk->size >= BM_CHUNK_RUNS_MAX)) {
+    int bitset = chunk_make_bitset(chunk);
+    if (bitset != 0) return bitset;
+  }
+
+  int changed = 1;
+  if (chunk->kind == BM_CHUNK_ARRAY) changed = array_change(chunk, v, value);
+  else if (chunk->kind == BM_CHUNK_RUN) changed = run_change(chunk, v, value);
+  else {
+    uint64_t *words = chunk->data;
+    words[v / BITS] ^= UINT64_C(1) << (v % BITS);
+  }
+  if (changed < 0) return changed;
+  chunk->card += value ? 1 : -1;
+
+  // A bitset that became full or sparse enough is smaller in another kind
+  if (chunk->kind == BM_CHUNK_BITSET && (chunk->card == chunk->span || chunk->card <= BM_CHUNK_ARRAY_MAX / 2)) {
+    chunk_from_words(chunk, chunk->data);
+  }
+  return 1;
+}
+
+int bm_chunk_change_range(struct bm_chunk *chunk, uint32_t first, uint32_t last, int value) {
+  M_REQUIRE_NON_NULL(chunk);
+  if (first > last || last >= chunk->span) return ERR_BAD_PARAMETER;
+
+  // Nothing to do on a chunk that already has the value everywhere
+  if ((value && chunk->card == chunk->span) || (!value && chunk->card == 0)) return 0;
+
+  // A word at a time on a copy of the bits, then choose the kind again
+  uint64_t *words = chunk_to_words(chunk);
+  if (words == NULL) return ERR_NOMEM;
+  uint32_t changed = words_change_range(words, first, last, value);
+  if (changed == 0) {
+    free(words);
+    return 0;
+  }
+  chunk->card = value ? chunk->card + changed : chunk->card - changed;
+  chunk_from_words(chunk, words);
+  return (int) changed;
+}
+
+uint32_t bm_chunk_next(const struct bm_chunk *chunk, uint32_t from, int value, uint32_t limit) {
+  if (limit > chunk->span) limit = chunk->span;
+  if (from >= limit) return limit;
+
+  uint32_t found = limit;
+  if (chunk->kind == BM_CHUNK_BITSET) {
+    // Words without the value are equal to skip
+    const uint64_t *words = chunk->data;
+    uint64_t skip = value ? 0 : UINT64_MAX;
+    uint32_t w = from / BITS;
+    uint64_t bits = (words[w] ^ skip) & (UINT64_MAX << (from % BITS));
+    while (bits == 0 && ++w < (limit + BITS - 1) / BITS) bits = words[w] ^ skip;
+    if (bits != 0) found = w * BITS + chunk_ctz(bits);
+  }
+  else if (chunk->kind == BM_CHUNK_ARRAY) {
+    const uint16_t *values = chunk->data;
+    uint32_t i = array_lower(values, chunk->size, from);
+    if (value) {
+      if (i < chunk->size) found = values[i];
+    }
+    else {
+      // The first hole in the used values from there
+      found = from;
+      while (i < chunk->size && values[i] == found) {
+        ++found;
+        ++i;
+      }
+    }
+  }
+  else {
+    const struct bm_run *runs = chunk->data;
+    uint32_t i = run_lower(runs, chunk->size, from);
+    int inside = i < chunk->size && runs[i].start <= from;
+    if (value) {
+      if (i < chunk->size) found = inside ? from : runs[i].start;
+    }
+    // Runs are never adjacent: the value after a run is unused
+    else found = inside ? (uint32_t) runs[i].last + 1 : from;
+  }
+  return found < limit ? found : limit;
+}
+
+size_t bm_chunk_bytes(const struct bm_chunk *chunk) {
+  if (chunk->kind == BM_CHUNK_BITSET) return BITSET_WORDS * sizeof(uint64_t);
+  if (chunk->kind == BM_CHUNK_ARRAY) return (size_t) chunk->capacity * sizeof(uint16_t);
+  return (size_t) chunk->capacity * sizeof(struct bm_run);
+}
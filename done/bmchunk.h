@@ -0,0 +1,105 @@
+#pragma once
+
+/**
+ * @file bmchunk.h
+ * @brief containers of a compressed bmblock_array: every chunk of
+ *        BM_CHUNK_BITS values keeps its used values in the smallest of an
+ *        array, a bitset or a list of runs
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* values in a chunk */
+#define BM_CHUNK_BITS 65536
+/* used values an array container holds at most (it is then as large as a bitset) */
+#define BM_CHUNK_ARRAY_MAX 4096
+/* runs a run container holds at most (same) */
+#define BM_CHUNK_RUNS_MAX 2048
+
+enum bm_chunk_kind {
+    BM_CHUNK_ARRAY,    /* sorted used values, for sparse chunks */
+    BM_CHUNK_BITSET,   /* one bit per value, for dense chunks */
+    BM_CHUNK_RUN       /* sorted runs of used values, for long allocated stretches */
+};
+
+struct bm_run {
+    uint16_t start;
+    uint16_t last;     /* included */
+};
+
+struct bm_chunk {
+    enum bm_chunk_kind kind;
+    uint32_t span;     /* values in the chunk (the last one of an array may be shorter) */
+    uint32_t card;     /* used values */
+    uint32_t size;     /* elements in data: values of an array, runs of a run container */
+    uint32_t capacity; /* elements data has room for */
+    void *data;        /* uint16_t values, BM_CHUNK_BITS/64 words or struct bm_run; NULL if empty */
+};
+
+/**
+ * @brief initialize an empty chunk (an array container without memory)
+ * @param chunk the chunk (OUT)
+ * @param span the number of values in the chunk (at most BM_CHUNK_BITS)
+ */
+void bm_chunk_init(struct bm_chunk *chunk, uint32_t span);
+
+/**
+ * @brief release the memory of a chunk
+ * @param chunk the chunk
+ */
+void bm_chunk_free(struct bm_chunk *chunk);
+
+/**
+ * @brief return the bit of a value
+ * @param chunk the chunk
+ * @param v the value, below span
+ * @return 1 if it is used, 0 otherwise
+ */
+int bm_chunk_get(const struct bm_chunk *chunk, uint32_t v);
+
+/**
+ * @brief set or clear the bit of a value, changing the kind of the
+ *        container if another one becomes smaller
+ * @param chunk the chunk
+ * @param v the value, below span
+ * @param value 1 to mark it used, 0 unused
+ * @return 1 if the bit changed, 0 if it already had the value; <0 on error (then nothing changed)
+ */
+int bm_chunk_change(struct bm_chunk *chunk, uint32_t v, int value);
+
+/**
+ * @brief set or clear the bits of the values between first and last
+ *        (included), then use the smallest kind of container
+ * @param chunk the chunk
+ * @param first the first value
+ * @param last the last value, below span
+ * @param value 1 to mark them used, 0 unused
+ * @return the number of bits that changed; <0 on error (then nothing changed)
+ */
+int bm_chunk_change_range(struct bm_chunk *chunk, uint32_t first, uint32_t last, int value);
+
+/**
+ * @brief find the first value at or after from whose bit is value
+ * @param chunk the chunk
+ * @param from where to start
+ * @param value 0 to look for an unused value, 1 for a used one
+ * @param limit where to stop (excluded, at most span)
+ * @return the value, limit if there is none
+ */
+uint32_t bm_chunk_next(const struct bm_chunk *chunk, uint32_t from, int value, uint32_t limit);
+
+/**
+ * @brief the memory used by the container of a chunk
+ * @param chunk the chunk
+ * @return the number of bytes of data
+ */
+size_t bm_chunk_bytes(const struct bm_chunk *chunk);
+
+#ifdef __cplusplus
+}
+#endif
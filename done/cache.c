@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "cache.h"
+
+/**
+ * @brief find the bucket of a sector in the hash table
+ */
+static size_t cache_bucket(const struct sector_cache *c, uint32_t sector) {
+  // nbuckets is a power of 2
+  return sector & (c->nbuckets - 1);
+}
+
+/**
+ * @brief remove an entry from the LRU list
+ */
+static void cache_unlink(struct sector_cache *c, struct cache_entry *e) {
+  if (e->prev != NULL) e->prev->next = e->next;
+  else c->head = e->next;
+  if (e->next != NULL) e->next->prev = e->prev;
+  else c->tail = e->prev;
+  e->prev = NULL;
+  e->next = NULL;
+}
+
+/**
+ * @brief put an entry at the head (most recently used) of the LRU list
+ */
+static void cache_push_front(struct sector_cache *c, struct cache_entry *e) {
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head != NULL) c->head->prev = e;
+  c->head = e;
+  if (c->tail == NULL) c->tail = e;
+}
+
+/**
+ * @brief remove an entry from its hash bucket
+ */
+static void cache_unhash(struct sector_cache *c, struct cache_entry *e) {
+  struct cache_entry **link = &c->buckets[cache_bucket(c, e->sector)];
+  while (*link != NULL && *link != e) link = &(*link)->hnext;
+  if (*link == e) *link = e->hnext;
+  e->hnext = NULL;
+}
+
+/**
+ * @brief find the entry holding a sector, NULL if there is none
+ */
+static struct cache_entry *cache_find(const struct sector_cache *c, uint32_t sector) {
+  struct cache_entry *e = c->buckets[cache_bucket(c, sector)];
+  while (e != NULL && e->sector != sector) e = e->hnext;
+  return e;
+}
+
+struct sector_cache *cache_alloc(size_t capacity) {
+  // Check parameters
+  if (capacity == 0) return NULL;
+
+  struct sector_cache *c = calloc(1, sizeof(struct sector_cache));
+  if (c == NULL) return NULL;
+
+  // Use at least as many buckets as entries, rounded up to a power of 2
+  c->nbuckets = 1;
+  while (c->nbuckets < capacity) c->nbuckets <<= 1;
+
+  c->buckets = calloc(c->nbuckets, sizeof(struct cache_entry *));
+  c->entries = calloc(capacity, sizeof(struct cache_entry));
+  c->order = calloc(capacity, sizeof(struct cache_entry *));
+  if (c->buckets == NULL || c->entries == NULL || c->order == NULL) {
+    cache_free(c);
+    return NULL;
+  }
+  c->capacity = capacity;
+  return c;
+}
+
+void cache_free(struct sector_cache *c) {
+  if (c == NULL) return;
+  free(c->buckets);
+  free(c->entries);
+  free(c->order);
+  free(c);
+}
+
+int cache_read(struct sector_cache *c, uint32_t sector, void *data) {
+  struct cache_entry *e = cache_find(c, sector);
+  if (e == NULL) {
+    ++c->misses;
+    return 0;
+  }
+  ++c->hits;
+
+  // The entry becomes the most recently used one
+  if (c->head != e) {
+    cache_unlink(c, e);
+    cache_push_front(c, e);
+  }
+  memcpy(data, e->data, SECTOR_SIZE);
+  return 1;
+}
+
+/**
+ * @brief find the entry for a sector, or take one for it: a never used
+ *        entry, or else the least recently used clean entry
+ * @return the entry, unlinked from the LRU list; NULL if every entry is dirty
+ */
+static struct cache_entry *cache_put(struct sector_cache *c, uint32_t sector) {
+  struct cache_entry *e = cache_find(c, sector);
+
+  if (e != NULL) {
+    // Already cached: the caller only refreshes the content and the LRU position
+    cache_unlink(c, e);
+    return e;
+  }
+
+  if (c->used < c->capacity) {
+    // Take a never used entry
+    e = &c->entries[c->used++];
+  }
+  else {
+    // Evict the least recently used entry that doesn't need to be written
+    e = c->tail;
+    while (e != NULL && e->dirty) e = e->prev;
+    if (e == NULL) return NULL;
+    cache_unlink(c, e);
+    cache_unhash(c, e);
+    ++c->evictions;
+  }
+  e->sector = sector;
+  e->dirty = 0;
+  e->hnext = c->buckets[cache_bucket(c, sector)];
+  c->buckets[cache_bucket(c, sector)] = e;
+  return e;
+}
+
+void cache_store(struct sector_cache *c, uint32_t sector, const void *data) {
+  // A dirty entry is newer than the disk, whatever was read before it was written
+  struct cache_entry *e = cache_find(c, sector);
+  if (e != NULL && e->dirty) return;
+
+  e = cache_put(c, sector);
+  if (e == NULL) return;
+
+  memcpy(e->data, data, SECTOR_SIZE);
+  cache_push_front(c, e);
+}
+
+int cache_write(struct sector_cache *c, uint32_t sector, const void *data) {
+  struct cache_entry *e = cache_put(c, sector);
+  if (e == NULL) return 0;
+
+  // A second write before the flush costs nothing on the disk
+  if (e->dirty) ++c->absorbed;
+  else {
+    e->dirty = 1;
+    ++c->dirty;
+  }
+  memcpy(e->data, data, SECTOR_SIZE);
+  cache_push_front(c, e);
+  return 1;
+}
+
+/**
+ * @brief compare two entries by sector number, for qsort()
+ */
+static int cache_entry_cmp(const void *a, const void *b) {
+  uint32_t x = (*(struct cache_entry * const *) a)->sector;
+  uint32_t y = (*(struct cache_entry * const *) b)->sector;
+  return (x > y) - (x < y);
+}
+
+int cache_flush(struct sector_cache *c, cache_writer write, void *arg) {
+  if (c->dirty == 0) return 0;
+
+  // Collect the dirty entries and sort them so that the disk is written in order
+  size_t n = 0;
+  for (size_t i = 0; i < c->used; ++i) {
+    if (c->entries[i].dirty) c->order[n++] = &c->entries[i];
+  }
+  qsort(c->order, n, sizeof(struct cache_entry *), cache_entry_cmp);
+
+  for (size_t i = 0; i < n; ++i) {
+    int written = write(arg, c->order[i]->sector, c->order[i]->data);
+    if (written != 0) return written;
+    c->order[i]->dirty = 0;
+    --c->dirty;
+    ++c->flushed;
+  }
+  return 0;
+}
+
+void cache_invalidate(struct sector_cache *c, uint32_t sector) {
+  struct cache_entry *e = cache_find(c, sector);
+  if (e == NULL) return;
+
+  cache_unlink(c, e);
+  cache_unhash(c, e);
+  if (e->dirty) --c->dirty;
+
+  // Keep the used entries packed at the beginning of the array
+  struct cache_entry *last = &c->entries[--c->used];
+  if (e != last) {
+    int wasHead = (c->head == last);
+    int wasTail = (c->tail == last);
+    cache_unhash(c, last);
+    *e = *last;
+    // Fix the pointers that referenced the moved entry
+    if (e->prev != NULL) e->prev->next = e;
+    if (e->next != NULL) e->next->prev = e;
+    if (wasHead) c->head = e;
+    if (wasTail) c->tail = e;
+    e->hnext = c->buckets[cache_bucket(c, e->sector)];
+    c->buckets[cache_bucket(c, e->sector)] = e;
+  }
+}
+
+void cache_print_stats(const struct sector_cache *c) {
+  printf("**********SECTOR CACHE START**********\n");
+  if (c == NULL) {
+    printf("disabled\n");
+  }
+  else {
+    printf("capacity: %zu\n", c->capacity);
+    printf("used: %zu\n", c->used);
+    printf("hits: %" PRIu64 "\n", c->hits);
+    printf("misses: %" PRIu64 "\n", c->misses);
+    printf("evictions: %" PRIu64 "\n", c->evictions);
+    printf("dirty: %zu\n", c->dirty);
+    printf("absorbed writes: %" PRIu64 "\n", c->absorbed);
+    printf("flushed: %" PRIu64 "\n", c->flushed);
+  }
+  printf("**********SECTOR CACHE END************\n");
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+/**
+ * @file cache.h
+ * @brief LRU cache of 512-byte sectors, shared by every layer of a mount.
+ *
+ * Entries live in a fixed array allocated once by cache_alloc(); a hash
+ * table finds them by sector number and a doubly linked list keeps them
+ * ordered from most to least recently used.
+ *
+ * In write-back mode, cache_write() only marks the entry dirty; dirty
+ * entries are never evicted and reach the disk through cache_flush().
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "unixv6fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cache_entry {
+    uint32_t sector;                 // sector number on disk
+    struct cache_entry *prev;        // LRU list, towards the most recently used
+    struct cache_entry *next;        // LRU list, towards the least recently used
+    struct cache_entry *hnext;       // next entry in the same hash bucket
+    int dirty;                       // 1 if data is newer than the disk
+    uint8_t data[SECTOR_SIZE];       // copy of the sector content
+};
+
+struct sector_cache {
+    size_t capacity;                 // number of entries
+    size_t used;                     // number of valid entries
+    size_t nbuckets;                 // size of the hash table (power of 2)
+    struct cache_entry **buckets;    // hash table
+    struct cache_entry *entries;     // all the entries
+    struct cache_entry *head;        // most recently used entry
+    struct cache_entry *tail;        // least recently used entry
+    struct cache_entry **order;      // scratch array used to sort the dirty entries
+    size_t dirty;                    // number of dirty entries
+    size_t dirty_limit;              // write-back: sector_write() flushes at that many dirty entries, 0 to write through
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t absorbed;               // writes to an already dirty entry
+    uint64_t flushed;                // dirty entries written by cache_flush()
+};
+
+/**
+ * @brief write one sector to the disk, used by cache_flush()
+ * @param arg the argument given to cache_flush()
+ * @param sector the sector number
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+typedef int (*cache_writer)(void *arg, uint32_t sector, const void *data);
+
+/**
+ * @brief allocate a new cache able to hold capacity sectors
+ * @param capacity the number of sectors kept in memory (must be >0)
+ * @return a pointer to the newly created cache or NULL on failure
+ */
+struct sector_cache *cache_alloc(size_t capacity);
+
+/**
+ * @brief release all the memory used by a cache
+ * @param c the cache (may be NULL)
+ */
+void cache_free(struct sector_cache *c);
+
+/**
+ * @brief copy a sector from the cache if it is present
+ * @param c the cache
+ * @param sector the sector number
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 1 on hit; 0 on miss
+ */
+int cache_read(struct sector_cache *c, uint32_t sector, void *data);
+
+/**
+ * @brief store (or update) a sector in the cache, evicting the least
+ *        recently used clean entry if the cache is full. Nothing is stored
+ *        if every entry is dirty, nor if the entry of the sector is dirty:
+ *        it is newer than what was read from the disk.
+ * @param c the cache
+ * @param sector the sector number
+ * @param data a pointer to 512-bytes of memory (IN)
+ */
+void cache_store(struct sector_cache *c, uint32_t sector, const void *data);
+
+/**
+ * @brief store a sector in the cache and mark it dirty, instead of writing
+ *        it to the disk
+ * @param c the cache
+ * @param sector the sector number
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 1 on success; 0 if every entry is dirty (flush first)
+ */
+int cache_write(struct sector_cache *c, uint32_t sector, const void *data);
+
+/**
+ * @brief write every dirty entry with the given function, in ascending
+ *        sector order, and mark them clean
+ * @param c the cache
+ * @param write the function writing one sector
+ * @param arg the first argument given to write
+ * @return 0 on success; the first error returned by write (the entries
+ *         not written yet stay dirty)
+ */
+int cache_flush(struct sector_cache *c, cache_writer write, void *arg);
+
+/**
+ * @brief forget a sector, if it is in the cache (even if it is dirty)
+ * @param c the cache
+ * @param sector the sector number
+ */
+void cache_invalidate(struct sector_cache *c, uint32_t sector);
+
+/**
+ * @brief print to stdout the counters of the cache
+ * @param c the cache
+ */
+void cache_print_stats(const struct sector_cache *c);
+
+#ifdef __cplusplus
+}
+#endif
@@ -29,7 +29,10 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
   if (openFile < 0) {return openFile;}
   
   // If the inode doesn't correpond to a directory, error
-  if (!((d->fv6.i_node).i_mode & IALLOC) || !((d->fv6.i_node).i_mode & IFDIR)) {return ERR_INVALID_DIRECTORY_INODE;}
+  if (!((d->fv6.i_node).i_mode & IALLOC) || !((d->fv6.i_node).i_mode & IFDIR)) {
+    filev6_close(u, &(d->fv6));
+    return ERR_INVALID_DIRECTORY_INODE;
+  }
   // Initialize cur and last at the beggining
   d->cur = 0;
   d->last = 0;
@@ -53,11 +56,13 @@ int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr
   // If we've reached the end of a sector
   if (d->cur == d->last) {
 	// Create a array of direntv6 to store all dirs/files of the next sector
-    struct direntv6 data[SECTOR_SIZE / sizeof(struct direntv6)];
-    // Try to read the next sector
-    blockRead = filev6_readblock(&(d->fv6), data);
+    struct direntv6 buf[SECTOR_SIZE / sizeof(struct direntv6)];
+    const void *sectorData = NULL;
+    // Try to read the next sector (in place when the disk is mapped)
+    blockRead = filev6_readblock_ref(&(d->fv6), buf, &sectorData);
     // If error or end of file, return error or 0
     if (blockRead <= 0) {return blockRead;}
+    const struct direntv6 *data = sectorData;
 	// Go through each direntv6 in our array and copy their values to d->dirs
 	size_t max_i = blockRead/sizeof(struct direntv6);
     for (int i = 0; i < max_i; ++i) {
@@ -84,6 +89,11 @@ int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr
   return 1;
 }
 
+int direntv6_closedir(struct directory_reader *d) {
+  M_REQUIRE_NON_NULL(d);
+  return filev6_close(d->fv6.u, &(d->fv6));
+}
+
 /**
  * @brief debugging routine; print the a subtree (note: recursive)
  * @param u a mounted filesystem
@@ -126,7 +136,7 @@ int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const cha
 	// Try to read a child of the current dir
     tryRead = direntv6_readdir(&dir, name, &nextChild);
 	// If we can't, return error code (either error or no more child)
-    if(tryRead <= 0) return tryRead;
+    if(tryRead <= 0) {direntv6_closedir(&dir); return tryRead;}
     
     // Write into toPrint the next prefix name = prefix/name
     char toPrint[MAXPATHLEN_UV6+1];
@@ -137,7 +147,7 @@ int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const cha
     // Try to recurse on the current child
     int tryRecurs = direntv6_print_tree(u, nextChild, toPrint);
     // Return errors from print_tree
-    if(tryRecurs != 0) return tryRecurs;
+    if(tryRecurs != 0) {direntv6_closedir(&dir); return tryRecurs;}
 
   } while(tryRead == 1);
 
@@ -181,10 +191,11 @@ int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const cha
 		int found = 0;
 		do{
 			tryRead = direntv6_readdir(&dir, name, &nextChild);
-			if(tryRead < 0){return tryRead;}
+			if(tryRead < 0){direntv6_closedir(&dir); return tryRead;}
 			if (strncmp(name, entry, sizeToCompare) == 0) found = 1;
 
 		} while(tryRead == 1 && found == 0);
+		direntv6_closedir(&dir);
 
 		if (found == 0) return ERR_INODE_OUTOF_RANGE;
 
@@ -263,7 +274,7 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
   // Write the inode
   int tryWrite = inode_write(u, allocatedInr, &inode);
   if (tryWrite != 0) {
-    bm_clear(u->ibm, allocatedInr);
+    bm_release(u->ibm, allocatedInr);
     return tryWrite;
   }
   
@@ -280,7 +291,11 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
 
   // Write the child dirent in the parent filev6
   int writebytes = filev6_writebytes(u, &fv6, &direntChild, sizeof(direntChild));
+  filev6_close(u, &fv6);
   if (writebytes < 0) return writebytes;
+
+  // The first sector of the child will go near its directory
+  filev6_place(u, allocatedInr, mode, &fv6);
   
   return 0;
 }
@@ -42,6 +42,13 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
  */
 int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr);
 
+/**
+ * @brief close a directory reader opened by direntv6_opendir()
+ * @param d the directory reader
+ * @return 0 on success; <0 on errror
+ */
+int direntv6_closedir(struct directory_reader *d);
+
 /**
  * @brief debugging routine; print the a subtree (note: recursive)
  * @param u a mounted filesystem
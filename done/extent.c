@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include "extent.h"
+#include "error.h"
+
+/**
+ * @brief tell if an extent comes before another one in a treap
+ */
+static int extent_before(int tree, const struct extent *a, const struct extent *b) {
+  if (tree == EXTENT_BY_LENGTH && a->length != b->length) return a->length < b->length;
+  return a->start < b->start;
+}
+
+/**
+ * @brief recompute the longest extent of a subtree ordered by start
+ */
+static void extent_update(int tree, struct extent *e) {
+  if (tree != EXTENT_BY_START) return;
+  e->max_length = e->length;
+  for (int side = 0; side < 2; ++side) {
+    const struct extent *child = e->child[tree][side];
+    if (child != NULL && child->max_length > e->max_length) e->max_length = child->max_length;
+  }
+}
+
+/**
+ * @brief split a treap in the extents before key and the others
+ */
+static void extent_split(int tree, struct extent *root, const struct extent *key, struct extent **left, struct extent **right) {
+  if (root == NULL) {
+    *left = *right = NULL;
+    return;
+  }
+  if (extent_before(tree, root, key)) {
+    extent_split(tree, root->child[tree][1], key, &root->child[tree][1], right);
+    *left = root;
+  }
+  else {
+    extent_split(tree, root->child[tree][0], key, left, &root->child[tree][0]);
+    *right = root;
+  }
+  extent_update(tree, root);
+}
+
+/**
+ * @brief join two treaps, every extent of a coming before those of b
+ */
+static struct extent *extent_merge(int tree, struct extent *a, struct extent *b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->priority > b->priority) {
+    a->child[tree][1] = extent_merge(tree, a->child[tree][1], b);
+    extent_update(tree, a);
+    return a;
+  }
+  b->child[tree][0] = extent_merge(tree, a, b->child[tree][0]);
+  extent_update(tree, b);
+  return b;
+}
+
+/**
+ * @brief add an extent to a treap
+ * @return the new root
+ */
+static struct extent *extent_insert(int tree, struct extent *root, struct extent *e) {
+  if (root == NULL || e->priority > root->priority) {
+    // e goes here, with everything before it on its left
+    extent_split(tree, root, e, &e->child[tree][0], &e->child[tree][1]);
+    extent_update(tree, e);
+    return e;
+  }
+  int side = !extent_before(tree, e, root);
+  root->child[tree][side] = extent_insert(tree, root->child[tree][side], e);
+  extent_update(tree, root);
+  return root;
+}
+
+/**
+ * @brief take an extent out of a treap
+ * @return the new root
+ */
+static struct extent *extent_remove(int tree, struct extent *root, struct extent *e) {
+  if (root == e) return extent_merge(tree, e->child[tree][0], e->child[tree][1]);
+  int side = !extent_before(tree, e, root);
+  root->child[tree][side] = extent_remove(tree, root->child[tree][side], e);
+  extent_update(tree, root);
+  return root;
+}
+
+/**
+ * @brief put an extent in both treaps
+ */
+static void extent_link(struct extent_index *index, struct extent *e) {
+  for (int tree = 0; tree < 2; ++tree) index->root[tree] = extent_insert(tree, index->root[tree], e);
+}
+
+/**
+ * @brief take an extent out of both treaps, before its start or length changes
+ */
+static void extent_unlink(struct extent_index *index, struct extent *e) {
+  for (int tree = 0; tree < 2; ++tree) index->root[tree] = extent_remove(tree, index->root[tree], e);
+}
+
+/**
+ * @brief a new extent, not linked yet
+ * @return the extent, NULL if there is not enough memory
+ */
+static struct extent *extent_new(struct extent_index *index, uint64_t start, uint64_t length) {
+  struct extent *e = calloc(1, sizeof(struct extent));
+  if (e == NULL) return NULL;
+  e->start = start;
+  e->length = length;
+  e->max_length = length;
+  index->seed = index->seed * 1103515245u + 12345u;
+  e->priority = index->seed;
+  return e;
+}
+
+/**
+ * @brief the last extent starting at x or before it
+ * @return the extent, NULL if there is none
+ */
+static struct extent *extent_at_or_before(const struct extent_index *index, uint64_t x) {
+  struct extent *found = NULL;
+  struct extent *e = index->root[EXTENT_BY_START];
+  while (e != NULL) {
+    if (e->start <= x) {
+      found = e;
+      e = e->child[EXTENT_BY_START][1];
+    }
+    else e = e->child[EXTENT_BY_START][0];
+  }
+  return found;
+}
+
+/**
+ * @brief the first extent starting after x
+ * @return the extent, NULL if there is none
+ */
+static struct extent *extent_after(const struct extent_index *index, uint64_t x) {
+  struct extent *found = NULL;
+  struct extent *e = index->root[EXTENT_BY_START];
+  while (e != NULL) {
+    if (e->start > x) {
+      found = e;
+      e = e->child[EXTENT_BY_START][0];
+    }
+    else e = e->child[EXTENT_BY_START][1];
+  }
+  return found;
+}
+
+struct extent_index *extent_index_build(struct bmblock_array *bm) {
+  if (bm == NULL) return NULL;
+  struct extent_index *index = calloc(1, sizeof(struct extent_index));
+  if (index == NULL) return NULL;
+  index->seed = 12345;
+
+  // Every run of unused values
+  uint64_t x = bm->min;
+  while (x <= bm->max) {
+    uint64_t start = bm_find_value(bm, x, 0);
+    if (start > bm->max) break;
+    uint64_t end = bm_find_value(bm, start, 1);
+
+    struct extent *e = extent_new(index, start, end - start);
+    if (e == NULL) {
+      extent_index_free(index);
+      return NULL;
+    }
+    extent_link(index, e);
+    ++index->count;
+    index->free += end - start;
+    x = end;
+  }
+  return index;
+}
+
+/**
+ * @brief free a subtree, ordered by start
+ */
+static void extent_free_tree(struct extent *e) {
+  if (e == NULL) return;
+  extent_free_tree(e->child[EXTENT_BY_START][0]);
+  extent_free_tree(e->child[EXTENT_BY_START][1]);
+  free(e);
+}
+
+void extent_index_free(struct extent_index *index) {
+  if (index == NULL) return;
+  extent_free_tree(index->root[EXTENT_BY_START]);
+  free(index);
+}
+
+int extent_take(struct extent_index *index, uint64_t first, uint64_t count) {
+  M_REQUIRE_NON_NULL(index);
+  if (count == 0) return 0;
+
+  // The values must all be in one extent
+  struct extent *e = extent_at_or_before(index, first);
+  if (e == NULL || first + count > e->start + e->length) return ERR_BAD_PARAMETER;
+
+  uint64_t end = e->start + e->length;
+  if (e->start == first && end == first + count) {
+    // The whole extent
+    extent_unlink(index, e);
+    free(e);
+    --index->count;
+  }
+  else if (e->start == first || end == first + count) {
+    // Its beginning or its end
+    extent_unlink(index, e);
+    if (e->start == first) e->start += count;
+    e->length -= count;
+    extent_link(index, e);
+  }
+  else {
+    // Its middle: the end becomes another extent
+    struct extent *tail = extent_new(index, first + count, end - first - count);
+    if (tail == NULL) return ERR_NOMEM;
+    extent_unlink(index, e);
+    e->length = first - e->start;
+    extent_link(index, e);
+    extent_link(index, tail);
+    ++index->count;
+  }
+  index->free -= count;
+  return 0;
+}
+
+int extent_give(struct extent_index *index, uint64_t first, uint64_t count) {
+  M_REQUIRE_NON_NULL(index);
+  if (count == 0) return 0;
+
+  // None of the values may already be free
+  struct extent *previous = extent_at_or_before(index, first);
+  struct extent *next = extent_after(index, first);
+  if (previous != NULL && previous->start + previous->length > first) return ERR_BAD_PARAMETER;
+  if (next != NULL && next->start < first + count) return ERR_BAD_PARAMETER;
+
+  int withPrevious = previous != NULL && previous->start + previous->length == first;
+  int withNext = next != NULL && next->start == first + count;
+  if (withPrevious && withNext) {
+    // The values join two extents
+    extent_unlink(index, previous);
+    extent_unlink(index, next);
+    previous->length += count + next->length;
+    free(next);
+    extent_link(index, previous);
+    --index->count;
+  }
+  else if (withPrevious) {
+    extent_unlink(index, previous);
+    previous->length += count;
+    extent_link(index, previous);
+  }
+  else if (withNext) {
+    extent_unlink(index, next);
+    next->start = first;
+    next->length += count;
+    extent_link(index, next);
+  }
+  else {
+    struct extent *e = extent_new(index, first, count);
+    if (e == NULL) return ERR_NOMEM;
+    extent_link(index, e);
+    ++index->count;
+  }
+  index->free += count;
+  return 0;
+}
+
+int extent_best_fit(const struct extent_index *index, uint64_t n, uint64_t *start, uint64_t *length) {
+  M_REQUIRE_NON_NULL(index);
+  M_REQUIRE_NON_NULL(start);
+  M_REQUIRE_NON_NULL(length);
+
+  // The first extent, ordered by length then start, of at least n values
+  const struct extent *found = NULL;
+  const struct extent *e = index->root[EXTENT_BY_LENGTH];
+  while (e != NULL) {
+    if (e->length >= n) {
+      found = e;
+      e = e->child[EXTENT_BY_LENGTH][0];
+    }
+    else e = e->child[EXTENT_BY_LENGTH][1];
+  }
+  if (found == NULL) return ERR_BITMAP_FULL;
+
+  *start = found->start;
+  *length = found->length;
+  return 0;
+}
+
+/**
+ * @brief the first extent of a subtree starting after a value with at least n values
+ * @return the extent, NULL if there is none
+ */
+static const struct extent *extent_first_fit(const struct extent *e, uint64_t after, uint64_t n) {
+  // Nothing long enough down there
+  if (e == NULL || e->max_length < n) return NULL;
+
+  if (e->start > after) {
+    const struct extent *left = extent_first_fit(e->child[EXTENT_BY_START][0], after, n);
+    if (left != NULL) return left;
+    if (e->length >= n) return e;
+  }
+  return extent_first_fit(e->child[EXTENT_BY_START][1], after, n);
+}
+
+int extent_next_fit(const struct extent_index *index, uint64_t goal, uint64_t n, uint64_t *start) {
+  M_REQUIRE_NON_NULL(index);
+  M_REQUIRE_NON_NULL(start);
+
+  // Right at the goal, if it is free and enough values follow it
+  const struct extent *e = extent_at_or_before(index, goal);
+  if (e != NULL && e->start + e->length >= goal + n) {
+    *start = goal;
+    return 0;
+  }
+
+  e = extent_first_fit(index->root[EXTENT_BY_START], goal, n);
+  if (e == NULL) return ERR_BITMAP_FULL;
+  *start = e->start;
+  return 0;
+}
+
+int extent_largest(const struct extent_index *index, uint64_t *start, uint64_t *length) {
+  M_REQUIRE_NON_NULL(index);
+  M_REQUIRE_NON_NULL(start);
+  M_REQUIRE_NON_NULL(length);
+
+  const struct extent *e = index->root[EXTENT_BY_START];
+  if (e == NULL) return ERR_BITMAP_FULL;
+
+  // Go down towards the lowest extent of the longest length
+  uint64_t longest = e->max_length;
+  while (e->length != longest || (e->child[EXTENT_BY_START][0] != NULL
+                                  && e->child[EXTENT_BY_START][0]->max_length == longest)) {
+    const struct extent *left = e->child[EXTENT_BY_START][0];
+    e = (left != NULL && left->max_length == longest) ? left : e->child[EXTENT_BY_START][1];
+  }
+  *start = e->start;
+  *length = e->length;
+  return 0;
+}
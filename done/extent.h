@@ -0,0 +1,109 @@
+#pragma once
+
+/**
+ * @file extent.h
+ * @brief index of the free extents of a bitmap, ordered by start and by length
+ *
+ * Every free extent (maximal run of unused values) is one node, linked in
+ * two treaps: one ordered by start, where every node also knows the longest
+ * extent of its subtree, and one ordered by length, then start. Finding the
+ * smallest extent of at least n values, or the first one after a position,
+ * takes logarithmic time; so does every change.
+ *
+ * The index is not kept in step with the bitmap by itself: whoever marks
+ * values used or unused in the bitmap calls extent_take() or extent_give().
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "bmblock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EXTENT_BY_START 0
+#define EXTENT_BY_LENGTH 1
+
+struct extent {
+    uint64_t start;
+    uint64_t length;
+    uint32_t priority;               // heap order of both treaps
+    uint64_t max_length;             // longest extent of its subtree, ordered by start
+    struct extent *child[2][2];      // [EXTENT_BY_START or EXTENT_BY_LENGTH][left or right]
+};
+
+struct extent_index {
+    struct extent *root[2];          // [EXTENT_BY_START or EXTENT_BY_LENGTH]
+    size_t count;                    // number of extents
+    uint64_t free;                   // sum of their lengths
+    uint32_t seed;                   // of the priorities
+};
+
+/**
+ * @brief build the index of the unused values of a bitmap
+ * @param bm the bitmap
+ * @return the index, NULL if there is not enough memory
+ */
+struct extent_index *extent_index_build(struct bmblock_array *bm);
+
+/**
+ * @brief release an index and all its extents
+ * @param index the index, may be NULL
+ */
+void extent_index_free(struct extent_index *index);
+
+/**
+ * @brief remove values from the free extents, once marked used in the bitmap
+ * @param index the index
+ * @param first the first value
+ * @param count the number of values, all in the same free extent
+ * @return 0 on success; <0 on error (then nothing changed)
+ */
+int extent_take(struct extent_index *index, uint64_t first, uint64_t count);
+
+/**
+ * @brief add values to the free extents, once marked unused in the bitmap;
+ *        they are merged with the extents just before and after them
+ * @param index the index
+ * @param first the first value
+ * @param count the number of values, none of them in a free extent
+ * @return 0 on success; <0 on error (then nothing changed)
+ */
+int extent_give(struct extent_index *index, uint64_t first, uint64_t count);
+
+/**
+ * @brief find the smallest free extent of at least n values (the lowest
+ *        one among those of the same length)
+ * @param index the index
+ * @param n the number of values wanted
+ * @param start the start of the extent (OUT)
+ * @param length its length (OUT)
+ * @return 0 on success; ERR_BITMAP_FULL if there is none
+ */
+int extent_best_fit(const struct extent_index *index, uint64_t n, uint64_t *start, uint64_t *length);
+
+/**
+ * @brief find the first n free values in a row at or after goal: in the
+ *        extent holding goal, if it has n values from there, else at the
+ *        start of the first extent after goal long enough
+ * @param index the index
+ * @param goal where the values should start
+ * @param n the number of values wanted
+ * @param start the first of the values (OUT)
+ * @return 0 on success; ERR_BITMAP_FULL if there is none
+ */
+int extent_next_fit(const struct extent_index *index, uint64_t goal, uint64_t n, uint64_t *start);
+
+/**
+ * @brief find the longest free extent (the lowest one among the longest)
+ * @param index the index
+ * @param start the start of the extent (OUT)
+ * @param length its length (OUT)
+ * @return 0 on success; ERR_BITMAP_FULL if there is no free value
+ */
+int extent_largest(const struct extent_index *index, uint64_t *start, uint64_t *length);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,6 +4,8 @@
 #include "inode.h"
 #include "error.h"
 #include "sector.h"
+#include "aio.h"
+#include "extent.h"
 #include <string.h>
 
 
@@ -29,8 +31,19 @@ int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv
   // if error return it
   if (resultOfRead != 0) return resultOfRead;
 
-  // Initialize the offset
+  // Initialize the offset, no stream detected yet
   fv6->offset = 0;
+  fv6->ra_next = 0;
+  fv6->ra_end = 0;
+  fv6->ra_window = 0;
+  // Nothing reserved for it yet
+  fv6->alloc_next = 0;
+  fv6->alloc_end = 0;
+  fv6->alloc_window = 0;
+  // Keep the inode in core while the file is open
+  fv6->icached = icache_hold(u->icache, inr);
+  // No indirect sector read yet
+  fv6->ind_sector = 0;
 
   return 0;
 }
@@ -49,6 +62,108 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset) {
 	return 0;
 }
 
+/**
+ * @brief charge the next sector requests to the content of a file: the
+ *        content of a directory is its directory entries
+ * @param u the filesystem
+ * @param inode the inode of the file
+ */
+static void filev6_tag(const struct unix_filesystem *u, const struct inode *inode) {
+  iostat_tag(u->stats, (inode->i_mode & IFMT) == IFDIR ? IOSTAT_DIRENT : IOSTAT_FILE);
+}
+
+int filev6_findsector(struct filev6 *fv6, int32_t file_sec_off) {
+  M_REQUIRE_NON_NULL(fv6);
+  const struct unix_filesystem *u = fv6->u;
+  const struct inode *inode = &(fv6->i_node);
+
+  // Small files need no indirect sector, and the errors are the same
+  int32_t sectors = inode_getsize(inode) / SECTOR_SIZE;
+  if (!(inode->i_mode & IALLOC) || sectors <= ADDR_SMALL_LENGTH
+      || sectors > (ADDR_SMALL_LENGTH - 1) * ADDRESSES_PER_SECTOR || file_sec_off < 0) {
+    return inode_findsector(u, inode, file_sec_off);
+  }
+  if (file_sec_off / ADDRESSES_PER_SECTOR >= ADDR_SMALL_LENGTH) return ERR_OFFSET_OUT_OF_RANGE;
+
+  // Read the indirect sector only if it is not the one kept
+  uint16_t indirect = inode->i_address[file_sec_off / ADDRESSES_PER_SECTOR];
+  if (indirect != fv6->ind_sector || indirect == 0) {
+    const void *addresses = sector_get(u, indirect);
+    if (addresses != NULL) memcpy(fv6->ind_addresses, addresses, SECTOR_SIZE);
+    else {
+      iostat_tag(u->stats, IOSTAT_INODE);
+      int sector = sector_read(u, indirect, fv6->ind_addresses);
+      if (sector != 0) {
+        fv6->ind_sector = 0;
+        return sector;
+      }
+    }
+    fv6->ind_sector = indirect;
+  }
+
+  return fv6->ind_addresses[file_sec_off % ADDRESSES_PER_SECTOR];
+}
+
+/**
+ * @brief detect sequential reads and bring the next sectors of the file
+ *        into the sector cache before they are asked for
+ * @param fv6 the filev6 (IN-OUT; read-ahead state updated)
+ * @param index the first sector (within the file) being read
+ * @param count the number of sectors being read
+ */
+static void filev6_readahead(struct filev6 *fv6, uint32_t index, uint32_t count) {
+  const struct unix_filesystem *u = fv6->u;
+  uint32_t next = index + count;
+
+  // Reading anywhere else than after the previous read ends the stream
+  if (index != fv6->ra_next) {
+    fv6->ra_next = next;
+    fv6->ra_end = 0;
+    fv6->ra_window = 0;
+    return;
+  }
+  fv6->ra_next = next;
+
+  // Prefetching is only useful with a cache to keep the sectors
+  if (u->cache == NULL) return;
+
+  // Wait until the stream comes close to the end of what is prefetched
+  if (fv6->ra_window > 0 && next + fv6->ra_window / 2 < fv6->ra_end) return;
+
+  // Grow the window with the stream, without flooding the cache
+  uint32_t max = FILEV6_READAHEAD_MAX;
+  if (max > u->cache->capacity / 4) max = u->cache->capacity / 4;
+  uint32_t window = (fv6->ra_window == 0) ? FILEV6_READAHEAD_MIN : fv6->ra_window * 2;
+  if (window > max) window = max;
+  if (window == 0) return;
+  fv6->ra_window = window;
+
+  // Find the sectors after what is already prefetched, up to the end of the file
+  uint32_t fileSectors = (inode_getsize(&(fv6->i_node)) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  uint32_t first = (fv6->ra_end > next) ? fv6->ra_end : next;
+  uint32_t sectors[FILEV6_READAHEAD_MAX];
+  uint32_t n = 0;
+  while (n < window && first + n < fileSectors) {
+    int mySector = filev6_findsector(fv6, first + n);
+    if (mySector <= 0) break;
+    sectors[n++] = mySector;
+  }
+  fv6->ra_end = first + n;
+  if (n == 0) return;
+
+  // Errors don't matter: the sectors are simply read again when asked for
+  filev6_tag(u, &(fv6->i_node));
+  if (u->aio != NULL && aio_pending(u->aio) == 0) {
+    (void) aio_read_all(u->aio, sectors, n, NULL);
+  }
+  else {
+    uint8_t scratch[FILEV6_READAHEAD_MAX][SECTOR_SIZE];
+    void *bufs[FILEV6_READAHEAD_MAX];
+    for (uint32_t i = 0; i < n; ++i) bufs[i] = scratch[i];
+    (void) sector_read_list(u, sectors, n, bufs);
+  }
+}
+
 /**
  * @brief read at most SECTOR_SIZE from the file at the current cursor
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
@@ -56,26 +171,56 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset) {
  * @return >0: the number of bytes of the file read; 0: end of file; <0 error
  */
 int filev6_readblock(struct filev6 *fv6, void *buf) {
+  M_REQUIRE_NON_NULL(buf);
+
+  const void *data = NULL;
+  int readResult = filev6_readblock_ref(fv6, buf, &data);
+
+  // Copy the data if it was accessed in place
+  if (readResult > 0 && data != buf) memcpy(buf, data, SECTOR_SIZE);
+
+  return readResult;
+}
+
+/**
+ * @brief same as filev6_readblock() but, when the disk is memory-mapped,
+ *        give a pointer to the data in place instead of copying it
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to SECTOR_SIZE bytes, only used when the data can't be accessed in place (OUT)
+ * @param data set to the data read: either in the mapping or buf (OUT)
+ * @return >0: the number of bytes of the file read; 0: end of file; <0 error
+ */
+int filev6_readblock_ref(struct filev6 *fv6, void *buf, const void **data) {
   // Check that arguments are not null
   M_REQUIRE_NON_NULL(fv6);
   M_REQUIRE_NON_NULL(buf);
+  M_REQUIRE_NON_NULL(data);
 
   // Get filesize from the filev6
   int fileSize = inode_getsize(&(fv6->i_node));
   // If the offset is bigger that the size of the file, return 0 = end of file
   if (fv6->offset >= fileSize) return 0;
 
+  // Prefetch what comes next if the file is read sequentially
+  filev6_readahead(fv6, fv6->offset / SECTOR_SIZE, 1);
+
   // Get the sector number corresponding to the inode we try to read
-  int mySector = inode_findsector(fv6->u, &(fv6->i_node), fv6->offset / SECTOR_SIZE);
+  int mySector = filev6_findsector(fv6, fv6->offset / SECTOR_SIZE);
   // If error while finding, return it
   if (mySector < 0) {
     return mySector;
   }
-  // try to read the sector
-  int readResult = sector_read((fv6->u)->f, mySector, buf);
 
-  // If error return it
-  if (readResult < 0) return readResult;
+  // Access the sector in place if possible, otherwise try to read it
+  *data = sector_get(fv6->u, mySector);
+  if (*data == NULL) {
+    filev6_tag(fv6->u, &(fv6->i_node));
+    int readResult = sector_read(fv6->u, mySector, buf);
+
+    // If error return it
+    if (readResult < 0) return readResult;
+    *data = buf;
+  }
 
 
   // Move the offset to the new position
@@ -85,6 +230,59 @@ int filev6_readblock(struct filev6 *fv6, void *buf) {
   return toMove;
 }
 
+/**
+ * @brief read up to nb_sectors consecutive sectors of the file at the
+ *        current cursor, physically contiguous sectors in one system call
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to nb_sectors*SECTOR_SIZE bytes of available memory (OUT)
+ * @param nb_sectors the maximal number of sectors to read (at most FILEV6_MAX_EXTENT are read)
+ * @return >0: the number of bytes of the file read; 0: end of file; <0 error
+ */
+int filev6_readblocks(struct filev6 *fv6, void *buf, int nb_sectors) {
+  M_REQUIRE_NON_NULL(fv6);
+  M_REQUIRE_NON_NULL(buf);
+  if (nb_sectors <= 0) return ERR_BAD_PARAMETER;
+  if (nb_sectors > FILEV6_MAX_EXTENT) nb_sectors = FILEV6_MAX_EXTENT;
+
+  int fileSize = inode_getsize(&(fv6->i_node));
+  uint32_t sectors[FILEV6_MAX_EXTENT];
+  void *bufs[FILEV6_MAX_EXTENT];
+
+  // Find where all the sectors are at once; if one can't be found, read those before it
+  int found = inode_map_range(fv6->u, &(fv6->i_node), fv6->offset / SECTOR_SIZE, nb_sectors, sectors, NULL);
+  if (found <= 0) return found;
+
+  // Move the offset like filev6_readblock() does
+  int32_t offset = fv6->offset;
+  int n = 0;
+  while (n < found && offset < fileSize) {
+    int toMove = offset + SECTOR_SIZE > fileSize ? fileSize % SECTOR_SIZE : SECTOR_SIZE;
+    if (toMove == 0) break;
+    bufs[n] = (uint8_t *) buf + n * SECTOR_SIZE;
+    ++n;
+    offset += toMove;
+  }
+  if (n == 0) return 0;
+
+  // Prefetch what comes next if the file is read sequentially
+  filev6_readahead(fv6, fv6->offset / SECTOR_SIZE, n);
+
+  // A fragmented file is read with all its sectors in flight through the io_uring
+  int contiguous = 1;
+  for (int i = 1; i < n && contiguous; ++i) contiguous = sectors[i] == sectors[i - 1] + 1;
+  struct aio_queue *aio = fv6->u->aio;
+  int async = !contiguous && aio_is_async(aio) && aio_pending(aio) == 0;
+
+  // Read them all at once
+  filev6_tag(fv6->u, &(fv6->i_node));
+  int readResult = async ? aio_read_all(aio, sectors, n, bufs) : sector_read_list(fv6->u, sectors, n, bufs);
+  if (readResult < 0) return readResult;
+
+  int toMove = offset - fv6->offset;
+  fv6->offset = offset;
+  return toMove;
+}
+
 /**
  * @brief create a new filev6
  * @param u the filesystem (IN)
@@ -106,6 +304,105 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6){
 }
 
 
+/**
+ * @brief first sector of the region of the given inode
+ */
+static uint64_t filev6_region(const struct unix_filesystem *u, uint16_t inr) {
+  uint64_t size = (u->fbm->max - u->fbm->min + 1) / FILEV6_ALLOC_REGIONS;
+  return u->fbm->min + (inr % FILEV6_ALLOC_REGIONS) * size;
+}
+
+/**
+ * @brief the sector after the last one of a file, 0 if it has none
+ */
+static uint64_t filev6_after_last(const struct inode *inode) {
+  size_t sectors = (inode_getsize(inode) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  if (sectors == 0 || sectors > ADDR_SMALL_LENGTH) return 0;
+  return (uint64_t) inode->i_address[sectors - 1] + 1;
+}
+
+void filev6_place(struct unix_filesystem *u, uint16_t inr, uint16_t mode, const struct filev6 *dir) {
+  if (u == NULL || dir == NULL || u->fbm == NULL) return;
+
+  // Directories are spread over the disk by filev6_goal() itself
+  if ((mode & IFMT) == IFDIR) return;
+
+  // Files next to their directory, or in its region until it has a sector
+  u->created_inr = inr;
+  u->created_goal = filev6_after_last(&dir->i_node);
+  if (u->created_goal == 0) u->created_goal = filev6_region(u, dir->i_number);
+}
+
+/**
+ * @brief where the next sector of a file should go
+ * @return the goal sector, 0 if there is none
+ */
+static uint64_t filev6_goal(const struct unix_filesystem *u, const struct filev6 *fv6) {
+  if (!u->locality) return 0;
+
+  // Right after its last sector
+  uint64_t goal = filev6_after_last(&fv6->i_node);
+  if (goal != 0) return goal;
+  // A directory starts in its own region
+  if ((fv6->i_node.i_mode & IFMT) == IFDIR) return filev6_region(u, fv6->i_number);
+  // Where filev6_place() put a new file
+  if (fv6->i_number == u->created_inr && u->created_goal != 0) return u->created_goal;
+  return 0;
+}
+
+/**
+ * @brief mark used in the fbm, and in its free extents, n consecutive
+ *        free sectors: from the goal or the first ones after it that fit,
+ *        else the smallest free extent that fits, else the longest one
+ * @param u the filesystem
+ * @param goal where the sectors should start, 0 if anywhere
+ * @param n the number of sectors wanted (> 0)
+ * @param start the first sector (OUT)
+ * @return <0 on error, the number of sectors (between 1 and n) otherwise
+ */
+static int filev6_reserve(struct unix_filesystem *u, uint64_t goal, size_t n, uint64_t *start) {
+  // Without an index of the free extents, search the fbm itself
+  if (u->extents == NULL) return bm_find_run_near(u->fbm, goal != 0 ? goal : u->fbm->cursor, n, start);
+
+  uint64_t length = n;
+  int found = goal != 0 ? extent_next_fit(u->extents, goal, n, start) : ERR_BITMAP_FULL;
+  if (found != 0) {
+    uint64_t extentLength;
+    found = extent_best_fit(u->extents, n, start, &extentLength);
+  }
+  if (found != 0) {
+    found = extent_largest(u->extents, start, &length);
+    if (found != 0) return found;
+  }
+
+  int take = extent_take(u->extents, *start, length);
+  if (take != 0) return take;
+  int set = bm_set_range(u->fbm, *start, *start + length - 1);
+  if (set != 0) {
+    // Give back what was set, and the extent
+    bm_clear_range(u->fbm, *start, *start + length - 1);
+    if (u->extents != NULL) (void) extent_give(u->extents, *start, length);
+    return set;
+  }
+  return (int) length;
+}
+
+/**
+ * @brief give back to the fbm, and to its free extents, sectors reserved by filev6_reserve()
+ * @param u the filesystem
+ * @param first the first sector
+ * @param count the number of sectors
+ */
+static void filev6_unreserve(const struct unix_filesystem *u, uint64_t first, uint64_t count) {
+  if (count == 0) return;
+  // They leave the window, written or not
+  if (u->windows != NULL) (void) bm_clear_range(u->windows, first, first + count - 1);
+  // Sectors still marked used are only lost until the next mount rebuilds the fbm
+  if (bm_clear_range(u->fbm, first, first + count - 1) != 0) return;
+  // Without memory for a new extent, the index only offers them again after the next mount
+  if (u->extents != NULL) (void) extent_give(u->extents, first, count);
+}
+
 // Helper function for filev6_writebytes
 /**
  * @brief write one sector of data from buf in the filev6
@@ -122,6 +419,9 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, void *buf,
   M_REQUIRE_NON_NULL(buf);
   if(len < 0) return ERR_BAD_PARAMETER;
 
+  // The disk changes: umountv6() must write the bitmaps
+  (u->s).s_fmod = 1;
+
   size_t nb_bytes;
   // Current size of the filev6
   size_t fileSize = inode_getsize(&fv6->i_node);
@@ -136,17 +436,41 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, void *buf,
       // We'll write at most SECTOR_SIZE bytes
       nb_bytes = len >= SECTOR_SIZE ? SECTOR_SIZE : len;
       
-      // Find a free sector
-      int freeSector = bm_find_next(u->fbm);
+      // Once the window is used up, reserve in the fbm a larger one, at least the rest of the write
+      if (fv6->alloc_next == fv6->alloc_end) {
+        fv6->alloc_window = fv6->alloc_window == 0 ? FILEV6_WINDOW_MIN
+                            : (fv6->alloc_window >= FILEV6_WINDOW_MAX / 2 ? FILEV6_WINDOW_MAX : 2 * fv6->alloc_window);
+        // But no more than the file can still hold, nor than FILEV6_WINDOW_MAX
+        size_t sectors = fileSize / SECTOR_SIZE;
+        size_t room = sectors < ADDR_SMALL_LENGTH ? ADDR_SMALL_LENGTH - sectors : 0;
+        size_t wanted = fv6->alloc_window < room ? fv6->alloc_window : room;
+        size_t needed = (len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (needed > room) needed = room;
+        if (needed > FILEV6_WINDOW_MAX) needed = FILEV6_WINDOW_MAX;
+        if (wanted < needed) wanted = needed;
+        // The sector written now, at least
+        if (wanted == 0) wanted = 1;
 
-      if (freeSector < 0) return ERR_BITMAP_FULL;
+        uint64_t start;
+        int length = filev6_reserve(u, filev6_goal(u, fv6), wanted, &start);
+        if (length < 0) return ERR_BITMAP_FULL;
+        // Until they are written, umountv6() keeps them free on the disk
+        if (u->windows != NULL && bm_set_range(u->windows, start, start + length - 1) != 0) {
+          filev6_unreserve(u, start, length);
+          return ERR_NOMEM;
+        }
+        fv6->alloc_next = start;
+        fv6->alloc_end = start + length;
+      }
 
-      // Tell fbm that we'll use it 
-      bm_set(u->fbm, freeSector);
+      // Take the next sector of the window, the fbm already has it
+      uint64_t freeSector = fv6->alloc_next++;
+      if (u->windows != NULL) (void) bm_clear(u->windows, freeSector);
       
       // Write opur data in this sector, if we can't free in the fbm
-      int writeSector = sector_write(u->f, freeSector, buf);
-      if (writeSector < 0) {bm_clear(u->fbm, freeSector);return writeSector;}
+      filev6_tag(u, &(fv6->i_node));
+      int writeSector = sector_write(u, freeSector, buf);
+      if (writeSector < 0) {filev6_unreserve(u, freeSector, 1);return writeSector;}
 
       // Update the address array
       fv6->i_node.i_address[fileSize / SECTOR_SIZE] = freeSector; 
@@ -163,7 +487,8 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, void *buf,
   
     // read the sector
     uint8_t data[SECTOR_SIZE];
-    int readData = sector_read(u->f, sectorAddress, data);
+    filev6_tag(u, &(fv6->i_node));
+    int readData = sector_read(u, sectorAddress, data);
     if (readData < 0) return readData;
 
     // Cast to byte to manipulate data
@@ -177,7 +502,7 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, void *buf,
     }
   
     // rewrite the sector
-    int tryWrite = sector_write(u->f, sectorAddress, data);
+    int tryWrite = sector_write(u, sectorAddress, data);
     if (tryWrite < 0) return tryWrite;
 
     fv6->offset += nb_bytes;
@@ -207,15 +532,15 @@ int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, void *buf,
   if(len < 0) return ERR_BAD_PARAMETER;
   
   size_t leftLen = len;
+  int writen = 0;
   // While we still have some bytes to write
-  while (leftLen != 0) {
+  while (leftLen != 0 && writen >= 0) {
     // Try to write
-    int writen = filev6_writesector(u, fv6, ((uint8_t*) buf) + len - leftLen, leftLen) ;
-    if (writen < 0) return writen;
+    writen = filev6_writesector(u, fv6, ((uint8_t*) buf) + len - leftLen, leftLen);
     // If success, reduce leftLen
-    leftLen -= writen;
-
+    if (writen >= 0) leftLen -= writen;
   }
+  if (writen < 0) return writen;
   
   // Finaly write the inode 
   int writeInode = inode_write(u, fv6->i_number, &(fv6->i_node));
@@ -223,3 +548,52 @@ int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, void *buf,
  
   return 0;
 }
+
+int filev6_close(const struct unix_filesystem *u, struct filev6 *fv6) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(fv6);
+
+  // The inode may leave the cache
+  icache_release(u->icache, fv6->icached);
+  fv6->icached = NULL;
+
+  // Give back the sectors of the window that were not used
+  filev6_unreserve(u, fv6->alloc_next, fv6->alloc_end - fv6->alloc_next);
+  fv6->alloc_next = 0;
+  fv6->alloc_end = 0;
+  fv6->alloc_window = 0;
+  return 0;
+}
+
+int filev6_layout(const struct unix_filesystem *u, struct filev6_layout *layout) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(layout);
+  M_REQUIRE_NON_NULL(u->ibm);
+  memset(layout, 0, sizeof(*layout));
+
+  // For each allocated inode
+  for (uint64_t inr = u->ibm->min; inr <= u->ibm->max; ++inr) {
+    if (bm_get(u->ibm, inr) != 1) continue;
+    struct filev6 fv6;
+    if (filev6_open(u, (uint16_t) inr, &fv6) != 0) continue;
+
+    // Go through its sectors in the order of the file
+    int32_t sectors = (inode_getsize(&fv6.i_node) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int previous = -1;
+    for (int32_t i = 0; i < sectors; ++i) {
+      int sector = filev6_findsector(&fv6, i);
+      if (sector <= 0) break;
+      if (previous >= 0) {
+        // Any sector but the next one on the disk needs a seek
+        uint64_t distance = sector > previous ? sector - previous : previous - sector;
+        layout->distance += distance;
+        if (distance != 1) ++layout->seeks;
+      }
+      else ++layout->files;
+      ++layout->sectors;
+      previous = sector;
+    }
+    filev6_close(u, &fv6);
+  }
+  return 0;
+}
@@ -20,10 +20,55 @@ struct filev6 {
     uint16_t i_number;                   // the inode number (on disk)
     struct inode i_node;                 // the content of the inode
     int32_t offset;                      // the current cursor within the file (in bytes)
+    uint32_t ra_next;                    // read-ahead: sector (in the file) a sequential read asks next
+    uint32_t ra_end;                     // read-ahead: first sector (in the file) not prefetched yet
+    uint32_t ra_window;                  // read-ahead: sectors prefetched at once, 0 outside a sequential stream
+    uint64_t alloc_next;                 // allocation window: next sector reserved in the fbm for the file
+    uint64_t alloc_end;                  // allocation window: first sector after the reserved ones
+    uint32_t alloc_window;               // allocation window: sectors reserved last time, 0 before the first write
+    struct icache_entry *icached;        // the entry of the inode in u->icache, held while open; NULL if none
+    uint16_t ind_sector;                 // indirect sector last used to find a sector, 0 if none
+    uint16_t ind_addresses[ADDRESSES_PER_SECTOR]; // its content
 };
 
 /**
- * @brief open up a file corresponding to a given inode; set offset to zero
+ * @brief sectors prefetched when a sequential stream starts; the window
+ *        doubles every time the stream catches up with it, up to
+ *        FILEV6_READAHEAD_MAX (and a quarter of the sector cache)
+ */
+#define FILEV6_READAHEAD_MIN 4
+#define FILEV6_READAHEAD_MAX 64
+
+/**
+ * @brief sectors a written filev6 reserves in the fbm when it needs a new
+ *        one; the window doubles every time it is used up, up to
+ *        FILEV6_WINDOW_MAX (never more than the file can still hold).
+ *        New sectors are then taken from the window without touching the
+ *        fbm, until filev6_close() gives the rest back.
+ */
+#define FILEV6_WINDOW_MIN 16
+#define FILEV6_WINDOW_MAX 64
+
+/**
+ * @brief regions of the data sectors: the first sector of a new directory
+ *        goes to the region of its inode number, the ones of a new file
+ *        after the last sector of its directory
+ */
+#define FILEV6_ALLOC_REGIONS 8
+
+/**
+ * @brief how the sectors of the files are laid out on the disk
+ */
+struct filev6_layout {
+    uint64_t files;                      // files and directories with at least one sector
+    uint64_t sectors;                    // their data sectors
+    uint64_t seeks;                      // consecutive sectors of a file that are not adjacent on the disk
+    uint64_t distance;                   // sum of the distances between consecutive sectors of a file
+};
+
+/**
+ * @brief open up a file corresponding to a given inode; set offset to zero.
+ *        Its inode stays in the inode cache until filev6_close().
  * @param u the filesystem (IN)
  * @param inr he inode number (IN)
  * @param fv6 the complete filve6 data structure (OUT)
@@ -31,6 +76,15 @@ struct filev6 {
  */
 int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv6);
 
+/**
+ * @brief close a file: release its inode in the inode cache and give back
+ *        to the fbm the sectors of its allocation window that were not used
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_close(const struct unix_filesystem *u, struct filev6 *fv6);
+
 /**
  * @brief change the current offset of the given file to the one specified
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
@@ -40,13 +94,52 @@ int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv
 int filev6_lseek(struct filev6 *fv6, int32_t offset);
 
 /**
- * @brief read at most SECTOR_SIZE from the file at the current cursor
+ * @brief read at most SECTOR_SIZE from the file at the current cursor.
+ *        Sequential reads prefetch the next sectors of the file into the
+ *        sector cache (filev6_readblock_ref() and filev6_readblocks() too).
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
  * @param buf points to SECTOR_SIZE bytes of available memory (OUT)
  * @return >0: the number of bytes of the file read; 0: end of file; <0 error
  */
 int filev6_readblock(struct filev6 *fv6, void *buf);
 
+/**
+ * @brief same as filev6_readblock() but, when the disk is memory-mapped,
+ *        give a pointer to the data in place instead of copying it
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to SECTOR_SIZE bytes, only used when the data can't be accessed in place (OUT)
+ * @param data set to the data read: either in the mapping or buf (OUT)
+ * @return >0: the number of bytes of the file read; 0: end of file; <0 error
+ */
+int filev6_readblock_ref(struct filev6 *fv6, void *buf, const void **data);
+
+/**
+ * @brief same as inode_findsector() for the inode of an open file, but the
+ *        last indirect sector used is kept in the filev6: a sequential
+ *        read then reads it once for its ADDRESSES_PER_SECTOR sectors
+ *        (the indirect sectors are never rewritten while a file is open)
+ * @param fv6 the filev6 (IN-OUT; indirect sector kept)
+ * @param file_sec_off the offset within the file (in sector-size units)
+ * @return >0: the sector on disk; <0 error
+ */
+int filev6_findsector(struct filev6 *fv6, int32_t file_sec_off);
+
+/**
+ * @brief maximal number of sectors read by one call to filev6_readblocks()
+ */
+#define FILEV6_MAX_EXTENT ADDRESSES_PER_SECTOR
+
+/**
+ * @brief read up to nb_sectors consecutive sectors of the file at the
+ *        current cursor, physically contiguous sectors in one system call;
+ *        scattered ones all in flight at once when the mount has an io_uring (aio_depth)
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to nb_sectors*SECTOR_SIZE bytes of available memory (OUT)
+ * @param nb_sectors the maximal number of sectors to read (at most FILEV6_MAX_EXTENT are read)
+ * @return >0: the number of bytes of the file read; 0: end of file; <0 error
+ */
+int filev6_readblocks(struct filev6 *fv6, void *buf, int nb_sectors);
+
 /**
  * @brief create a new filev6
  * @param u the filesystem (IN)
@@ -57,7 +150,9 @@ int filev6_readblock(struct filev6 *fv6, void *buf);
 int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6);
 
 /**
- * @brief write the len bytes of the given buffer on disk to the given filev6
+ * @brief write the len bytes of the given buffer on disk to the given filev6;
+ *        the new sectors come from its allocation window (see FILEV6_WINDOW_MIN),
+ *        so the filev6 must be closed with filev6_close() afterwards
  * @param u the filesystem (IN)
  * @param fv6 the filev6 (IN)
  * @param buf the data we want to write (IN)
@@ -66,6 +161,25 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6);
  */
 int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, void *buf, int len);
 
+/**
+ * @brief choose where the first sector of a new file will be written, the
+ *        next time filev6_writebytes() is called on it (only the last new
+ *        file is remembered; a directory always starts in its region)
+ * @param u the filesystem (IN-OUT)
+ * @param inr the inode number of the new inode
+ * @param mode its mode
+ * @param dir the directory holding it (IN)
+ */
+void filev6_place(struct unix_filesystem *u, uint16_t inr, uint16_t mode, const struct filev6 *dir);
+
+/**
+ * @brief measure how the sectors of every allocated inode are laid out:
+ *        the average seek distance is distance / (sectors - files)
+ * @param u the filesystem (IN)
+ * @param layout the measure (OUT)
+ * @return 0 on success; <0 on errror
+ */
+int filev6_layout(const struct unix_filesystem *u, struct filev6_layout *layout);
 
 #ifdef __cplusplus
 }
@@ -10,6 +10,8 @@
 
 #define FUSE_USE_VERSION 26
 #define MAXPATHLEN_UV6 1024
+// sector reads in flight for one fs_read()
+#define FS_AIO_DEPTH 32
 
 #include <fuse.h>
 #include <stdio.h>
@@ -84,7 +86,10 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     // If other type of error, return it
     if(tryOpen < 0) return tryOpen;
 
-	if (!(dir.fv6.i_node.i_mode & IALLOC) || !(dir.fv6.i_node.i_mode & IFDIR)) return ERR_INVALID_DIRECTORY_INODE;
+	if (!(dir.fv6.i_node.i_mode & IALLOC) || !(dir.fv6.i_node.i_mode & IFDIR)) {
+        direntv6_closedir(&dir);
+        return ERR_INVALID_DIRECTORY_INODE;
+    }
     int tryRead;
 
     // Do all this while we can read childs from the current directory
@@ -99,7 +104,7 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         // Try to read a child of the current dir
         tryRead = direntv6_readdir(&dir, name, &nextChild);
         // If we can't, return error code (either error or no more child)
-        if(tryRead <= 0) return tryRead;
+        if(tryRead <= 0) break;
 
         // Write the name
         char toPrint[MAXPATHLEN_UV6+1];
@@ -111,7 +116,8 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     } while(tryRead == 1);
 
-    return 0;
+    direntv6_closedir(&dir);
+    return tryRead < 0 ? tryRead : 0;
 }
 
 static int fs_read(const char *path, char *buf, size_t size, off_t offset,
@@ -136,43 +142,66 @@ static int fs_read(const char *path, char *buf, size_t size, off_t offset,
    
     if(inodeOpen < 0) return inodeOpen;
 
-	if (!(stv6.i_node.i_mode & IALLOC) || (stv6.i_node.i_mode & IFDIR)) return ERR_BAD_PARAMETER;
+	if (!(stv6.i_node.i_mode & IALLOC) || (stv6.i_node.i_mode & IFDIR)) {
+        filev6_close(&fs, &stv6);
+        return ERR_BAD_PARAMETER;
+    }
 	  // Move the cursor at the corret position gieven by FUSE
     int fileSeek = filev6_lseek(&stv6, offset);
-    if (fileSeek < 0) return fileSeek;
-
-    unsigned char data[size];
-    
+    if (fileSeek < 0) {
+        filev6_close(&fs, &stv6);
+        return fileSeek;
+    }
 
     int fileRead = 0;
     int currentRead = 0;
 
 
-    while (fileRead < size - SECTOR_SIZE) {
-        // Read the next block of data pointed by the cursor
-        currentRead = filev6_readblock(&stv6, data + fileRead);
+    // Read every whole sector that fits in buf, contiguous ones at once
+    while (size - fileRead >= SECTOR_SIZE) {
+        // Read the next blocks of data pointed by the cursor
+        currentRead = filev6_readblocks(&stv6, buf + fileRead, (size - fileRead) / SECTOR_SIZE);
         // If error return it
-        if(currentRead < 0) return currentRead;
+        if(currentRead < 0) {
+            filev6_close(&fs, &stv6);
+            return currentRead;
+        }
         // If 0, end of file
         else if(currentRead == 0) break;
         fileRead += currentRead;
     }
-	  
-    
-    // Set last char to \0 to end the string
-    data[fileRead] = '\0';
-    
-    // If fileRead > 0 => we did read successfully => save what we read
-    if(fileRead > 0) memcpy(buf, data, fileRead);
+    filev6_close(&fs, &stv6);
 
     // return how much bytes we read
     return fileRead;
 }
 
+static int fs_statfs(const char *path, struct statvfs *stbuf)
+{
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(stbuf);
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+
+    // Sizes and free space straight from the bitmaps, which keep count of their unused bits
+    stbuf->f_bsize = SECTOR_SIZE;
+    stbuf->f_frsize = SECTOR_SIZE;
+    stbuf->f_blocks = fs.fbm->max - fs.fbm->min + 1;
+    stbuf->f_bfree = fs.fbm->free_count;
+    stbuf->f_bavail = fs.fbm->free_count;
+    stbuf->f_files = fs.ibm->max - fs.ibm->min + 1;
+    stbuf->f_ffree = fs.ibm->free_count;
+    stbuf->f_favail = fs.ibm->free_count;
+    stbuf->f_namemax = DIRENT_MAXLEN;
+
+    return 0;
+}
+
 static struct fuse_operations available_ops = {
     .getattr	= fs_getattr,
     .readdir	= fs_readdir,
     .read		= fs_read,
+    .statfs	= fs_statfs,
 };
 
 
@@ -186,7 +215,15 @@ static int arg_parse(void *data, const char *filename, int key, struct fuse_args
     if (key == FUSE_OPT_KEY_NONOPT && fs.f == NULL && filename != NULL) {
 
 
-        int tryMount = mountv6(filename, &fs);
+        // FUSE only reads the filesystem: the sectors of a read go to the disk together
+        // through an io_uring, and stay in the sector cache
+        struct mount_options opts;
+        mountv6_default_options(&opts);
+        opts.read_only = 1;
+        opts.io = SECTOR_IO_PREAD;
+        opts.aio_depth = FS_AIO_DEPTH;
+
+        int tryMount = mountv6_opts(filename, &opts, &fs);
         // If we can't error
         if (tryMount < 0) {
             // print error and exit fuse
@@ -201,6 +238,8 @@ int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     int ret = fuse_opt_parse(&args, NULL, NULL, arg_parse);
+    // The caches and the aio queue of the mount are not shared between threads
+    if (ret == 0) ret = fuse_opt_add_arg(&args, "-s");
     if (ret == 0) {
         ret = fuse_main(args.argc, args.argv, &available_ops, NULL);
         (void)umountv6(&fs);
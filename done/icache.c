@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "icache.h"
+
+/**
+ * @brief find the bucket of an inode in the hash table
+ */
+static size_t icache_bucket(const struct inode_cache *c, uint16_t inr) {
+  // nbuckets is a power of 2
+  return inr & (c->nbuckets - 1);
+}
+
+/**
+ * @brief remove an entry from the LRU list
+ */
+static void icache_unlink(struct inode_cache *c, struct icache_entry *e) {
+  if (e->prev != NULL) e->prev->next = e->next;
+  else c->head = e->next;
+  if (e->next != NULL) e->next->prev = e->prev;
+  else c->tail = e->prev;
+  e->prev = NULL;
+  e->next = NULL;
+}
+
+/**
+ * @brief put an entry at the head (most recently used) of the LRU list
+ */
+static void icache_push_front(struct inode_cache *c, struct icache_entry *e) {
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head != NULL) c->head->prev = e;
+  c->head = e;
+  if (c->tail == NULL) c->tail = e;
+}
+
+/**
+ * @brief remove an entry from its hash bucket
+ */
+static void icache_unhash(struct inode_cache *c, struct icache_entry *e) {
+  struct icache_entry **link = &c->buckets[icache_bucket(c, e->inr)];
+  while (*link != NULL && *link != e) link = &(*link)->hnext;
+  if (*link == e) *link = e->hnext;
+  e->hnext = NULL;
+}
+
+/**
+ * @brief find the entry holding an inode, NULL if there is none
+ */
+static struct icache_entry *icache_find(const struct inode_cache *c, uint16_t inr) {
+  struct icache_entry *e = c->buckets[icache_bucket(c, inr)];
+  while (e != NULL && e->inr != inr) e = e->hnext;
+  return e;
+}
+
+struct inode_cache *icache_alloc(size_t capacity) {
+  // Check parameters
+  if (capacity == 0) return NULL;
+
+  struct inode_cache *c = calloc(1, sizeof(struct inode_cache));
+  if (c == NULL) return NULL;
+
+  // Use at least as many buckets as entries, rounded up to a power of 2
+  c->nbuckets = 1;
+  while (c->nbuckets < capacity) c->nbuckets <<= 1;
+
+  c->buckets = calloc(c->nbuckets, sizeof(struct icache_entry *));
+  c->entries = calloc(capacity, sizeof(struct icache_entry));
+  c->order = calloc(capacity, sizeof(struct icache_entry *));
+  if (c->buckets == NULL || c->entries == NULL || c->order == NULL) {
+    icache_free(c);
+    return NULL;
+  }
+  c->capacity = capacity;
+  return c;
+}
+
+void icache_free(struct inode_cache *c) {
+  if (c == NULL) return;
+  free(c->buckets);
+  free(c->entries);
+  free(c->order);
+  free(c);
+}
+
+int icache_read(struct inode_cache *c, uint16_t inr, struct inode *inode) {
+  if (c == NULL) return 0;
+  struct icache_entry *e = icache_find(c, inr);
+  if (e == NULL) {
+    ++c->misses;
+    return 0;
+  }
+  ++c->hits;
+
+  // The entry becomes the most recently used one
+  if (c->head != e) {
+    icache_unlink(c, e);
+    icache_push_front(c, e);
+  }
+  *inode = e->inode;
+  return 1;
+}
+
+/**
+ * @brief find or make the entry of an inode and make it the most recently
+ *        used one, evicting the least recently used clean entry without
+ *        references if the cache is full
+ * @return the entry, NULL if every entry is dirty or referenced
+ */
+static struct icache_entry *icache_put(struct inode_cache *c, uint16_t inr) {
+  struct icache_entry *e = icache_find(c, inr);
+
+  if (e != NULL) {
+    // Already cached: refresh the LRU position
+    icache_unlink(c, e);
+    icache_push_front(c, e);
+    return e;
+  }
+
+  if (c->used < c->capacity) {
+    // Take a never used entry
+    e = &c->entries[c->used++];
+  }
+  else {
+    // Evict the least recently used entry that no filev6 holds and the disk has
+    e = c->tail;
+    while (e != NULL && (e->refs != 0 || e->dirty)) e = e->prev;
+    if (e == NULL) return NULL;
+    icache_unlink(c, e);
+    icache_unhash(c, e);
+    ++c->evictions;
+  }
+  e->inr = inr;
+  e->refs = 0;
+  e->dirty = 0;
+  e->hnext = c->buckets[icache_bucket(c, inr)];
+  c->buckets[icache_bucket(c, inr)] = e;
+  icache_push_front(c, e);
+  return e;
+}
+
+void icache_store(struct inode_cache *c, uint16_t inr, const struct inode *inode) {
+  if (c == NULL) return;
+  struct icache_entry *e = icache_put(c, inr);
+  if (e != NULL) e->inode = *inode;
+}
+
+int icache_write(struct inode_cache *c, uint16_t inr, const struct inode *inode) {
+  if (c == NULL) return 0;
+  struct icache_entry *e = icache_put(c, inr);
+  if (e == NULL) return 0;
+
+  if (e->dirty++ == 0) ++c->dirty;
+  e->inode = *inode;
+  return 1;
+}
+
+/**
+ * @brief compare two entries by inode number, for qsort()
+ */
+static int icache_entry_cmp(const void *a, const void *b) {
+  uint16_t x = (*(struct icache_entry * const *) a)->inr;
+  uint16_t y = (*(struct icache_entry * const *) b)->inr;
+  return (x > y) - (x < y);
+}
+
+int icache_flush(struct inode_cache *c, icache_writer write, void *arg) {
+  if (c == NULL || c->dirty == 0) return 0;
+
+  // Collect the dirty entries and sort them so that the inodes of a sector are together
+  size_t n = 0;
+  for (size_t i = 0; i < c->used; ++i) {
+    if (c->entries[i].dirty) c->order[n++] = &c->entries[i];
+  }
+  qsort(c->order, n, sizeof(struct icache_entry *), icache_entry_cmp);
+
+  for (size_t first = 0; first < n; ) {
+    // The entries of the same sector of the inode table
+    uint32_t index = c->order[first]->inr / INODES_PER_SECTOR;
+    size_t end = first + 1;
+    while (end < n && c->order[end]->inr / INODES_PER_SECTOR == index) ++end;
+
+    int written = write(arg, index, c->order + first, end - first);
+    if (written != 0) return written;
+
+    // Every write to these inodes but one cost nothing on the disk
+    uint64_t writes = 0;
+    for (size_t i = first; i < end; ++i) {
+      writes += c->order[i]->dirty;
+      c->order[i]->dirty = 0;
+      --c->dirty;
+    }
+    ++c->flushed;
+    c->avoided += writes - 1;
+    first = end;
+  }
+  return 0;
+}
+
+struct icache_entry *icache_hold(struct inode_cache *c, uint16_t inr) {
+  if (c == NULL) return NULL;
+  struct icache_entry *e = icache_find(c, inr);
+  if (e == NULL) return NULL;
+
+  if (e->refs++ == 0) ++c->held;
+  return e;
+}
+
+void icache_release(struct inode_cache *c, struct icache_entry *e) {
+  if (c == NULL || e == NULL || e->refs == 0) return;
+  if (--e->refs == 0) --c->held;
+}
+
+void icache_print_stats(const struct inode_cache *c) {
+  printf("**********INODE CACHE START**********\n");
+  if (c == NULL) {
+    printf("disabled\n");
+  }
+  else {
+    printf("capacity: %zu\n", c->capacity);
+    printf("used: %zu\n", c->used);
+    printf("held: %zu\n", c->held);
+    printf("hits: %" PRIu64 "\n", c->hits);
+    printf("misses: %" PRIu64 "\n", c->misses);
+    printf("evictions: %" PRIu64 "\n", c->evictions);
+    printf("dirty: %zu\n", c->dirty);
+    printf("flushed sectors: %" PRIu64 "\n", c->flushed);
+    printf("avoided writes: %" PRIu64 "\n", c->avoided);
+  }
+  printf("**********INODE CACHE END************\n");
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+/**
+ * @file icache.h
+ * @brief in-core copies of the inodes, found by inode number.
+ *
+ * Entries live in a fixed array allocated once by icache_alloc(); a hash
+ * table finds them by inode number and a doubly linked list keeps them
+ * ordered from most to least recently used. An open filev6 holds a
+ * reference to the entry of its inode: referenced entries are never
+ * evicted, so they stay at the same address.
+ *
+ * By default the cache is write-through: inode_write() writes the inode
+ * table and updates the entry, so an entry is never newer than the disk.
+ * With a dirty limit, icache_write() only marks the entry dirty; dirty
+ * entries are never evicted and reach the disk through icache_flush(),
+ * one write per sector of the inode table however many of its inodes
+ * changed.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "unixv6fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct icache_entry {
+    uint16_t inr;                    // inode number
+    uint32_t refs;                   // open filev6 holding the entry
+    struct icache_entry *prev;       // LRU list, towards the most recently used
+    struct icache_entry *next;       // LRU list, towards the least recently used
+    struct icache_entry *hnext;      // next entry in the same hash bucket
+    uint32_t dirty;                  // writes since the inode reached the disk, 0 if clean
+    struct inode inode;              // copy of the inode
+};
+
+struct inode_cache {
+    size_t capacity;                 // number of entries
+    size_t used;                     // number of valid entries
+    size_t nbuckets;                 // size of the hash table (power of 2)
+    struct icache_entry **buckets;   // hash table
+    struct icache_entry *entries;    // all the entries
+    struct icache_entry *head;       // most recently used entry
+    struct icache_entry *tail;       // least recently used entry
+    size_t held;                     // number of entries with references
+    struct icache_entry **order;     // scratch array used to sort the dirty entries
+    size_t dirty_limit;              // write-back: flush when this many inodes are dirty, 0 to write through
+    size_t dirty;                    // number of dirty entries
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t flushed;                // sectors written by icache_flush()
+    uint64_t avoided;                // sector writes saved by grouping the dirty inodes
+};
+
+/**
+ * @brief write the dirty inodes of one sector of the inode table, used by
+ *        icache_flush()
+ * @param arg the argument given to icache_flush()
+ * @param index the sector in the inode table (inode number / INODES_PER_SECTOR)
+ * @param entries the dirty entries of that sector, in inode order (IN)
+ * @param n the number of entries
+ * @return 0 on success; <0 on error
+ */
+typedef int (*icache_writer)(void *arg, uint32_t index, struct icache_entry *const *entries, size_t n);
+
+/**
+ * @brief allocate a new cache able to hold capacity inodes
+ * @param capacity the number of inodes kept in memory (must be >0)
+ * @return a pointer to the newly created cache or NULL on failure
+ */
+struct inode_cache *icache_alloc(size_t capacity);
+
+/**
+ * @brief release all the memory used by a cache
+ * @param c the cache (may be NULL)
+ */
+void icache_free(struct inode_cache *c);
+
+/**
+ * @brief copy an inode from the cache if it is present
+ * @param c the cache (may be NULL: always a miss)
+ * @param inr the inode number
+ * @param inode the inode (OUT)
+ * @return 1 on hit; 0 on miss
+ */
+int icache_read(struct inode_cache *c, uint16_t inr, struct inode *inode);
+
+/**
+ * @brief store (or update) an inode in the cache, evicting the least
+ *        recently used clean entry without references if the cache is
+ *        full. Nothing is stored if every entry is dirty or referenced.
+ *        An entry already dirty stays dirty.
+ * @param c the cache (may be NULL)
+ * @param inr the inode number
+ * @param inode the inode (IN)
+ */
+void icache_store(struct inode_cache *c, uint16_t inr, const struct inode *inode);
+
+/**
+ * @brief store an inode in the cache and mark it dirty, instead of writing
+ *        it to the inode table
+ * @param c the cache (may be NULL: nothing is stored)
+ * @param inr the inode number
+ * @param inode the inode (IN)
+ * @return 1 on success; 0 if every entry is dirty or referenced (flush first)
+ */
+int icache_write(struct inode_cache *c, uint16_t inr, const struct inode *inode);
+
+/**
+ * @brief write every dirty entry with the given function, one call per
+ *        sector of the inode table in ascending order, and mark them clean
+ * @param c the cache (may be NULL)
+ * @param write the function writing the inodes of one sector
+ * @param arg the first argument given to write
+ * @return 0 on success; the first error returned by write (the entries
+ *         not written yet stay dirty)
+ */
+int icache_flush(struct inode_cache *c, icache_writer write, void *arg);
+
+/**
+ * @brief take a reference to the entry of an inode, so that it stays in
+ *        the cache until icache_release()
+ * @param c the cache (may be NULL)
+ * @param inr the inode number
+ * @return the entry; NULL if the inode is not in the cache
+ */
+struct icache_entry *icache_hold(struct inode_cache *c, uint16_t inr);
+
+/**
+ * @brief give back a reference taken by icache_hold()
+ * @param c the cache
+ * @param e the entry (may be NULL)
+ */
+void icache_release(struct inode_cache *c, struct icache_entry *e);
+
+/**
+ * @brief print to stdout the counters of the cache
+ * @param c the cache
+ */
+void icache_print_stats(const struct inode_cache *c);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,6 +4,7 @@
 #include "sector.h"
 #include "inode.h"
 #include <inttypes.h>
+#include <pthread.h>
 
 /**
  * @brief set the size of a given inode to the given size
@@ -35,46 +36,174 @@ void inode_print(const struct inode *inode) {
   printf("**********FS INDOE END**********\n");
 }
 
+// What the threads of inode_scan() share
+struct inode_scan_job {
+  const struct unix_filesystem *u;
+  int flags;
+  inode_scan_callback callback;
+  void *ctx;
+  enum iostat_class tag;           // subsystem charged for the reads
+  int shared;                      // the threads read at the same time (sector_can_share_reads())
+  pthread_mutex_t lock;            // next, result and the statistics; the sector layer unless shared
+  uint32_t next;                   // next chunk to read
+  uint32_t chunks;                 // number of chunks
+  int result;                      // first error, 0 if none
+};
+
 /**
- * @brief read all inodes from disk and print out their content to
- *        stdout according to the assignment
- * @param u the filesystem
- * @return 0 on success; < 0 on error.
+ * @brief read sectors of the inode table; when the reads are shared, the
+ *        request is counted here, under the lock
+ * @return 0 on success; <0 on error
  */
-int inode_scan_print(const struct unix_filesystem *u) {
-  M_REQUIRE_NON_NULL(u);
+static int inode_scan_sectors(struct inode_scan_job *job, uint32_t first, uint32_t count, struct inode *inodes) {
+  const struct unix_filesystem *u = job->u;
+  if (!job->shared) {
+    iostat_tag(u->stats, job->tag);
+    return sector_read_range(u, first, count, inodes);
+  }
 
-  // Go through every sector of the filessystem
-  size_t max_i = (u->s).s_inode_start + (u->s).s_isize;
-  for (int i = (u->s).s_inode_start; i < max_i; ++i) {
+  uint64_t start = (u->stats != NULL) ? iostat_clock() : 0;
+  int read = sector_read_range_shared(u, first, count, inodes);
+  if (read == 0 && u->stats != NULL) {
+    pthread_mutex_lock(&job->lock);
+    iostat_record_class(u->stats, job->tag, 0, (size_t) count * SECTOR_SIZE, iostat_clock() - start);
+    pthread_mutex_unlock(&job->lock);
+  }
+  return read;
+}
 
-    struct inode toBeRead[INODES_PER_SECTOR];
+/**
+ * @brief read a chunk of the inode table; with INODE_SCAN_UNREADABLE, a
+ *        chunk that can't be read is read again one sector at a time
+ * @param readable set to 1 for every sector read, 0 for the others (OUT)
+ * @return the number of sectors of the chunk; <0 on error
+ */
+static int inode_scan_read(struct inode_scan_job *job, uint32_t chunk, struct inode *inodes, int *readable) {
+  const struct unix_filesystem *u = job->u;
+  uint32_t first = chunk * INODE_SCAN_CHUNK_SECTORS;
+  uint32_t count = (u->s).s_isize - first;
+  if (count > INODE_SCAN_CHUNK_SECTORS) count = INODE_SCAN_CHUNK_SECTORS;
+
+  // All the sectors at once
+  int read = inode_scan_sectors(job, (u->s).s_inode_start + first, count, inodes);
+  for (uint32_t k = 0; k < count; ++k) readable[k] = (read == 0);
+  if (read == 0) return count;
+  if (!(job->flags & INODE_SCAN_UNREADABLE)) return read;
+
+  // Else find which ones can't be read
+  for (uint32_t k = 0; k < count; ++k) {
+    readable[k] = inode_scan_sectors(job, (u->s).s_inode_start + first + k, 1, inodes + k * INODES_PER_SECTOR) == 0;
+  }
+  return count;
+}
+
+/**
+ * @brief call back for the inodes of a chunk read by inode_scan_read()
+ * @return 0 to go on; what the callback returned otherwise
+ */
+static int inode_scan_chunk(const struct inode_scan_job *job, uint32_t chunk, const struct inode *inodes,
+                            const int *readable, int count) {
+  for (int k = 0; k < count; ++k) {
+    for (int j = 0; j < INODES_PER_SECTOR; ++j) {
+      uint16_t inr = (uint16_t) ((chunk * INODE_SCAN_CHUNK_SECTORS + k) * INODES_PER_SECTOR + j);
+      const struct inode *inode = readable[k] ? &inodes[k * INODES_PER_SECTOR + j] : NULL;
+      if (inode != NULL && !(inode->i_mode & IALLOC) && !(job->flags & INODE_SCAN_ALL)) continue;
 
-    // Read the ith sector
-    int sector = sector_read(u->f, i, toBeRead);
-    if (sector != 0) {
-      return sector;
+      int result = job->callback(job->ctx, inr, inode);
+      if (result != 0) return result;
     }
+  }
+  return 0;
+}
 
-    // Go through each inode of the current sector
-    // Since the toBeaRead array is composed of 16 buts elements, only need to go
-    // for SECTOR_SIZE / 2 elements
-    for (int j = 0; j < INODES_PER_SECTOR; ++j) {
-      // If the inode exists
-      if (toBeRead[j].i_mode & IALLOC) {
-        // Print it
-        printf("inode   %ld (%s) len   %d\n",
-          (i-(u->s).s_inode_start)*INODES_PER_SECTOR + j, //inode number
-          (toBeRead[j].i_mode & IFDIR) ? SHORT_DIR_NAME : SHORT_FIL_NAME, // type of file of the inode
-          inode_getsize(&toBeRead[j])); // size of the inode
-
-        
-      }
+/**
+ * @brief take chunks until there is none left or a thread failed
+ */
+static void *inode_scan_worker(void *arg) {
+  struct inode_scan_job *job = arg;
+  struct inode inodes[INODE_SCAN_CHUNK_SECTORS * INODES_PER_SECTOR];
+  int readable[INODE_SCAN_CHUNK_SECTORS];
+
+  while (1) {
+    // Take the next chunk; read it at the same time as the others if the disk allows it
+    pthread_mutex_lock(&job->lock);
+    if (job->result != 0 || job->next >= job->chunks) {
+      pthread_mutex_unlock(&job->lock);
+      break;
     }
+    uint32_t chunk = job->next++;
+    int count = job->shared ? 0 : inode_scan_read(job, chunk, inodes, readable);
+    pthread_mutex_unlock(&job->lock);
+    if (job->shared) count = inode_scan_read(job, chunk, inodes, readable);
+
+    // Then go through it with the others
+    int result = count < 0 ? count : inode_scan_chunk(job, chunk, inodes, readable, count);
+    if (result != 0) {
+      pthread_mutex_lock(&job->lock);
+      if (job->result == 0) job->result = result;
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+  }
+  return NULL;
+}
+
+int inode_scan(const struct unix_filesystem *u, int flags, inode_scan_callback callback, void *ctx, int nthreads) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(callback);
+
+  struct inode_scan_job job = {u, flags, callback, ctx, IOSTAT_INODE, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0};
+  if (u->stats != NULL) job.tag = u->stats->current;
+  job.shared = nthreads > 1 && sector_can_share_reads(u) == 1;
+
+  // The table on the disk must hold the inodes still dirty in the cache
+  int sync = inode_sync(u);
+  if (sync != 0) return sync;
+  job.chunks = ((u->s).s_isize + INODE_SCAN_CHUNK_SECTORS - 1) / INODE_SCAN_CHUNK_SECTORS;
+
+  // No more threads than chunks
+  if (nthreads > INODE_SCAN_MAX_THREADS) nthreads = INODE_SCAN_MAX_THREADS;
+  if ((uint32_t) nthreads > job.chunks) nthreads = job.chunks;
+
+  // The calling thread works too; a thread that can't be made is simply missing
+  pthread_t ids[INODE_SCAN_MAX_THREADS];
+  int started = 0;
+  for (int t = 1; t < nthreads; ++t) {
+    if (pthread_create(&ids[started], NULL, inode_scan_worker, &job) == 0) ++started;
   }
+  inode_scan_worker(&job);
+  for (int t = 0; t < started; ++t) pthread_join(ids[t], NULL);
+
+  pthread_mutex_destroy(&job.lock);
+  return job.result;
+}
+
+/**
+ * @brief print one allocated inode, for inode_scan_print()
+ */
+static int inode_scan_print_one(void *ctx, uint16_t inr, const struct inode *inode) {
+  (void) ctx;
+  printf("inode   %d (%s) len   %d\n",
+    inr, //inode number
+    (inode->i_mode & IFDIR) ? SHORT_DIR_NAME : SHORT_FIL_NAME, // type of file of the inode
+    inode_getsize(inode)); // size of the inode
   return 0;
 }
 
+/**
+ * @brief read all inodes from disk and print out their content to
+ *        stdout according to the assignment
+ * @param u the filesystem
+ * @return 0 on success; < 0 on error.
+ */
+int inode_scan_print(const struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(u);
+
+  // One thread, to print them in order
+  iostat_tag(u->stats, IOSTAT_INODE);
+  return inode_scan(u, 0, inode_scan_print_one, NULL, 1);
+}
+
 /**
  * @brief read the content of an inode from disk
  * @param u the filesystem (IN)
@@ -90,21 +219,31 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
   // If the given inode number is >= than the number of allocated inodes, it is unallocated
   if ((u->s).s_isize * INODES_PER_SECTOR <= inr) return ERR_UNALLOCATED_INODE;
 
+  // The in-core copy needs no I/O
+  if (icache_read(u->icache, inr, inode)) {
+    return (inode->i_mode & IALLOC) ? 0 : ERR_UNALLOCATED_INODE;
+  }
+
   // Get the sector where the inode is
   int correctSector = inr / INODES_PER_SECTOR + (u->s).s_inode_start;
   
+  // Access the sector in place if the disk is mapped, otherwise read it
   struct inode toBeRead[INODES_PER_SECTOR];
-
-  // Read the correct sector
-  int sector = sector_read(u->f, correctSector, toBeRead);
-  if (sector != 0) return sector;
+  const struct inode *inodes = sector_get(u, correctSector);
+  if (inodes == NULL) {
+    iostat_tag(u->stats, IOSTAT_INODE);
+    int sector = sector_read(u, correctSector, toBeRead);
+    if (sector != 0) return sector;
+    inodes = toBeRead;
+  }
 
   // Get the inode position inside the sector
   int posOfInode = inr % INODES_PER_SECTOR;
   // Check if the inode is allocated (first check should be ok, but it is great to double check)
-  if (!(toBeRead[posOfInode].i_mode & IALLOC)) return ERR_UNALLOCATED_INODE;
+  if (!(inodes[posOfInode].i_mode & IALLOC)) return ERR_UNALLOCATED_INODE;
 
-  *inode = toBeRead[posOfInode];
+  *inode = inodes[posOfInode];
+  icache_store(u->icache, inr, inode);
 
   return 0;
 }
@@ -138,14 +277,75 @@ int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int
     // Get the indirect sector
     int sectorAddress = i->i_address[file_sec_off / ADDRESSES_PER_SECTOR];
 
+    // Access the indirect sector in place if the disk is mapped, otherwise read it
     uint16_t toBeRead[ADDRESSES_PER_SECTOR];
+    const uint16_t *addresses = sector_get(u, sectorAddress);
+    if (addresses == NULL) {
+      iostat_tag(u->stats, IOSTAT_INODE);
+      int sector = sector_read(u, sectorAddress, toBeRead);
+      if (sector != 0) return sector;
+      addresses = toBeRead;
+    }
 
-    // Read the correct sector
-    int sector = sector_read(u->f, sectorAddress, toBeRead);
-    if (sector != 0) return sector;
+    return addresses[file_sec_off % ADDRESSES_PER_SECTOR];
+  }
+}
+
+int inode_map_range(const struct unix_filesystem *u, const struct inode *inode, int32_t first, int32_t count,
+                    uint32_t *sectors, uint32_t *runs) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(inode);
+  M_REQUIRE_NON_NULL(sectors);
+  if (first < 0 || count < 0) return ERR_BAD_PARAMETER;
+  // Same checks as inode_findsector()
+  if (!(inode->i_mode & IALLOC)) return ERR_UNALLOCATED_INODE;
+  if (inode_getsize(inode) / SECTOR_SIZE > (ADDR_SMALL_LENGTH - 1)*ADDRESSES_PER_SECTOR) return ERR_FILE_TOO_LARGE;
+
+  // Stop at the end of the file
+  int32_t fileSectors = (inode_getsize(inode) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  int32_t n = first < fileSectors ? fileSectors - first : 0;
+  if (n > count) n = count;
+  int small = inode_getsize(inode) / SECTOR_SIZE <= ADDR_SMALL_LENGTH;
+
+  uint16_t toBeRead[ADDRESSES_PER_SECTOR];
+  const uint16_t *addresses = NULL;
+  int32_t loaded = -1;
+  int error = 0;
+  for (int32_t k = 0; k < n && error == 0; ++k) {
+    int32_t offset = first + k;
+
+    // A small file has the addresses of its sectors in the inode
+    if (small) {
+      if (offset >= ADDR_SMALL_LENGTH) error = ERR_BAD_PARAMETER;
+      else sectors[k] = inode->i_address[offset];
+      continue;
+    }
 
-    return toBeRead[file_sec_off % ADDRESSES_PER_SECTOR];
+    // Access every indirect sector once, in place if the disk is mapped
+    int32_t slot = offset / ADDRESSES_PER_SECTOR;
+    if (slot >= ADDR_SMALL_LENGTH) error = ERR_OFFSET_OUT_OF_RANGE;
+    else if (slot != loaded) {
+      addresses = sector_get(u, inode->i_address[slot]);
+      if (addresses == NULL) {
+        iostat_tag(u->stats, IOSTAT_INODE);
+        error = sector_read(u, inode->i_address[slot], toBeRead);
+        addresses = toBeRead;
+      }
+      loaded = slot;
+    }
+    if (error == 0) sectors[k] = addresses[offset % ADDRESSES_PER_SECTOR];
+    // The sectors found before an error are still given
+    else n = k;
+  }
+  if (error != 0 && n == 0) return error;
+
+  // Count the contiguous sectors from the end
+  if (runs != NULL) {
+    for (int32_t k = n - 1; k >= 0; --k) {
+      runs[k] = (k + 1 < n && sectors[k + 1] == sectors[k] + 1) ? runs[k + 1] + 1 : 1;
+    }
   }
+  return n;
 }
 
 /**
@@ -170,12 +370,30 @@ int inode_write(struct unix_filesystem *u, uint16_t inr, struct inode *inode) {
   // If the given inode number is >= than the number of allocated inodes, it is unallocated
   if ((u->s).s_isize * INODES_PER_SECTOR <= inr) return ERR_UNALLOCATED_INODE;
 
+  // The disk changes: umountv6() must write the bitmaps
+  (u->s).s_fmod = 1;
+
+  // Write-back: keep the inode in the cache, write its sector once too many are dirty
+  struct inode_cache *cache = u->icache;
+  if (cache != NULL && cache->dirty_limit > 0) {
+    int kept = icache_write(cache, inr, inode);
+    if (!kept) {
+      // Every entry is dirty or held, make room
+      int sync = inode_sync(u);
+      if (sync != 0) return sync;
+      kept = icache_write(cache, inr, inode);
+    }
+    // Only held entries left: write through below
+    if (kept) return cache->dirty >= cache->dirty_limit ? inode_sync(u) : 0;
+  }
+
   // Get the sector where the inode is
   int correctSector = inr / INODES_PER_SECTOR + (u->s).s_inode_start;
   struct inode toBeRead[INODES_PER_SECTOR];
 
   // Read the correct sector
-  int sector = sector_read(u->f, correctSector, toBeRead);
+  iostat_tag(u->stats, IOSTAT_INODE);
+  int sector = sector_read(u, correctSector, toBeRead);
   if (sector != 0) return sector;
 
   // Get the inode position inside the sector
@@ -184,20 +402,49 @@ int inode_write(struct unix_filesystem *u, uint16_t inr, struct inode *inode) {
   // Write the inode at the correct position
   toBeRead[posOfInode] = *inode;
 
-  // rewrite the sector
-  int tryWrite = sector_write(u->f, correctSector, toBeRead);
+  // rewrite the sector, then the in-core copy (write-through)
+  int tryWrite = sector_write(u, correctSector, toBeRead);
   if (tryWrite != 0) return tryWrite;
+  icache_store(u->icache, inr, inode);
 
   return 0;
 } 
 
+/**
+ * @brief icache_writer used to flush the dirty inodes: one read and one
+ *        write of their sector of the inode table
+ * @param arg the filesystem
+ */
+static int inode_write_back(void *arg, uint32_t index, struct icache_entry *const *entries, size_t n) {
+  const struct unix_filesystem *u = arg;
+  uint32_t correctSector = (u->s).s_inode_start + index;
+  struct inode inodes[INODES_PER_SECTOR];
+
+  int read = sector_read(u, correctSector, inodes);
+  if (read != 0) return read;
+
+  // Patch every dirty inode of the sector
+  for (size_t i = 0; i < n; ++i) {
+    inodes[entries[i]->inr % INODES_PER_SECTOR] = entries[i]->inode;
+  }
+  return sector_write(u, correctSector, inodes);
+}
+
+int inode_sync(const struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(u);
+  if (u->icache == NULL || u->icache->dirty == 0) return 0;
+
+  iostat_tag(u->stats, IOSTAT_INODE);
+  // The cast drops the const of u only for inode_write_back(), which never changes it
+  return icache_flush(u->icache, inode_write_back, (void *) u);
+}
+
 int inode_alloc(struct unix_filesystem *u) {
   M_REQUIRE_NON_NULL(u);
   
-  int getNext = bm_find_next(u->ibm);
+  // Find and take a free inode at once, without a lock
+  int getNext = bm_claim_next(u->ibm);
   if (getNext < 0) return ERR_NOMEM;
-
-  bm_set(u->ibm, getNext);
   
   return getNext;
 }
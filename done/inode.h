@@ -65,6 +65,42 @@ int inode_setsize(struct inode *inode, int new_size);
  */
 void inode_print(const struct inode *inode);
 
+/* flags of inode_scan() */
+#define INODE_SCAN_ALL 0x1         /* also call back for the inodes not allocated */
+#define INODE_SCAN_UNREADABLE 0x2  /* call back with a NULL inode for every inode of a sector that
+                                    * can't be read, instead of stopping with the error */
+
+/* sectors of the inode table read at once by inode_scan() */
+#define INODE_SCAN_CHUNK_SECTORS 64
+/* most threads inode_scan() uses */
+#define INODE_SCAN_MAX_THREADS 16
+
+/**
+ * @brief called by inode_scan() for every inode
+ * @param ctx the ctx given to inode_scan()
+ * @param inr the inode number
+ * @param inode the inode (NULL if its sector can't be read, with INODE_SCAN_UNREADABLE)
+ * @return 0 to go on; anything else stops the scan, which returns it
+ */
+typedef int (*inode_scan_callback)(void *ctx, uint16_t inr, const struct inode *inode);
+
+/**
+ * @brief call back for every allocated inode of the inode table, read
+ *        INODE_SCAN_CHUNK_SECTORS sectors at a time. With more than one
+ *        thread, the chunks are shared by the threads: they read at the same
+ *        time when sector_can_share_reads() allows it, one at a time
+ *        otherwise, and call back at the same time and in any order.
+ *        With one, the inodes come in order.
+ *        The reads are charged to the subsystem tagged by the caller.
+ * @param u the filesystem
+ * @param flags INODE_SCAN_ALL, INODE_SCAN_UNREADABLE or 0
+ * @param callback the function called for every inode
+ * @param ctx its first argument
+ * @param nthreads the number of threads (at most INODE_SCAN_MAX_THREADS, and one per chunk)
+ * @return 0 on success; <0 on error; or what the callback returned to stop
+ */
+int inode_scan(const struct unix_filesystem *u, int flags, inode_scan_callback callback, void *ctx, int nthreads);
+
 /**
  * @brief read all inodes from disk and print out their content to
  *        stdout according to the assignment
@@ -91,6 +127,22 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
  */
 int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off);
 
+/**
+ * @brief identify the sectors that correspond to consecutive portions of
+ *        a file, reading each indirect sector at most once
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN)
+ * @param first the first offset within the file (in sector-size units)
+ * @param count the number of sectors wanted
+ * @param sectors the sectors on disk, at most count of them (OUT)
+ * @param runs if not NULL, runs[k] is the number of sectors from sectors[k]
+ *        on that also follow each other on the disk: they can be read at once (OUT)
+ * @return >=0: the number of sectors found, fewer than count at the end of the file
+ *         or before a sector that can't be found; <0 error on the first sector
+ */
+int inode_map_range(const struct unix_filesystem *u, const struct inode *inode, int32_t first, int32_t count,
+                    uint32_t *sectors, uint32_t *runs);
+
 /**
  * @brief alloc a new inode (returns its inr if possible)
  * @param u the filesystem (IN)
@@ -107,6 +159,14 @@ int inode_alloc(struct unix_filesystem *u);
  */
 int inode_write(struct unix_filesystem *u, uint16_t inr, struct inode *inode);
 
+/**
+ * @brief write to the inode table the inodes kept dirty by a write-back
+ *        inode cache, reading and writing each of their sectors once
+ * @param u the filesystem (IN)
+ * @return 0 on success; <0 on error
+ */
+int inode_sync(const struct unix_filesystem *u);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "iostat.h"
+
+static const char * const IOSTAT_NAMES[IOSTAT_NB_CLASSES] = {
+  "other",
+  "superblock",
+  "inode",
+  "dirent",
+  "file",
+  "bitmap"
+};
+
+struct iostat *iostat_alloc(void) {
+  struct iostat *st = calloc(1, sizeof(struct iostat));
+  if (st == NULL) return NULL;
+  st->current = IOSTAT_OTHER;
+  return st;
+}
+
+void iostat_free(struct iostat *st) {
+  free(st);
+}
+
+void iostat_tag(struct iostat *st, enum iostat_class c) {
+  if (st == NULL || c >= IOSTAT_NB_CLASSES) return;
+  st->current = c;
+}
+
+void iostat_record(struct iostat *st, int write, size_t bytes, uint64_t ns) {
+  iostat_record_class(st, st->current, write, bytes, ns);
+}
+
+void iostat_record_class(struct iostat *st, enum iostat_class c, int write, size_t bytes, uint64_t ns) {
+  if (c >= IOSTAT_NB_CLASSES) c = IOSTAT_OTHER;
+  struct iostat_counters *counters = &st->classes[c];
+
+  if (write) {
+    ++counters->writes;
+    counters->bytes_written += bytes;
+  }
+  else {
+    ++counters->reads;
+    counters->bytes_read += bytes;
+  }
+
+  // Index of the highest bit set: 0 and 1 ns both go in the first bucket
+  int bucket = 0;
+  while (ns > 1 && bucket < IOSTAT_BUCKETS - 1) {
+    ns >>= 1;
+    ++bucket;
+  }
+  ++counters->latency[bucket];
+}
+
+uint64_t iostat_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+void iostat_reset(struct iostat *st) {
+  memset(st->classes, 0, sizeof(st->classes));
+}
+
+void iostat_print(const struct iostat *st) {
+  printf("**********IOSTAT START**********\n");
+  printf("%-12s %10s %10s %12s %13s\n", "subsystem", "reads", "writes", "bytes read", "bytes written");
+  for (int c = 0; c < IOSTAT_NB_CLASSES; ++c) {
+    const struct iostat_counters *counters = &st->classes[c];
+    printf("%-12s %10" PRIu64 " %10" PRIu64 " %12" PRIu64 " %13" PRIu64 "\n", IOSTAT_NAMES[c],
+           counters->reads, counters->writes, counters->bytes_read, counters->bytes_written);
+  }
+
+  // Only the subsystems and the buckets that were used
+  for (int c = 0; c < IOSTAT_NB_CLASSES; ++c) {
+    const struct iostat_counters *counters = &st->classes[c];
+    if (counters->reads + counters->writes == 0) continue;
+
+    printf("latency of %s (ns):\n", IOSTAT_NAMES[c]);
+    for (int b = 0; b < IOSTAT_BUCKETS; ++b) {
+      if (counters->latency[b] == 0) continue;
+      printf("  [%" PRIu64 ", %" PRIu64 "): %" PRIu64 "\n",
+             b == 0 ? (uint64_t) 0 : (uint64_t) 1 << b, (uint64_t) 1 << (b + 1), counters->latency[b]);
+    }
+  }
+  printf("**********IOSTAT END************\n");
+}
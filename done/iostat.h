@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file iostat.h
+ * @brief per-mount statistics of the sector I/O, by subsystem.
+ *
+ * Every layer tags the statistics with its subsystem (iostat_tag()) right
+ * before calling the sector layer, which then records each request:
+ * count, bytes and latency (log2 histogram, in nanoseconds).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum iostat_class {
+    IOSTAT_OTHER,          /* not attributed to any subsystem */
+    IOSTAT_SUPERBLOCK,     /* boot sector and superblock */
+    IOSTAT_INODE,          /* inode table and indirect sectors */
+    IOSTAT_DIRENT,         /* content of the directories */
+    IOSTAT_FILE,           /* content of the regular files */
+    IOSTAT_BITMAP,         /* building the free block and inode bitmaps */
+    IOSTAT_NB_CLASSES
+};
+
+/* bucket i counts the requests that took [2^i, 2^(i+1)) nanoseconds */
+#define IOSTAT_BUCKETS 32
+
+struct iostat_counters {
+    uint64_t reads;                    // read requests (one request may cover several sectors)
+    uint64_t writes;                   // write requests
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t latency[IOSTAT_BUCKETS];  // log2 histogram of the latency of every request
+};
+
+struct iostat {
+    enum iostat_class current;         // subsystem charged for the next requests
+    struct iostat_counters classes[IOSTAT_NB_CLASSES];
+};
+
+/**
+ * @brief allocate statistics, all counters at zero
+ * @return the statistics, NULL on failure
+ */
+struct iostat *iostat_alloc(void);
+
+/**
+ * @brief release statistics
+ * @param st the statistics (may be NULL)
+ */
+void iostat_free(struct iostat *st);
+
+/**
+ * @brief charge the next requests to the given subsystem
+ * @param st the statistics (may be NULL: nothing is done)
+ * @param c the subsystem
+ */
+void iostat_tag(struct iostat *st, enum iostat_class c);
+
+/**
+ * @brief count one request of the current subsystem
+ * @param st the statistics
+ * @param write 1 for a write, 0 for a read
+ * @param bytes the number of bytes transferred
+ * @param ns the time taken by the request, in nanoseconds
+ */
+void iostat_record(struct iostat *st, int write, size_t bytes, uint64_t ns);
+
+/**
+ * @brief same as iostat_record(), for a request of the given subsystem: an
+ *        asynchronous one completes after its subsystem tagged the next ones
+ * @param st the statistics
+ * @param c the subsystem that made the request
+ * @param write 1 for a write, 0 for a read
+ * @param bytes the number of bytes transferred
+ * @param ns the time taken by the request, in nanoseconds
+ */
+void iostat_record_class(struct iostat *st, enum iostat_class c, int write, size_t bytes, uint64_t ns);
+
+/**
+ * @brief current time, for the latency of the requests
+ * @return a monotonic time, in nanoseconds
+ */
+uint64_t iostat_clock(void);
+
+/**
+ * @brief set every counter back to zero
+ * @param st the statistics
+ */
+void iostat_reset(struct iostat *st);
+
+/**
+ * @brief print to stdout the counters and the latency histograms
+ * @param st the statistics
+ */
+void iostat_print(const struct iostat *st);
+
+#ifdef __cplusplus
+}
+#endif
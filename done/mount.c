@@ -8,7 +8,12 @@
 #include <inttypes.h>
 
 #include "filev6.h"
+#include "extent.h"
 #include "inode.h"
+#include "aio.h"
+#include "ramdisk.h"
+#include <stdlib.h>
+#include <stddef.h>
 
 void fill_ibm(struct unix_filesystem* ufs);
 void fill_fbm(struct unix_filesystem* ufs);
@@ -19,25 +24,236 @@ void fill_fbm(struct unix_filesystem* ufs);
  * @return 0 on success; <0 on error
  */
 int mountv6(const char *filename, struct unix_filesystem *u) {
-  M_REQUIRE_NON_NULL(filename);
-  M_REQUIRE_NON_NULL(u);
+  return mountv6_opts(filename, NULL, u);
+}
 
-  // Initialize unix_filesystem struct to 0
-  memset(u, 0, sizeof(*u));
+/**
+ * @brief fill the given options with the ones used by mountv6()
+ * @param opts the options (OUT)
+ */
+void mountv6_default_options(struct mount_options *opts) {
+  if (opts == NULL) return;
+  memset(opts, 0, sizeof(*opts));
+  opts->cache_sectors = MOUNT_DEFAULT_CACHE_SECTORS;
+  opts->cache_inodes = MOUNT_DEFAULT_CACHE_INODES;
+  opts->io = SECTOR_IO_STDIO;
+  opts->read_only = 0;
+  opts->ram_disk = 0;
+  opts->dirty_sectors = 0;
+  opts->dirty_inodes = 0;
+  opts->aio_depth = 0;
+  opts->io_stats = 0;
+  opts->locality = 1;
+}
 
+/**
+ * @brief tell if the superblock reserves, between itself and the inodes,
+ *        enough sectors to keep both bitmaps
+ * @param u the filesystem, with its bitmaps allocated
+ * @return 1 if the bitmaps can be kept on the disk, 0 otherwise
+ */
+static int mountv6_bitmaps_fit(const struct unix_filesystem *u) {
+  const struct superblock *s = &(u->s);
+  if (u->fbm == NULL || u->ibm == NULL || s->s_fbmsize == 0 || s->s_ibmsize == 0) return 0;
+  // Only flat arrays are written as they are
+  if (u->fbm->chunks != NULL || u->ibm->chunks != NULL) return 0;
+
+  // Both areas must be reserved
+  if (s->s_fbm_start <= SUPERBLOCK_SECTOR || s->s_fbm_start + s->s_fbmsize > s->s_inode_start) return 0;
+  if (s->s_ibm_start <= SUPERBLOCK_SECTOR || s->s_ibm_start + s->s_ibmsize > s->s_inode_start) return 0;
+
+  return (uint64_t) s->s_fbmsize * SECTOR_SIZE * 8 >= u->fbm->max - u->fbm->min + 1
+      && (uint64_t) s->s_ibmsize * SECTOR_SIZE * 8 >= u->ibm->max - u->ibm->min + 1;
+}
 
+/**
+ * @brief read a bitmap from its sectors: bit i of the sectors (bit i%8 of
+ *        byte i/8) is the bit of the value min+i
+ * @param u the filesystem
+ * @param bm the bitmap, every bit is replaced (OUT)
+ * @param start the first sector of the bitmap
+ * @param size the number of sectors of the bitmap
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_load_bitmap(struct unix_filesystem *u, struct bmblock_array *bm, uint16_t start, uint16_t size) {
+  uint8_t *bytes = malloc((size_t) size * SECTOR_SIZE);
+  if (bytes == NULL) return ERR_NOMEM;
+
+  iostat_tag(u->stats, IOSTAT_BITMAP);
+  int read = sector_read_range(u, start, size, bytes);
+  if (read == 0) {
+    // Rebuild every word from its bytes, least significant first
+    size_t nbytes = (bm->max - bm->min) / 8 + 1;
+    for (size_t w = 0; w < bm->length; ++w) {
+      uint64_t word = 0;
+      for (size_t b = 0; b < 8 && w * 8 + b < nbytes; ++b) word |= (uint64_t) bytes[w * 8 + b] << (8 * b);
+      bm->bm[w] = word;
+    }
+    bm_rebuild(bm);
+  }
 
-  FILE* file = fopen(filename, "r+b");
-  if (file == NULL) return ERR_IO;
+  free(bytes);
+  return read;
+}
 
-  u->f = file;
+/**
+ * @brief write a bitmap to its sectors, in the format of mountv6_load_bitmap()
+ * @param u the filesystem
+ * @param bm the bitmap
+ * @param unused values of the same range written as unused whatever bm says, NULL if none
+ * @param start the first sector of the bitmap
+ * @param size the number of sectors of the bitmap
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_store_bitmap(struct unix_filesystem *u, const struct bmblock_array *bm,
+                                const struct bmblock_array *unused, uint16_t start, uint16_t size) {
+  uint8_t *bytes = calloc(size, SECTOR_SIZE);
+  if (bytes == NULL) return ERR_NOMEM;
+
+  // Every bit after max stays 0
+  uint64_t nbits = bm->max - bm->min + 1;
+  for (size_t w = 0; w < bm->length; ++w) {
+    uint64_t word = bm->bm[w];
+    if (unused != NULL) word &= ~unused->bm[w];
+    if ((w + 1) * 64 > nbits) word &= (UINT64_C(1) << (nbits % 64)) - 1;
+    for (size_t b = 0; b < 8 && w * 8 + b < (size_t) size * SECTOR_SIZE; ++b) {
+      bytes[w * 8 + b] = (uint8_t) (word >> (8 * b));
+    }
+  }
+
+  int write = 0;
+  iostat_tag(u->stats, IOSTAT_BITMAP);
+  for (uint16_t i = 0; i < size && write == 0; ++i) {
+    write = sector_write(u, start + i, bytes + (size_t) i * SECTOR_SIZE);
+  }
+
+  free(bytes);
+  return write;
+}
+
+/**
+ * @brief tell if the bitmaps of a filesystem are kept on its disk
+ * @param u the mounted filesystem
+ * @return 1 if they are, 0 otherwise
+ */
+static int mountv6_keeps_bitmaps(const struct unix_filesystem *u) {
+  return !(u->s).s_ronly && mountv6_bitmaps_fit(u);
+}
+
+/**
+ * @brief write both bitmaps to the sectors reserved for them
+ * @param u the mounted filesystem
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_write_bitmaps(struct unix_filesystem *u) {
+  // A window of a file still open may never be written: the next mount gets its sectors back
+  int write = mountv6_store_bitmap(u, u->fbm, u->windows, (u->s).s_fbm_start, (u->s).s_fbmsize);
+  if (write != 0) return write;
+  return mountv6_store_bitmap(u, u->ibm, NULL, (u->s).s_ibm_start, (u->s).s_ibmsize);
+}
+
+/**
+ * @brief record in the superblock whether the bitmaps on the disk can be trusted
+ * @param u the mounted filesystem
+ * @param clean 1 once they were written, 0 before they may become stale
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_mark_clean(struct unix_filesystem *u, int clean) {
+  struct superblock su;
+  iostat_tag(u->stats, IOSTAT_SUPERBLOCK);
+  int read = sector_read(u, SUPERBLOCK_SECTOR, &su);
+  if (read != 0) return read;
+
+  su.pad[0] = clean ? MOUNT_CLEAN_MAGIC : 0;
+  return sector_write(u, SUPERBLOCK_SECTOR, &su);
+}
 
+/**
+ * @brief free, in the reverse order of mountv6_setup(), everything a mount
+ *        allocated, then close the disk; nothing is written
+ * @param u the filesystem, mounted or partly mounted
+ * @return 0 on success; ERR_IO if the file could not be closed
+ */
+static int mountv6_release(struct unix_filesystem *u) {
+  extent_index_free(u->extents);
+  u->extents = NULL;
+  bm_free(u->windows);
+  u->windows = NULL;
+  bm_free(u->fbm);
+  u->fbm = NULL;
+  bm_free(u->ibm);
+  u->ibm = NULL;
+  aio_close(u->aio);
+  u->aio = NULL;
+  iostat_free(u->stats);
+  u->stats = NULL;
+  icache_free(u->icache);
+  u->icache = NULL;
+  cache_free(u->cache);
+  u->cache = NULL;
+  sector_detach(u);
+
+  // A disk made in memory has no file
+  int closed = (u->f != NULL) ? fclose(u->f) : 0;
+  u->f = NULL;
+  return closed != 0 ? ERR_IO : 0;
+}
+
+/**
+ * @brief put the sector layer under an open disk and mount the filesystem
+ * @param opts the mount options (IN)
+ * @param inMemory 1 if the backend of u already keeps everything in memory
+ * @param u the filesystem, with u->f open or its backend set (IN/OUT)
+ * @return 0 on success; <0 on error, what was allocated is still in u
+ */
+static int mountv6_setup(const struct mount_options *opts, int inMemory, struct unix_filesystem *u) {
+  u->locality = opts->locality;
+
+  // A RAM disk is already in memory: no I/O method, mapping or cache
+  if (!inMemory) {
+    // Select the I/O method before anything is read
+    int io = sector_set_io(u, opts->io);
+    if (io != 0) return io;
+
+    // A read-only disk is accessed in place, it doesn't need a cache; unless
+    // the reads are asynchronous, which bring the sectors into the cache
+    if (opts->read_only && opts->aio_depth == 0) {
+      int map = sector_map(u);
+      if (map != 0) return map;
+    }
+    // Put the sector cache under every access to the disk
+    else if (opts->cache_sectors > 0) {
+      u->cache = cache_alloc(opts->cache_sectors);
+      if (u->cache == NULL) return ERR_NOMEM;
+
+      // Absorb the writes in the cache until too many sectors are dirty
+      if (opts->dirty_sectors > 0) {
+        int writeBack = sector_set_write_back(u, opts->dirty_sectors);
+        if (writeBack != 0) return writeBack;
+      }
+    }
+  }
+
+  // Keep the inodes read in memory, whatever the disk is
+  if (opts->cache_inodes > 0) {
+    u->icache = icache_alloc(opts->cache_inodes);
+    if (u->icache == NULL) return ERR_NOMEM;
+    // Group the inode writes by sector until too many inodes are dirty
+    u->icache->dirty_limit = opts->dirty_inodes;
+  }
+
+  // Count the requests from the very first one
+  if (opts->io_stats) {
+    u->stats = iostat_alloc();
+    if (u->stats == NULL) return ERR_NOMEM;
+  }
 
   // Since BOOTBLOCK_MAGIC_NUM is a byte, we use an array of bytes
   uint8_t toBeReadBoot[SECTOR_SIZE];
 
   // Read BOOTBLOCK_SECTOR, if error, return it
-  int bootSector = sector_read(u->f, BOOTBLOCK_SECTOR, &toBeReadBoot);
+  iostat_tag(u->stats, IOSTAT_SUPERBLOCK);
+  int bootSector = sector_read(u, BOOTBLOCK_SECTOR, &toBeReadBoot);
   if (bootSector != 0) return bootSector;
 
 
@@ -48,7 +264,7 @@ int mountv6(const char *filename, struct unix_filesystem *u) {
   uint16_t toBeReadSuper[SECTOR_SIZE/2];
 
   // Read SUPERBLOCK_SECTOR, if error return it
-  int superblock = sector_read(file, SUPERBLOCK_SECTOR, &toBeReadSuper);
+  int superblock = sector_read(u, SUPERBLOCK_SECTOR, &toBeReadSuper);
   if (superblock != 0) return superblock;
 
   // Set all fields of the superblock
@@ -62,10 +278,18 @@ int mountv6(const char *filename, struct unix_filesystem *u) {
   (u->s).s_ibm_start = toBeReadSuper[7];
   (u->s).s_flock = toBeReadSuper[8] >> 8;
   (u->s).s_ilock = toBeReadSuper[8] << 8 >> 8;
-  (u->s).s_fmod = toBeReadSuper[9] >> 8;
+  // s_fmod is set again by the first change of this mount
+  (u->s).s_fmod = 0;
   (u->s).s_ronly = toBeReadSuper[9] << 8 >> 8;
   (u->s).s_time[0] = toBeReadSuper[10];
   (u->s).s_time[1] = toBeReadSuper[11];
+  if (opts->read_only) (u->s).s_ronly = 1;
+
+  // Asynchronous I/O, used to prefetch while filling the bitmaps
+  if (opts->aio_depth > 0) {
+    u->aio = aio_open(u, opts->aio_depth);
+    if (u->aio == NULL) return ERR_NOMEM;
+  }
 
   // Allocate fbm and ibm
 
@@ -73,14 +297,86 @@ int mountv6(const char *filename, struct unix_filesystem *u) {
 
   u->fbm = bm_alloc((u->s).s_block_start + 1, (u->s).s_fsize - 1);
 
-  // Fill fbm and ibm
-  fill_ibm(u);
+  if (u->ibm == NULL || u->fbm == NULL) return ERR_NOMEM;
+
+  // No file is open yet, so no sector is in a window
+  u->windows = bm_alloc(u->fbm->min, u->fbm->max);
+  if (u->windows == NULL) return ERR_NOMEM;
+
+  // Read the bitmaps written by the last umount, if it went to the end
+  int clean = toBeReadSuper[offsetof(struct superblock, pad) / sizeof(uint16_t)] == MOUNT_CLEAN_MAGIC
+              && mountv6_bitmaps_fit(u);
+  int loaded = clean
+               && mountv6_load_bitmap(u, u->ibm, (u->s).s_ibm_start, (u->s).s_ibmsize) == 0
+               && mountv6_load_bitmap(u, u->fbm, (u->s).s_fbm_start, (u->s).s_fbmsize) == 0;
+
+  u->bitmaps_loaded = loaded;
+
+  // Otherwise, fill fbm and ibm from the inodes
+  if (!loaded) {
+    fill_ibm(u);
+
+    fill_fbm(u);
+  }
+
+  // From now on the bitmaps on the disk may become stale: say it before anything else is written
+  if (clean && mountv6_keeps_bitmaps(u)) {
+    int mark = mountv6_mark_clean(u, 0);
+    if (mark == 0) mark = sector_sync(u);
+    if (mark != 0) return mark;
+  }
 
-  fill_fbm(u);
+  // Index the free sectors for the allocation of the files
+  u->extents = extent_index_build(u->fbm);
+  if (u->extents == NULL) return ERR_NOMEM;
 
   return 0;
 }
 
+/**
+ * @brief  mount a unix v6 filesystem with the given options
+ * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param opts the mount options, NULL for the defaults of mountv6() (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_opts(const char *filename, const struct mount_options *opts, struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(filename);
+  M_REQUIRE_NON_NULL(u);
+
+  // Use the default options if none are given
+  struct mount_options defaults;
+  mountv6_default_options(&defaults);
+  if (opts == NULL) opts = &defaults;
+
+  // Initialize unix_filesystem struct to 0
+  memset(u, 0, sizeof(*u));
+
+  // A RAM disk never writes to the file
+  FILE* file = fopen(filename, opts->read_only || opts->ram_disk ? "rb" : "r+b");
+  if (file == NULL) return ERR_IO;
+
+  u->f = file;
+
+  // Copy the whole disk in memory, the file is then only used as a handle
+  if (opts->ram_disk) {
+    struct ramdisk *rd = ramdisk_alloc(0);
+    if (rd == NULL) return ERR_NOMEM;
+    int load = ramdisk_load(rd, u->f);
+    if (load == 0) load = sector_set_backend(u, &ramdisk_backend, rd);
+    if (load != 0) {
+      ramdisk_free(rd);
+      mountv6_release(u);
+      return load;
+    }
+  }
+
+  // A failed mount leaves nothing behind
+  int setup = mountv6_setup(opts, opts->ram_disk, u);
+  if (setup != 0) mountv6_release(u);
+  return setup;
+}
+
 /**
  * @brief print to stdout the content of the superblock
  * @param u - the mounted filesytem
@@ -106,59 +402,102 @@ void mountv6_print_superblock(const struct unix_filesystem *u) {
 }
 
 /**
- * @brief umount the given filesystem
+ * @brief write to the disk every inode and sector modified on a write-back mount
  * @param u - the mounted filesytem
  * @return 0 on success; <0 on error
  */
-int umountv6(struct unix_filesystem *u) {
+int mountv6_sync(struct unix_filesystem *u) {
   M_REQUIRE_NON_NULL(u);
-  M_REQUIRE_NON_NULL(u->f);
-  // Try to close
-  int closed = fclose(u->f);
-  // If error return it
-  if (closed != 0) return ERR_IO;
-  
-  u->f = NULL;
+  if (u->backend == NULL) M_REQUIRE_NON_NULL(u->f);
 
-  return 0;
+  // The dirty inodes go to their sectors first
+  int inodes = inode_sync(u);
+  if (inodes != 0) return inodes;
+
+  // The bitmaps go with the other modified sectors, if anything changed
+  if ((u->s).s_fmod && mountv6_keeps_bitmaps(u)) {
+    int write = mountv6_write_bitmaps(u);
+    if (write != 0) return write;
+  }
+  return sector_sync(u);
 }
 
-/*
- * staff only; students will not have to implement
+/**
+ * @brief umount the given filesystem, writing the dirty inodes and sectors first
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error
  */
+int umountv6(struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(u);
+  if (u->backend == NULL) M_REQUIRE_NON_NULL(u->f);
+
+  // The dirty inodes go to their sectors before anything else is written
+  int inodes = inode_sync(u);
+
+  // Leave the bitmaps for the next mount; the volume is clean only once they reached the disk
+  int keep = 0;
+  if (inodes == 0 && mountv6_keeps_bitmaps(u)) {
+    if ((u->s).s_fmod) {
+      keep = mountv6_write_bitmaps(u);
+      if (keep == 0) keep = sector_sync(u);
+      if (keep == 0) keep = mountv6_mark_clean(u, 1);
+    }
+    // Nothing changed: the bitmaps read at mount are still the right ones
+    else if (u->bitmaps_loaded) {
+      keep = mountv6_mark_clean(u, 1);
+    }
+  }
+
+  // No request may complete after the last sync
+  aio_close(u->aio);
+  u->aio = NULL;
+  // Nothing may stay in the cache, but release everything even if it fails
+  int sync = sector_sync(u);
+
+  // Try to close, if error return it
+  int closed = mountv6_release(u);
+  if (closed != 0) return closed;
+
+  if (inodes != 0) return inodes;
+  return keep != 0 ? keep : sync;
+}
+
 /**
- * @brief create a new filesystem
+ * @brief compute the superblock of a new filesystem
+ * @param su the superblock (OUT)
  * @param num_blocks the total number of blocks (= max size of disk), in sectors
  * @param num_inodes the total number of inodes
+ * @return 0 on success; <0 on error
  */
-int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes){
-  M_REQUIRE_NON_NULL(filename);
-
-  // Create the superblock
-  struct superblock su;
-  memset(&su, 0, sizeof(su));
-  su.s_isize = (num_inodes - 1) / INODES_PER_SECTOR + 1;
-  su.s_fsize = num_blocks;
-  if (su.s_fsize < su.s_isize + num_inodes) return ERR_NOT_ENOUGH_BLOCS;
-  su.s_inode_start = SUPERBLOCK_SECTOR + 1;
-  su.s_block_start = su.s_inode_start + su.s_isize;
-
-  // open the file
-  FILE* f = fopen(filename, "wb");
-  if (f == NULL) return ERR_IO;
+static int mkfs_superblock(struct superblock *su, uint16_t num_blocks, uint16_t num_inodes) {
+  memset(su, 0, sizeof(*su));
+  su->s_isize = (num_inodes - 1) / INODES_PER_SECTOR + 1;
+  su->s_fsize = num_blocks;
+  if (su->s_fsize < su->s_isize + num_inodes) return ERR_NOT_ENOUGH_BLOCS;
+  su->s_inode_start = SUPERBLOCK_SECTOR + 1;
+  su->s_block_start = su->s_inode_start + su->s_isize;
+  return 0;
+}
 
+/**
+ * @brief write the boot sector, the superblock and the inodes of a new filesystem
+ * @param u the disk, through any backend
+ * @param su the superblock
+ * @return 0 on success; <0 on error
+ */
+static int mkfs_write(const struct unix_filesystem *u, struct superblock *su) {
   // Set the boot sector
   uint8_t bootSector[SECTOR_SIZE];
   memset(bootSector, 0, SECTOR_SIZE);
   bootSector[BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM;
 
   // Wrtie bootsector
-  int writeBoot = sector_write(f, BOOTBLOCK_SECTOR,bootSector);
-  if (writeBoot != 0){fclose(f);return writeBoot;}
+  int writeBoot = sector_write(u, BOOTBLOCK_SECTOR,bootSector);
+  if (writeBoot != 0) return writeBoot;
 
   // Wrtie superblock
-  int writeSuperBlock = sector_write(f, SUPERBLOCK_SECTOR, &su);
-  if (writeSuperBlock != 0) {fclose(f);return writeSuperBlock;}
+  int writeSuperBlock = sector_write(u, SUPERBLOCK_SECTOR, su);
+  if (writeSuperBlock != 0) return writeSuperBlock;
 
   // Create the first indoe sector with the root inode
   uint16_t rootInode[ADDRESSES_PER_SECTOR];
@@ -167,49 +506,138 @@ int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
   rootInode[16] = IALLOC | IFDIR;
   
   // Write the root inode sector
-  int writeRoot = sector_write(f, su.s_inode_start, rootInode);
-  if (writeRoot != 0) {fclose(f);return writeRoot;}
+  int writeRoot = sector_write(u, su->s_inode_start, rootInode);
+  if (writeRoot != 0) return writeRoot;
 
   // Write all othwer inode sectors
   uint8_t emptyInode[SECTOR_SIZE];
   memset(emptyInode, 0, SECTOR_SIZE);
 
-  for (int sect = su.s_inode_start + 1; sect < su.s_block_start; ++sect) {
-    int writeEmpty = sector_write(f, sect, emptyInode);
-    if (writeEmpty != 0) {fclose(f);return writeEmpty;}
+  for (int sect = su->s_inode_start + 1; sect < su->s_block_start; ++sect) {
+    int writeEmpty = sector_write(u, sect, emptyInode);
+    if (writeEmpty != 0) return writeEmpty;
   }
+  return 0;
+}
+
+/*
+ * staff only; students will not have to implement
+ */
+/**
+ * @brief create a new filesystem
+ * @param num_blocks the total number of blocks (= max size of disk), in sectors
+ * @param num_inodes the total number of inodes
+ */
+int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes){
+  M_REQUIRE_NON_NULL(filename);
+
+  // Create the superblock
+  struct superblock su;
+  int super = mkfs_superblock(&su, num_blocks, num_inodes);
+  if (super != 0) return super;
+
+  // open the file, written with stdio: no backend nor cache
+  struct unix_filesystem disk;
+  memset(&disk, 0, sizeof(disk));
+  disk.f = fopen(filename, "wb");
+  if (disk.f == NULL) return ERR_IO;
+
+  int write = mkfs_write(&disk, &su);
 
   // Close the file
-  fclose(f);
+  fclose(disk.f);
+  return write;
+}
+
+/**
+ * @brief create a new filesystem on a RAM disk and mount it
+ * @param num_blocks the total number of blocks (= max size of disk), in sectors
+ * @param num_inodes the total number of inodes
+ * @param opts the mount options, NULL for the defaults of mountv6() (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_mkfs_ram(uint16_t num_blocks, uint16_t num_inodes, const struct mount_options *opts, struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(u);
+
+  // Use the default options if none are given
+  struct mount_options defaults;
+  mountv6_default_options(&defaults);
+  if (opts == NULL) opts = &defaults;
+
+  memset(u, 0, sizeof(*u));
+
+  struct superblock su;
+  int super = mkfs_superblock(&su, num_blocks, num_inodes);
+  if (super != 0) return super;
+
+  // There is no file at all: u->f stays NULL
+  struct ramdisk *rd = ramdisk_alloc(num_blocks);
+  if (rd == NULL) return ERR_NOMEM;
+  int backend = sector_set_backend(u, &ramdisk_backend, rd);
+  if (backend != 0) {
+    ramdisk_free(rd);
+    return backend;
+  }
+
+  // A failed mount leaves nothing behind
+  int write = mkfs_write(u, &su);
+  if (write == 0) write = mountv6_setup(opts, 1, u);
+  if (write != 0) mountv6_release(u);
+  return write;
+}
+
+/**
+ * @brief mark an inode used in the ibm, for fill_ibm(); an inode that
+ *        can't be read is considered used
+ */
+static int fill_ibm_one(void *ctx, uint16_t inr, const struct inode *inode) {
+  (void) inode;
+  // The ibm is never compressed (at most 2^16 inodes): claiming is thread-safe
+  (void) bm_claim(((struct unix_filesystem *) ctx)->ibm, inr);
   return 0;
 }
-void fill_ibm(struct unix_filesystem* ufs) {
 
-  // For each sector containing inodes
-  size_t max_i = (ufs->s).s_inode_start + (ufs->s).s_isize;
-  for (int i = (ufs->s).s_inode_start; i < max_i; ++i) {
+void fill_ibm(struct unix_filesystem* ufs) {
+  // Every allocated inode; threads only pay off if they read the inode table at the same time
+  int nthreads = sector_can_share_reads(ufs) == 1 ? MOUNT_SCAN_THREADS : 1;
+  iostat_tag(ufs->stats, IOSTAT_BITMAP);
+  (void) inode_scan(ufs, INODE_SCAN_UNREADABLE, fill_ibm_one, ufs, nthreads);
+}
 
-    struct inode toBeRead[INODES_PER_SECTOR];
-    // Read the ith sector
-    int sector = sector_read(ufs->f, i, toBeRead);
-    if (sector != 0) { // If error, we consifer that all inodes are used
-      for (int j = 0; j < INODES_PER_SECTOR; ++j) {
-        bm_set(ufs->ibm, (uint64_t) ((i-(ufs->s).s_inode_start)*INODES_PER_SECTOR + j));
-      }
-    }
-    else {
-      // Go through each inode of the current sector
-      for (int j = 0; j < INODES_PER_SECTOR; ++j) { 
-        // If allocated fill ibm
-        if (toBeRead[j].i_mode & IALLOC) {
-          bm_set(ufs->ibm,  ((i-(ufs->s).s_inode_start)*INODES_PER_SECTOR + j));
-        }
-      }
+/**
+ * @brief bring in the cache, all at once, the indirect sectors that
+ *        fill_fbm() is going to read one after the other
+ * @param ufs the filesystem
+ */
+static void fill_fbm_prefetch(struct unix_filesystem* ufs) {
+  if (ufs->aio == NULL || ufs->cache == NULL) return;
+
+  // Never ask for more than the cache can hold
+  size_t max = ufs->cache->capacity;
+  uint32_t *sectors = malloc(max * sizeof(uint32_t));
+  if (sectors == NULL) return;
+
+  size_t n = 0;
+  for (int i = ufs->ibm->min; i < ufs->ibm->max && n < max; ++i) {
+    struct inode inode;
+    if (bm_get(ufs->ibm, i) != 1 || inode_read(ufs, i, &inode) != 0) continue;
+
+    // Only files using indirect sectors (same test as inode_findsector())
+    if (inode_getsize(&inode) / SECTOR_SIZE <= ADDR_SMALL_LENGTH) continue;
+    for (int j = 0; j < ADDR_SMALL_LENGTH && n < max; ++j) {
+      if (inode.i_address[j] != 0) sectors[n++] = inode.i_address[j];
     }
   }
+
+  // Errors don't matter: fill_fbm() will read again what is missing
+  (void) aio_read_all(ufs->aio, sectors, n, NULL);
+  free(sectors);
 }
 
 void fill_fbm(struct unix_filesystem* ufs) {
+  fill_fbm_prefetch(ufs);
+
   // For each inode
   for (int i = ufs->ibm->min; i < ufs->ibm->max; ++i) {
     // If allocated
@@ -217,37 +645,29 @@ void fill_fbm(struct unix_filesystem* ufs) {
       // Set the sector that contains the inode
       bm_set(ufs->fbm, (uint64_t)i/INODES_PER_SECTOR + ufs->fbm->min);
 
-      struct filev6 fv6;
-  		memset(&fv6, 255, sizeof(fv6));
-
-  		// Try to open the filev6 at the found inode
-  		int openFile = filev6_open(ufs, i, &fv6);
-      if (openFile < 0) continue;
+      struct inode inode;
+      if (inode_read(ufs, i, &inode) != 0) continue;
 
       // Get the size
-      int fileSize = inode_getsize(&(fv6.i_node));
+      int fileSize = inode_getsize(&inode);
       // if we have a medium file, we start by "allocating" every indirect sector in the fbm
       if (fileSize/SECTOR_SIZE > ADDR_SMALL_LENGTH &&  fileSize/SECTOR_SIZE < (ADDR_SMALL_LENGTH-1)*ADDRESSES_PER_SECTOR) {
         for (int j = 0; j < ADDR_SMALL_LENGTH; ++j) {
           
-          bm_set(ufs->fbm, (fv6.i_node).i_address[j]);
+          bm_set(ufs->fbm, inode.i_address[j]);
         }
       }
 
-      // Now we access to every data sector
-      while(1) {
-        
-        // Find the next data sector
-        int mySector = inode_findsector(fv6.u, &(fv6.i_node), fv6.offset / SECTOR_SIZE);
-        // If error or offset out of the file, exit the loop
-        if (mySector < 0 || fv6.offset >= fileSize) break;
-        
-        // "Allocate" the data sector in the fbm
-        else bm_set(ufs->fbm, (uint64_t) mySector);
-        
-        // Move the offset to the new position
-        int toMove = fv6.offset + SECTOR_SIZE > fileSize ? fileSize % SECTOR_SIZE : SECTOR_SIZE;
-        fv6.offset += toMove;
+      // Now "allocate" every data sector, a run of contiguous ones at a time
+      uint32_t sectors[ADDRESSES_PER_SECTOR];
+      uint32_t runs[ADDRESSES_PER_SECTOR];
+      int32_t first = 0;
+      int found;
+      while ((found = inode_map_range(ufs, &inode, first, ADDRESSES_PER_SECTOR, sectors, runs)) > 0) {
+        for (int k = 0; k < found; k += runs[k]) {
+          bm_set_range(ufs->fbm, sectors[k], (uint64_t) sectors[k] + runs[k] - 1);
+        }
+        first += found;
       }
     }
   }
@@ -11,26 +11,106 @@
 #include <stdio.h>
 #include "unixv6fs.h"
 #include "bmblock.h"
+#include "cache.h"
+#include "icache.h"
+#include "sector.h"
+#include "iostat.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct aio_queue;
+struct extent_index;
+
 struct unix_filesystem {
-    FILE *f;
-    struct superblock s;           /* copy of the superblock */
+    FILE *f;                       /* the disk; NULL for a disk that only exists in memory */
+    const struct sector_backend_ops *backend; /* device under the sector layer, NULL to use f with stdio */
+    void *dev;                     /* state of the backend, given to its operations */
+    struct superblock s;           /* copy of the superblock; s_fmod is set once this mount
+                                    * changes the disk (inode_write(), filev6_writesector()) */
     struct bmblock_array *fbm;     /* block bitmmap -- ignore before WEEK 10 */
     struct bmblock_array *ibm;     /* inode bitmap  -- ignore before WEEK 10 */
+    struct extent_index *extents;  /* free extents of fbm, kept in step by filev6; NULL if not built */
+    struct bmblock_array *windows; /* sectors of fbm reserved by the allocation windows of open files
+                                    * and not written yet: the bitmaps on the disk leave them free */
+    struct sector_cache *cache;    /* sector cache, NULL if disabled */
+    struct inode_cache *icache;    /* in-core inodes, NULL if disabled */
+    struct aio_queue *aio;         /* asynchronous sector I/O, NULL if disabled */
+    struct iostat *stats;          /* I/O statistics by subsystem, NULL if disabled */
+    int locality;                  /* allocate the sectors of a file near its other sectors */
+    uint16_t created_inr;          /* last inode made by direntv6_create(), 0 if none */
+    uint32_t created_goal;         /* where the first sector of that inode should go, 0 for anywhere */
+    int bitmaps_loaded;            /* the bitmaps were read from the disk: they stay valid if s_fmod
+                                    * is never set, and umountv6() marks the volume clean again */
 };
 
+/* number of sectors cached by mountv6() */
+#define MOUNT_DEFAULT_CACHE_SECTORS 256
+
+/* number of inodes cached by mountv6() */
+#define MOUNT_DEFAULT_CACHE_INODES 256
+
+/* dirty inodes a write-back mount keeps before writing them */
+#define MOUNT_WRITE_BACK_INODES 64
+
+/* threads reading the inode table when the bitmaps are rebuilt, on a disk
+ * whose reads can be shared (sector_can_share_reads()); one otherwise */
+#define MOUNT_SCAN_THREADS 4
+
+/* dirty sectors a write-back mount keeps before writing them */
+#define MOUNT_WRITE_BACK_SECTORS 64
+
+/* left in pad[0] of the superblock by umountv6() once both bitmaps are
+ * on the disk (s_fbm_start, s_ibm_start): the next mount reads them instead
+ * of rebuilding them from the inodes. Cleared while the volume is mounted
+ * read-write; umountv6() only writes the bitmaps if the mount changed
+ * something, else it just puts back the flag it cleared. */
+#define MOUNT_CLEAN_MAGIC 0x6263
+
+struct mount_options {
+    size_t cache_sectors;          /* capacity of the sector cache, 0 to disable it */
+    size_t cache_inodes;           /* capacity of the inode cache, 0 to disable it */
+    enum sector_io io;             /* how sectors are read and written */
+    int read_only;                 /* never write the disk; it is memory-mapped, without sector
+                                    * cache, unless aio_depth > 0 */
+    int ram_disk;                  /* copy the disk in memory (no cache, no mapping); the
+                                    * file is never written, changes are lost at umount */
+    size_t dirty_sectors;          /* write-back: dirty sectors kept in the cache before they
+                                    * are written, 0 to write through (needs the cache) */
+    size_t dirty_inodes;           /* write-back: dirty inodes kept in the inode cache before
+                                    * their sectors are written, 0 to write through (needs
+                                    * the inode cache) */
+    unsigned aio_depth;            /* requests in flight for asynchronous I/O, 0 to disable it.
+                                    * u must then stay at the same address while mounted */
+    int io_stats;                  /* count the sector requests of every subsystem (u->stats) */
+    int locality;                  /* new sectors go after the last one of their file, or near
+                                    * its directory; 0 to take the first free ones */
+};
+
+/**
+ * @brief fill the given options with the ones used by mountv6()
+ * @param opts the options (OUT)
+ */
+void mountv6_default_options(struct mount_options *opts);
+
 /**
  * @brief  mount a unix v6 filesystem
  * @param filename name of the unixv6 filesystem on the underlying disk (IN)
  * @param u the filesystem (OUT)
- * @return 0 on success; <0 on error
+ * @return 0 on success; <0 on error, and then nothing stays open nor allocated
  */
 int mountv6(const char *filename, struct unix_filesystem *u);
 
+/**
+ * @brief  mount a unix v6 filesystem with the given options
+ * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param opts the mount options, NULL for the defaults of mountv6() (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error, and then nothing stays open nor allocated
+ */
+int mountv6_opts(const char *filename, const struct mount_options *opts, struct unix_filesystem *u);
+
 /**
  * @brief print to stdout the content of the superblock
  * @param u - the mounted filesytem
@@ -38,7 +118,18 @@ int mountv6(const char *filename, struct unix_filesystem *u);
 void mountv6_print_superblock(const struct unix_filesystem *u);
 
 /**
- * @brief umount the given filesystem
+ * @brief write to the disk the bitmaps, if the superblock has room for
+ *        them and the mount changed something, and every inode and sector
+ *        modified on a write-back mount
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error
+ */
+int mountv6_sync(struct unix_filesystem *u);
+
+/**
+ * @brief umount the given filesystem, writing the bitmaps (if the mount
+ *        changed something), the dirty inodes and the dirty sectors first;
+ *        the volume is then marked cleanly unmounted
  * @param u - the mounted filesytem
  * @return 0 on success; <0 on error
  */
@@ -54,6 +145,17 @@ int umountv6(struct unix_filesystem *u);
  */
 int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes);
 
+/**
+ * @brief create a new filesystem on a RAM disk and mount it; nothing is
+ *        ever written to a file
+ * @param num_blocks the total number of blocks (= max size of disk), in sectors
+ * @param num_inodes the total number of inodes
+ * @param opts the mount options, NULL for the defaults of mountv6() (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error, and then nothing stays open nor allocated
+ */
+int mountv6_mkfs_ram(uint16_t num_blocks, uint16_t num_inodes, const struct mount_options *opts, struct unix_filesystem *u);
+
 void fill_ibm(struct unix_filesystem* ufs);
 
 #ifdef __cplusplus
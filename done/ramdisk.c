@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unixv6fs.h"
+#include "error.h"
+#include "ramdisk.h"
+
+struct ramdisk {
+  uint8_t *data;               // the content of the disk
+  size_t nb_sectors;           // number of sectors in data
+};
+
+/**
+ * @brief make the RAM disk hold at least nb_sectors sectors, the new
+ *        sectors are filled with zeros
+ * @return 0 on success; <0 on error
+ */
+static int ramdisk_grow(struct ramdisk *rd, size_t nb_sectors) {
+  if (nb_sectors <= rd->nb_sectors) return 0;
+
+  // At least double the size, so that writing sector after sector stays linear
+  size_t size = rd->nb_sectors * 2;
+  if (size < nb_sectors) size = nb_sectors;
+
+  uint8_t *data = realloc(rd->data, size * SECTOR_SIZE);
+  if (data == NULL) return ERR_NOMEM;
+  memset(data + rd->nb_sectors * SECTOR_SIZE, 0, (size - rd->nb_sectors) * SECTOR_SIZE);
+
+  rd->data = data;
+  rd->nb_sectors = size;
+  return 0;
+}
+
+struct ramdisk *ramdisk_alloc(size_t nb_sectors) {
+  struct ramdisk *rd = calloc(1, sizeof(struct ramdisk));
+  if (rd == NULL) return NULL;
+
+  if (ramdisk_grow(rd, nb_sectors) != 0) {
+    free(rd);
+    return NULL;
+  }
+  return rd;
+}
+
+int ramdisk_load(struct ramdisk *rd, FILE *f) {
+  M_REQUIRE_NON_NULL(rd);
+  M_REQUIRE_NON_NULL(f);
+
+  // Size of the file, in complete sectors
+  if (fseek(f, 0, SEEK_END) != 0) return ERR_IO;
+  long size = ftell(f);
+  if (size < 0 || fseek(f, 0, SEEK_SET) != 0) return ERR_IO;
+  size_t nb_sectors = (size_t) size / SECTOR_SIZE;
+
+  int grow = ramdisk_grow(rd, nb_sectors);
+  if (grow != 0) return grow;
+
+  // Read everything at once
+  if (fread(rd->data, SECTOR_SIZE, nb_sectors, f) != nb_sectors) return ERR_IO;
+  return 0;
+}
+
+void ramdisk_free(struct ramdisk *rd) {
+  if (rd == NULL) return;
+  free(rd->data);
+  free(rd);
+}
+
+/**
+ * @brief sector_backend_ops.read of a RAM disk
+ */
+static int ramdisk_read(void *dev, uint32_t sector, void *data) {
+  struct ramdisk *rd = dev;
+  if (sector >= rd->nb_sectors) return ERR_IO;
+
+  memcpy(data, rd->data + (size_t) sector * SECTOR_SIZE, SECTOR_SIZE);
+  return 0;
+}
+
+/**
+ * @brief sector_backend_ops.write of a RAM disk
+ */
+static int ramdisk_write(void *dev, uint32_t sector, const void *data) {
+  struct ramdisk *rd = dev;
+  int grow = ramdisk_grow(rd, (size_t) sector + 1);
+  if (grow != 0) return grow;
+
+  memcpy(rd->data + (size_t) sector * SECTOR_SIZE, data, SECTOR_SIZE);
+  return 0;
+}
+
+/**
+ * @brief sector_backend_ops.flush of a RAM disk: nothing to do
+ */
+static int ramdisk_flush(void *dev) {
+  (void) dev;
+  return 0;
+}
+
+/**
+ * @brief sector_backend_ops.close of a RAM disk
+ */
+static void ramdisk_close(void *dev) {
+  ramdisk_free(dev);
+}
+
+const struct sector_backend_ops ramdisk_backend = {
+  "ram",
+  ramdisk_read,
+  ramdisk_write,
+  ramdisk_flush,
+  ramdisk_close
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+/**
+ * @file ramdisk.h
+ * @brief sector backend keeping the whole virtual disk in memory.
+ *
+ * Nothing is ever written to a file: the content is lost when the backend
+ * is closed (sector_detach()). Writing past the end makes the disk grow,
+ * as it would with a file.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include "sector.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ramdisk;
+
+/**
+ * @brief the operations of a RAM disk, to give to sector_set_backend()
+ *        with a struct ramdisk * as device
+ */
+extern const struct sector_backend_ops ramdisk_backend;
+
+/**
+ * @brief allocate a RAM disk filled with zeros
+ * @param nb_sectors the initial size of the disk, in sectors
+ * @return the new RAM disk, NULL on failure
+ */
+struct ramdisk *ramdisk_alloc(size_t nb_sectors);
+
+/**
+ * @brief copy every complete sector of a file at the beginning of a RAM disk
+ * @param rd the RAM disk (grows if the file is larger)
+ * @param f the file, read from its beginning
+ * @return 0 on success; <0 on error
+ */
+int ramdisk_load(struct ramdisk *rd, FILE *f);
+
+/**
+ * @brief release all the memory used by a RAM disk
+ * @param rd the RAM disk (may be NULL)
+ */
+void ramdisk_free(struct ramdisk *rd);
+
+#ifdef __cplusplus
+}
+#endif
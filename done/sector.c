@@ -1,53 +1,840 @@
 
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "unixv6fs.h"
 #include "error.h"
+#include "sector.h"
+#include "cache.h"
+#include "iostat.h"
+#include "mount.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// State of sector_file_backend: the FILE* of the disk and how it is accessed
+struct sector_file {
+  FILE *f;
+  int fd;                      // fileno(f), used with SECTOR_IO_PREAD and SECTOR_IO_DIRECT
+  off_t size;                  // SECTOR_IO_DIRECT: size of the file, aligned writes must not extend it
+  enum sector_io io;
+  const uint8_t *map;          // whole disk, when memory-mapped (read-only)
+  size_t map_sectors;          // number of sectors in the mapping
+  pthread_mutex_t pool_lock;   // protects the pool: inode_scan() threads share the disk
+  void *pool[SECTOR_DIRECT_POOL];  // SECTOR_IO_DIRECT: aligned buffers kept instead of allocating one per request
+  int pool_free;               // number of buffers in the pool
+};
 
-// Implemented WEEK 4
 /**
- * @brief read one 512-byte sector from the virtual disk
+ * @brief get the state of the file backend of a disk
+ * @param u the filesystem
+ * @return the state, NULL if the disk is not accessed through sector_file_backend
+ */
+static struct sector_file *sector_file_of(const struct unix_filesystem *u) {
+  return (u->backend == &sector_file_backend) ? u->dev : NULL;
+}
+
+/**
+ * @brief put sector_file_backend under a disk that has no backend yet
+ * @param u the filesystem, with u->f open
+ * @return the state of the file backend, NULL if the disk has another
+ *         backend or if there is no memory left
+ */
+static struct sector_file *sector_file_attach(struct unix_filesystem *u) {
+  if (u->backend == NULL && sector_set_backend(u, &sector_file_backend, NULL) != 0) return NULL;
+  return sector_file_of(u);
+}
+
+/**
+ * @brief get the file descriptor to use for positional reads on a disk
+ * @param file the state of the file backend
+ * @return the file descriptor; <0 on error
+ */
+static int sector_file_fd(struct sector_file *file) {
+  if (file->io == SECTOR_IO_PREAD || file->io == SECTOR_IO_DIRECT) return file->fd;
+
+  // stdio may still hold sectors written with fwrite()
+  if (fflush(file->f) != 0) return ERR_IO;
+  return fileno(file->f);
+}
+
+/**
+ * @brief count a successful request in the statistics of a disk, if it has any
+ * @param u the filesystem
+ * @param write 1 for a write, 0 for a read
+ * @param count the number of sectors transferred
+ * @param start when the request began, from iostat_clock()
+ */
+static void sector_account(const struct unix_filesystem *u, int write, size_t count, uint64_t start) {
+  if (u->stats == NULL) return;
+  iostat_record(u->stats, write, count * SECTOR_SIZE, iostat_clock() - start);
+}
+
+int sector_set_backend(struct unix_filesystem *u, const struct sector_backend_ops *ops, void *dev) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(ops);
+  if (ops != &sector_file_backend) M_REQUIRE_NON_NULL(dev);
+  else M_REQUIRE_NON_NULL(u->f);
+
+  // The backend stays until sector_detach()
+  if (u->backend != NULL) return ERR_BAD_PARAMETER;
+
+  if (ops == &sector_file_backend) {
+    struct sector_file *file = calloc(1, sizeof(struct sector_file));
+    if (file == NULL) return ERR_NOMEM;
+    file->f = u->f;
+    file->fd = -1;
+    file->io = SECTOR_IO_STDIO;
+    if (pthread_mutex_init(&file->pool_lock, NULL) != 0) {
+      free(file);
+      return ERR_NOMEM;
+    }
+    dev = file;
+  }
+  u->backend = ops;
+  u->dev = dev;
+  return 0;
+}
+
+int sector_set_write_back(struct unix_filesystem *u, size_t dirty_limit) {
+  M_REQUIRE_NON_NULL(u);
+  if (u->cache == NULL) return ERR_BAD_PARAMETER;
+
+  // Going back to write-through: nothing may stay dirty
+  if (dirty_limit == 0) {
+    int sync = sector_sync(u);
+    if (sync != 0) return sync;
+  }
+  u->cache->dirty_limit = dirty_limit;
+  return 0;
+}
+
+int sector_set_io(struct unix_filesystem *u, enum sector_io io) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(u->f);
+  if (io != SECTOR_IO_STDIO && io != SECTOR_IO_PREAD && io != SECTOR_IO_DIRECT) return ERR_BAD_PARAMETER;
+
+  struct sector_file *file = sector_file_attach(u);
+  if (file == NULL) return u->backend == NULL ? ERR_NOMEM : ERR_BAD_PARAMETER;
+
+  if (io == SECTOR_IO_PREAD || io == SECTOR_IO_DIRECT) {
+    file->fd = fileno(file->f);
+    if (file->fd < 0) return ERR_IO;
+    // Make sure stdio never holds a stale copy of what we write with pwrite()
+    if (setvbuf(file->f, NULL, _IONBF, 0) != 0) return ERR_IO;
+  }
+
+  if (io == SECTOR_IO_DIRECT) {
+#ifdef O_DIRECT
+    // Bypass the page cache from now on (fails if the filesystem doesn't support it)
+    struct stat st;
+    int flags = fcntl(file->fd, F_GETFL);
+    if (flags < 0 || fstat(file->fd, &st) != 0) return ERR_IO;
+    if (fcntl(file->fd, F_SETFL, flags | O_DIRECT) != 0) return ERR_IO;
+    file->size = st.st_size;
+#else
+    return ERR_BAD_PARAMETER;
+#endif
+  }
+  file->io = io;
+  return 0;
+}
+
+int sector_map(struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(u->f);
+
+  struct sector_file *file = sector_file_attach(u);
+  if (file == NULL) return u->backend == NULL ? ERR_NOMEM : ERR_BAD_PARAMETER;
+  if (file->map != NULL) return 0;
+
+  // Map every complete sector of the file
+  struct stat st;
+  if (fstat(fileno(file->f), &st) != 0) return ERR_IO;
+  size_t nb_sectors = st.st_size / SECTOR_SIZE;
+  if (nb_sectors == 0) return ERR_IO;
+
+  void *map = mmap(NULL, nb_sectors * SECTOR_SIZE, PROT_READ, MAP_SHARED, fileno(file->f), 0);
+  if (map == MAP_FAILED) return ERR_IO;
+
+  file->map = map;
+  file->map_sectors = nb_sectors;
+  return 0;
+}
+
+const void *sector_get(const struct unix_filesystem *u, uint32_t sector) {
+  if (u == NULL) return NULL;
+
+  struct sector_file *file = sector_file_of(u);
+  if (file == NULL || file->map == NULL || sector >= file->map_sectors) return NULL;
+
+  return file->map + (size_t) sector * SECTOR_SIZE;
+}
+
+int sector_lookup(const struct unix_filesystem *u, uint32_t sector, void *data) {
+  if (u == NULL || data == NULL) return 0;
+
+  struct sector_file *file = sector_file_of(u);
+  if (file != NULL && file->map != NULL) {
+    if (sector >= file->map_sectors) return 0;
+    memcpy(data, file->map + (size_t) sector * SECTOR_SIZE, SECTOR_SIZE);
+    return 1;
+  }
+  return u->cache != NULL && cache_read(u->cache, sector, data);
+}
+
+void sector_update(const struct unix_filesystem *u, uint32_t sector, const void *data) {
+  if (u == NULL || data == NULL) return;
+
+  if (u->cache != NULL) cache_store(u->cache, sector, data);
+}
+
+int sector_fileno(const struct unix_filesystem *u, int write) {
+  M_REQUIRE_NON_NULL(u);
+
+  struct sector_file *file = sector_file_of(u);
+  if (file == NULL || file->map != NULL) return ERR_BAD_PARAMETER;
+  if (write && file->io != SECTOR_IO_PREAD) return ERR_BAD_PARAMETER;
+  // Requests of one sector don't meet the alignment rules of O_DIRECT
+  if (file->io == SECTOR_IO_DIRECT) return ERR_BAD_PARAMETER;
+
+  // Whatever is done with the descriptor must see the sectors not written yet
+  if (write) {
+    int sync = sector_sync(u);
+    if (sync != 0) return sync;
+  }
+
+  int fd = sector_file_fd(file);
+  return fd < 0 ? ERR_IO : fd;
+}
+
+void sector_detach(struct unix_filesystem *u) {
+  if (u == NULL || u->backend == NULL) return;
+
+  u->backend->close(u->dev);
+  u->backend = NULL;
+  u->dev = NULL;
+}
+
+/**
+ * @brief read or write one sector at its position, without moving any cursor
+ * @param fd the file descriptor of the disk
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data the sector content (OUT when reading, IN when writing)
+ * @param write 1 to write, 0 to read
+ * @return 0 on success; <0 on error
+ */
+static int sector_pio(int fd, uint32_t sector, void *data, int write) {
+  size_t done = 0;
+  off_t offset = (off_t) sector * SECTOR_SIZE;
+
+  // pread/pwrite may transfer less than asked, loop until the sector is complete
+  while (done < SECTOR_SIZE) {
+    ssize_t n = write
+      ? pwrite(fd, (const char *) data + done, SECTOR_SIZE - done, offset + done)
+      : pread(fd, (char *) data + done, SECTOR_SIZE - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return ERR_IO;
+    done += n;
+  }
+  return 0;
+}
+
+/**
+ * @brief take a SECTOR_DIRECT_BUFFER bytes buffer aligned on SECTOR_DIRECT_ALIGN
+ *        from the pool of a disk, or a new one if the pool is empty
+ * @param file the state of the file backend
+ * @return the buffer, NULL if there is no memory left
+ */
+static uint8_t *sector_pool_get(struct sector_file *file) {
+  void *buf = NULL;
+  pthread_mutex_lock(&file->pool_lock);
+  if (file->pool_free > 0) buf = file->pool[--file->pool_free];
+  pthread_mutex_unlock(&file->pool_lock);
+  if (buf != NULL) return buf;
+
+  // Allocate outside of the lock
+  if (posix_memalign(&buf, SECTOR_DIRECT_ALIGN, SECTOR_DIRECT_BUFFER) != 0) return NULL;
+  return buf;
+}
+
+/**
+ * @brief give back a buffer taken with sector_pool_get()
+ * @param file the state of the file backend
+ * @param buf the buffer
+ */
+static void sector_pool_put(struct sector_file *file, uint8_t *buf) {
+  pthread_mutex_lock(&file->pool_lock);
+  int kept = file->pool_free < SECTOR_DIRECT_POOL;
+  if (kept) file->pool[file->pool_free++] = buf;
+  pthread_mutex_unlock(&file->pool_lock);
+  if (!kept) free(buf);
+}
+
+/**
+ * @brief copy between a list of buffers and contiguous memory, moving a cursor
+ * @param iov the buffers
+ * @param k index of the current buffer (IN-OUT)
+ * @param off offset in the current buffer (IN-OUT)
+ * @param mem the contiguous memory
+ * @param len the number of bytes to copy
+ * @param toIov 1 to copy from mem to the buffers, 0 the other way
+ */
+static void sector_iov_copy(const struct iovec *iov, int *k, size_t *off, uint8_t *mem, size_t len, int toIov) {
+  while (len > 0) {
+    size_t part = iov[*k].iov_len - *off;
+    if (part > len) part = len;
+    uint8_t *at = (uint8_t *) iov[*k].iov_base + *off;
+    if (toIov) memcpy(at, mem, part);
+    else memcpy(mem, at, part);
+    mem += part;
+    len -= part;
+    *off += part;
+    if (*off == iov[*k].iov_len) {
+      ++*k;
+      *off = 0;
+    }
+  }
+}
+
+/**
+ * @brief read aligned bytes with O_DIRECT; a short read only happens at
+ *        the end of the file, what is missing is filled with zeros
+ * @return the number of bytes really read; <0 on error
+ */
+static ssize_t sector_direct_pread(int fd, uint8_t *buf, size_t len, off_t offset) {
+  ssize_t got;
+  do {
+    got = pread(fd, buf, len, offset);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) return ERR_IO;
+
+  memset(buf + got, 0, len - got);
+  return got;
+}
+
+/**
+ * @brief read or write consecutive sectors with O_DIRECT. The transfer is
+ *        widened to whole aligned blocks in a buffer of the pool; a write
+ *        not covering its first or last block reads it first
+ *        (read-modify-write).
+ * @param file the state of the file backend
+ * @param first the first sector
+ * @param iov the sectors content, one buffer after the other (OUT when reading, IN when writing)
+ * @param n the number of buffers
+ * @param write 1 to write, 0 to read
+ * @return 0 on success; <0 on error
+ */
+static int sector_direct(struct sector_file *file, uint32_t first, const struct iovec *iov, int n, int write) {
+  size_t total = 0;
+  for (int i = 0; i < n; ++i) total += iov[i].iov_len;
+
+  uint8_t *buf = sector_pool_get(file);
+  if (buf == NULL) return ERR_NOMEM;
+
+  off_t pos = (off_t) first * SECTOR_SIZE;
+  off_t end = pos + total;
+  int k = 0;
+  size_t off = 0;
+  int result = 0;
+  while (result == 0 && pos < end) {
+    // The aligned blocks holding [pos, stop), at most one buffer
+    off_t start = pos / SECTOR_DIRECT_ALIGN * SECTOR_DIRECT_ALIGN;
+    off_t stop = (end - start > SECTOR_DIRECT_BUFFER) ? start + SECTOR_DIRECT_BUFFER : end;
+    size_t len = (stop - start + SECTOR_DIRECT_ALIGN - 1) / SECTOR_DIRECT_ALIGN * SECTOR_DIRECT_ALIGN;
+    size_t skip = pos - start;
+
+    if (!write) {
+      ssize_t got = sector_direct_pread(file->fd, buf, len, start);
+      if (got < 0) result = (int) got;
+      else if (got < stop - start) result = ERR_IO;
+      else sector_iov_copy(iov, &k, &off, buf + skip, stop - pos, 1);
+    }
+    else {
+      // Keep what is around the sectors in the first and last blocks
+      size_t last = len - SECTOR_DIRECT_ALIGN;
+      if (skip > 0 && sector_direct_pread(file->fd, buf, SECTOR_DIRECT_ALIGN, start) < 0) result = ERR_IO;
+      if (result == 0 && (size_t) (stop - start) < len && (last > 0 || skip == 0)
+          && sector_direct_pread(file->fd, buf + last, SECTOR_DIRECT_ALIGN, start + last) < 0) result = ERR_IO;
+
+      if (result == 0) {
+        sector_iov_copy(iov, &k, &off, buf + skip, stop - pos, 0);
+        ssize_t put;
+        do {
+          put = pwrite(file->fd, buf, len, start);
+        } while (put < 0 && errno == EINTR);
+        if (put != (ssize_t) len) result = ERR_IO;
+      }
+
+      // The padding of the last block may not grow the file
+      if (result == 0) {
+        if (stop > file->size) file->size = stop;
+        if (start + (off_t) len > file->size && ftruncate(file->fd, file->size) != 0) result = ERR_IO;
+      }
+    }
+    pos = stop;
+  }
+
+  sector_pool_put(file, buf);
+  return result;
+}
+
+/**
+ * @brief read one sector from the underlying file, bypassing the cache
  * @param f open file of the virtual disk
+ * @param file the state of the file backend, NULL for plain stdio on f
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (OUT)
  * @return 0 on success; <0 on error
  */
-int sector_read(FILE *f, uint32_t sector, void *data) {
-  M_REQUIRE_NON_NULL(f);
-  M_REQUIRE_NON_NULL(data);
+static int sector_read_file(FILE *f, struct sector_file *file, uint32_t sector, void *data) {
+  if (file != NULL && file->io == SECTOR_IO_DIRECT) {
+    struct iovec iov = {data, SECTOR_SIZE};
+    return sector_direct(file, sector, &iov, 1, 0);
+  }
+  if (file != NULL && file->io == SECTOR_IO_PREAD) {
+    // Read directly at the position of the sector
+    return sector_pio(file->fd, sector, data, 0);
+  }
 
   // Move the cursor at the correct position in the file
   int cursor = fseek(f, sector*SECTOR_SIZE, SEEK_SET);
   if (cursor != 0) return ERR_IO;
 
   // Read one sector starting at the position of the cursor
-  int read = fread(data, SECTOR_SIZE, 1, f);
-  if (read != 1) return ERR_IO;
+  return (fread(data, SECTOR_SIZE, 1, f) == 1) ? 0 : ERR_IO;
+}
+
+/**
+ * @brief write one sector to the underlying file, bypassing the cache
+ * @param f open file of the virtual disk
+ * @param file the state of the file backend, NULL for plain stdio on f
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+static int sector_write_file(FILE *f, struct sector_file *file, uint32_t sector, const void *data) {
+  if (file != NULL && file->io == SECTOR_IO_DIRECT) {
+    struct iovec iov = {(void *) data, SECTOR_SIZE};
+    return sector_direct(file, sector, &iov, 1, 1);
+  }
+  if (file != NULL && file->io == SECTOR_IO_PREAD) {
+    // Write directly at the position of the sector
+    return sector_pio(file->fd, sector, (void *) data, 1);
+  }
+
+  // Move the cursor at the correct position
+  int cursor = fseek(f, sector*SECTOR_SIZE, SEEK_SET);
+  if (cursor != 0) return ERR_IO;
+
+  // Write the sector
+  return (fwrite(data, SECTOR_SIZE, 1, f) == 1) ? 0 : ERR_IO;
+}
+
+/**
+ * @brief sector_backend_ops.read of sector_file_backend
+ * @param dev the state of the file backend
+ */
+static int sector_file_read(void *dev, uint32_t sector, void *data) {
+  struct sector_file *file = dev;
+  return sector_read_file(file->f, file, sector, data);
+}
+
+/**
+ * @brief sector_backend_ops.write of sector_file_backend
+ * @param dev the state of the file backend
+ */
+static int sector_file_write(void *dev, uint32_t sector, const void *data) {
+  struct sector_file *file = dev;
+  return sector_write_file(file->f, file, sector, data);
+}
+
+/**
+ * @brief sector_backend_ops.flush of sector_file_backend: empty the stdio buffer
+ * @param dev the state of the file backend
+ */
+static int sector_file_flush(void *dev) {
+  struct sector_file *file = dev;
+  return fflush(file->f) == 0 ? 0 : ERR_IO;
+}
+
+/**
+ * @brief sector_backend_ops.close of sector_file_backend: remove the
+ *        mapping and free the state with its pool; the FILE* belongs to
+ *        whoever opened it
+ * @param dev the state of the file backend
+ */
+static void sector_file_close(void *dev) {
+  struct sector_file *file = dev;
+  if (file->map != NULL) munmap((void *) file->map, file->map_sectors * SECTOR_SIZE);
+  while (file->pool_free > 0) free(file->pool[--file->pool_free]);
+  pthread_mutex_destroy(&file->pool_lock);
+  free(file);
+}
+
+const struct sector_backend_ops sector_file_backend = {
+  "file",
+  sector_file_read,
+  sector_file_write,
+  sector_file_flush,
+  sector_file_close
+};
+
+/**
+ * @brief sector_read() without counting the request
+ */
+static int sector_read_disk(const struct unix_filesystem *u, uint32_t sector, void *data) {
+  struct sector_cache *cache = u->cache;
+  struct sector_file *file = sector_file_of(u);
+
+  // A mapped disk is already in memory
+  if (file != NULL && file->map != NULL) {
+    if (sector >= file->map_sectors) return ERR_IO;
+    memcpy(data, file->map + (size_t) sector * SECTOR_SIZE, SECTOR_SIZE);
+    return 0;
+  }
+
+  // If the sector is already in memory, no need to touch the disk
+  if (cache != NULL && cache_read(cache, sector, data)) return 0;
+
+  // Ask the device
+  int read = (u->backend != NULL) ? u->backend->read(u->dev, sector, data)
+                                  : sector_read_file(u->f, NULL, sector, data);
+  if (read != 0) return read;
+
+  // Keep it for the next time
+  if (cache != NULL) cache_store(cache, sector, data);
 
   return 0;
 }
 
+// Implemented WEEK 4
+/**
+ * @brief read one 512-byte sector from the virtual disk
+ * @param u the filesystem, with its disk open
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read(const struct unix_filesystem *u, uint32_t sector, void *data) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(data);
+  if (u->backend == NULL) M_REQUIRE_NON_NULL(u->f);
+
+  uint64_t start = (u->stats != NULL) ? iostat_clock() : 0;
+
+  int read = sector_read_disk(u, sector, data);
+  if (read == 0) sector_account(u, 0, 1, start);
+  return read;
+}
+
+
+/**
+ * @brief cache_writer used to flush the dirty sectors of a disk
+ * @param arg the filesystem
+ */
+static int sector_write_back(void *arg, uint32_t sector, const void *data) {
+  const struct unix_filesystem *u = arg;
+  return u->backend != NULL ? u->backend->write(u->dev, sector, data)
+                            : sector_write_file(u->f, NULL, sector, data);
+}
+
+int sector_sync(const struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(u);
+  if (u->backend == NULL) M_REQUIRE_NON_NULL(u->f);
+
+  // Write the dirty sectors in ascending order, then flush the device
+  if (u->cache != NULL) {
+    int flush = cache_flush(u->cache, sector_write_back, (void *) u);
+    if (flush != 0) return flush;
+  }
+  if (u->backend == NULL) return fflush(u->f) == 0 ? 0 : ERR_IO;
+  return u->backend->flush(u->dev);
+}
+
+/**
+ * @brief sector_write() without counting the request
+ */
+static int sector_write_disk(const struct unix_filesystem *u, uint32_t sector, const void *data) {
+  struct sector_cache *cache = u->cache;
+  struct sector_file *file = sector_file_of(u);
+
+  // The mapping is read-only
+  if (file != NULL && file->map != NULL) return ERR_READ_ONLY;
+
+  // Write-back: keep the sector in the cache, flush once too many are dirty
+  if (cache != NULL && cache->dirty_limit > 0) {
+    if (!cache_write(cache, sector, data)) {
+      // Every entry is dirty, make room
+      int sync = sector_sync(u);
+      if (sync != 0) return sync;
+      cache_write(cache, sector, data);
+    }
+    return cache->dirty >= cache->dirty_limit ? sector_sync(u) : 0;
+  }
+
+  int write = sector_write_back((void *) u, sector, data);
+
+  // The cached copy is no longer valid if the write failed
+  if (write != 0) {
+    if (cache != NULL) cache_invalidate(cache, sector);
+    return write;
+  }
+
+  // The cache is write-through: keep the new content
+  if (cache != NULL) cache_store(cache, sector, data);
+
+  return 0;
+}
 
 // Implemented WEEK 11
 /**
  * @brief read one 512-byte sector from the virtual disk
- * @param f open file of the virtual disk
+ * @param u the filesystem, with its disk open
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (IN)
  * @return 0 on success; <0 on error
  */
-int sector_write(FILE *f, uint32_t sector, void *data){
-  M_REQUIRE_NON_NULL(f);
+int sector_write(const struct unix_filesystem *u, uint32_t sector, void *data){
+  M_REQUIRE_NON_NULL(u);
   M_REQUIRE_NON_NULL(data);
-  
-  // Move the cursor at the correct position
-  int cursor = fseek(f, sector*SECTOR_SIZE, SEEK_SET);
-  if (cursor != 0) return ERR_IO;
+  if (u->backend == NULL) M_REQUIRE_NON_NULL(u->f);
 
-  // Write the sector
-  int write = fwrite(data, SECTOR_SIZE, 1, f);
-  if (write != 1) return ERR_IO;
-	
- 
+  uint64_t start = (u->stats != NULL) ? iostat_clock() : 0;
+
+  int write = sector_write_disk(u, sector, data);
+  if (write == 0) sector_account(u, 1, 1, start);
+  return write;
+}
 
+// One sector of a sector_read_list() request
+struct sector_req {
+  uint32_t sector;
+  void *buf;
+};
+
+/**
+ * @brief compare two requests by sector number, for qsort()
+ */
+static int sector_req_cmp(const void *a, const void *b) {
+  uint32_t x = ((const struct sector_req *) a)->sector;
+  uint32_t y = ((const struct sector_req *) b)->sector;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief read consecutive sectors into the given buffers with preadv()
+ * @param fd the file descriptor of the disk
+ * @param first the first sector to read
+ * @param iov the buffers, filled one after the other (modified)
+ * @param n the number of buffers
+ * @return 0 on success; <0 on error
+ */
+static int sector_preadv(int fd, uint32_t first, struct iovec *iov, int n) {
+  off_t offset = (off_t) first * SECTOR_SIZE;
+
+  // preadv may read less than asked, continue where it stopped
+  while (n > 0) {
+    ssize_t got = preadv(fd, iov, n, offset);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return ERR_IO;
+    offset += got;
+
+    // Skip the buffers that are complete, then adjust the partially filled one
+    while (n > 0 && (size_t) got >= iov->iov_len) {
+      got -= iov->iov_len;
+      ++iov;
+      --n;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + got;
+      iov->iov_len -= got;
+    }
+  }
   return 0;
 }
+
+/**
+ * @brief read consecutive sectors of a file disk into the given buffers,
+ *        with the method of the disk
+ * @param file the state of the file backend
+ * @param fd the file descriptor of the disk
+ * @param first the first sector to read
+ * @param iov the buffers, filled one after the other (modified)
+ * @param n the number of buffers
+ * @return 0 on success; <0 on error
+ */
+static int sector_readv(struct sector_file *file, int fd, uint32_t first, struct iovec *iov, int n) {
+  if (file->io == SECTOR_IO_DIRECT) return sector_direct(file, first, iov, n, 0);
+  return sector_preadv(fd, first, iov, n);
+}
+
+/**
+ * @brief sector_read_range() without counting the request
+ */
+static int sector_read_range_disk(const struct unix_filesystem *u, uint32_t first, uint32_t count, void *buf) {
+  uint8_t *bytes = buf;
+  struct sector_file *file = sector_file_of(u);
+
+  // Not a file with its own backend: one sector at a time
+  if (file == NULL) {
+    for (uint32_t i = 0; i < count; ++i) {
+      int read = sector_read_disk(u, first + i, bytes + (size_t) i * SECTOR_SIZE);
+      if (read != 0) return read;
+    }
+    return 0;
+  }
+
+  // A mapped disk is already in memory
+  if (file->map != NULL) {
+    if ((uint64_t) first + count > file->map_sectors) return ERR_IO;
+    memcpy(buf, file->map + (size_t) first * SECTOR_SIZE, (size_t) count * SECTOR_SIZE);
+    return 0;
+  }
+
+  int fd = sector_file_fd(file);
+  if (fd < 0) return ERR_IO;
+
+  struct sector_cache *cache = u->cache;
+  uint32_t i = 0;
+  while (i < count) {
+    // Sectors found in the cache are simply copied
+    if (cache != NULL && cache_read(cache, first + i, bytes + (size_t) i * SECTOR_SIZE)) {
+      ++i;
+      continue;
+    }
+
+    // Extend the run of missing sectors until one is found in the cache
+    uint32_t end = i + 1;
+    int nextCached = 0;
+    while (end < count && !nextCached) {
+      if (cache != NULL && cache_read(cache, first + end, bytes + (size_t) end * SECTOR_SIZE)) nextCached = 1;
+      else ++end;
+    }
+
+    // Read the whole run at once
+    struct iovec iov = {bytes + (size_t) i * SECTOR_SIZE, (size_t) (end - i) * SECTOR_SIZE};
+    int read = sector_readv(file, fd, first + i, &iov, 1);
+    if (read != 0) return read;
+
+    if (cache != NULL) {
+      for (uint32_t k = i; k < end; ++k) cache_store(cache, first + k, bytes + (size_t) k * SECTOR_SIZE);
+    }
+    i = end + nextCached;
+  }
+  return 0;
+}
+
+int sector_read_range(const struct unix_filesystem *u, uint32_t first, uint32_t count, void *buf) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(buf);
+  if (u->backend == NULL) M_REQUIRE_NON_NULL(u->f);
+
+  uint64_t start = (u->stats != NULL) ? iostat_clock() : 0;
+
+  int read = sector_read_range_disk(u, first, count, buf);
+  if (read == 0) sector_account(u, 0, count, start);
+  return read;
+}
+
+int sector_can_share_reads(const struct unix_filesystem *u) {
+  M_REQUIRE_NON_NULL(u);
+  struct sector_file *file = sector_file_of(u);
+
+  // Positional reads and copies from the mapping share no state, the cache does
+  if (file == NULL || u->cache != NULL) return 0;
+  return file->map != NULL || file->io == SECTOR_IO_PREAD || file->io == SECTOR_IO_DIRECT;
+}
+
+int sector_read_range_shared(const struct unix_filesystem *u, uint32_t first, uint32_t count, void *buf) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(buf);
+  if (sector_can_share_reads(u) != 1) return ERR_BAD_PARAMETER;
+
+  return sector_read_range_disk(u, first, count, buf);
+}
+
+/**
+ * @brief sector_read_list() without counting the request
+ */
+static int sector_read_list_disk(const struct unix_filesystem *u, const uint32_t *sectors,
+                                 size_t count, void * const *bufs) {
+  struct sector_file *file = sector_file_of(u);
+
+  // Not a file with its own backend or disk already in memory: one sector at a time
+  if (file == NULL || file->map != NULL) {
+    for (size_t i = 0; i < count; ++i) {
+      int read = sector_read_disk(u, sectors[i], bufs[i]);
+      if (read != 0) return read;
+    }
+    return 0;
+  }
+
+  struct sector_req *reqs = malloc(count * sizeof(struct sector_req));
+  struct iovec *iov = malloc((count < IOV_MAX ? count : IOV_MAX) * sizeof(struct iovec));
+  if (reqs == NULL || iov == NULL) {
+    free(reqs);
+    free(iov);
+    return ERR_NOMEM;
+  }
+
+  // Keep only the sectors that are not in the cache, sorted
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (u->cache == NULL || !cache_read(u->cache, sectors[i], bufs[i])) {
+      reqs[n].sector = sectors[i];
+      reqs[n].buf = bufs[i];
+      ++n;
+    }
+  }
+  qsort(reqs, n, sizeof(struct sector_req), sector_req_cmp);
+
+  int result = 0;
+  int fd = (n > 0) ? sector_file_fd(file) : 0;
+  if (fd < 0) result = ERR_IO;
+
+  size_t i = 0;
+  while (result == 0 && i < n) {
+    // Merge the adjacent sectors (a repeated sector starts a new run)
+    size_t end = i + 1;
+    while (end < n && end - i < IOV_MAX && reqs[end].sector == reqs[end - 1].sector + 1) ++end;
+
+    for (size_t k = i; k < end; ++k) {
+      iov[k - i].iov_base = reqs[k].buf;
+      iov[k - i].iov_len = SECTOR_SIZE;
+    }
+    result = sector_readv(file, fd, reqs[i].sector, iov, (int) (end - i));
+
+    if (result == 0 && u->cache != NULL) {
+      for (size_t k = i; k < end; ++k) cache_store(u->cache, reqs[k].sector, reqs[k].buf);
+    }
+    i = end;
+  }
+
+  free(reqs);
+  free(iov);
+  return result;
+}
+
+int sector_read_list(const struct unix_filesystem *u, const uint32_t *sectors, size_t count, void * const *bufs) {
+  M_REQUIRE_NON_NULL(u);
+  M_REQUIRE_NON_NULL(sectors);
+  M_REQUIRE_NON_NULL(bufs);
+  if (u->backend == NULL) M_REQUIRE_NON_NULL(u->f);
+  if (count == 0) return 0;
+
+  uint64_t start = (u->stats != NULL) ? iostat_clock() : 0;
+
+  int read = sector_read_list_disk(u, sectors, count, bufs);
+  if (read == 0) sector_account(u, 0, count, start);
+  return read;
+}
@@ -10,31 +10,221 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include "cache.h"
+#include "iostat.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct unix_filesystem;
+
 // Implemented WEEK 4
 /**
  * @brief read one 512-byte sector from the virtual disk
- * @param f open file of the virtual disk
+ * @param u the filesystem: through its backend and its cache, or with
+ *        stdio on u->f if it has no backend
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (OUT)
  * @return 0 on success; <0 on error
  */
-int sector_read(FILE *f, uint32_t sector, void *data);
+int sector_read(const struct unix_filesystem *u, uint32_t sector, void *data);
 
 
 // Implemented WEEK 11
 /**
- * @brief read one 512-byte sector from the virtual disk
- * @param f open file of the virtual disk
+ * @brief write one 512-byte sector to the virtual disk
+ * @param u the filesystem: through its backend and its cache, or with
+ *        stdio on u->f if it has no backend
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (IN)
  * @return 0 on success; <0 on error
  */
-int sector_write(FILE *f, uint32_t sector, void  *data);
+int sector_write(const struct unix_filesystem *u, uint32_t sector, void  *data);
+
+/**
+ * @brief how sector_read()/sector_write() access an attached disk
+ */
+enum sector_io {
+    SECTOR_IO_STDIO,   /* fseek() + fread()/fwrite() on the FILE* (default) */
+    SECTOR_IO_PREAD,   /* pread()/pwrite() on its file descriptor: no shared cursor, no stdio buffer */
+    SECTOR_IO_DIRECT   /* same with O_DIRECT, bypassing the page cache: transfers go through
+                        * SECTOR_DIRECT_ALIGN-aligned buffers, partial blocks are read-modify-written */
+};
+
+/**
+ * @brief alignment of the offsets, lengths and buffers of SECTOR_IO_DIRECT
+ *        transfers, the size of each buffer of its pool and the number of
+ *        buffers the pool of each disk keeps
+ */
+#define SECTOR_DIRECT_ALIGN 4096
+#define SECTOR_DIRECT_BUFFER (64 * 1024)
+#define SECTOR_DIRECT_POOL 4
+
+/**
+ * @brief the device under a disk: how sectors are really read and written,
+ *        below the cache (u->cache). dev is u->dev, the device given to
+ *        sector_set_backend().
+ */
+struct sector_backend_ops {
+    const char *name;
+    int (*read)(void *dev, uint32_t sector, void *data);          /* 0 on success; <0 on error */
+    int (*write)(void *dev, uint32_t sector, const void *data);   /* 0 on success; <0 on error */
+    int (*flush)(void *dev);                                      /* 0 on success; <0 on error */
+    void (*close)(void *dev);                                     /* called by sector_detach() */
+};
+
+/**
+ * @brief the default backend: the FILE* of the disk itself, accessed as
+ *        chosen with sector_set_io()
+ */
+extern const struct sector_backend_ops sector_file_backend;
+
+/**
+ * @brief choose the device under a disk, in u->backend and u->dev. With
+ *        another backend than sector_file_backend, u->f may be NULL;
+ *        sector_set_io(), sector_map() and the positional I/O
+ *        (sector_fileno()) only apply to sector_file_backend.
+ *        Every request is then made through u->cache, if it is not NULL,
+ *        and counted in u->stats, if it is not NULL, under its current subsystem.
+ * @param u the filesystem, without a backend yet
+ * @param ops the operations of the backend
+ * @param dev the device given to every operation (ignored for sector_file_backend,
+ *        which uses u->f); closed by sector_detach()
+ * @return 0 on success; <0 on error
+ */
+int sector_set_backend(struct unix_filesystem *u, const struct sector_backend_ops *ops, void *dev);
+
+/**
+ * @brief make sector_write() keep the sectors in the cache of the disk,
+ *        marked dirty, instead of writing them. The dirty sectors are
+ *        written in ascending order by sector_sync(), which sector_write()
+ *        calls itself once dirty_limit sectors are dirty.
+ * @param u the filesystem, with a cache (u->cache)
+ * @param dirty_limit the number of dirty sectors that triggers a flush,
+ *        0 to write through again (the dirty sectors are written first)
+ * @return 0 on success; <0 on error
+ */
+int sector_set_write_back(struct unix_filesystem *u, size_t dirty_limit);
+
+/**
+ * @brief write every dirty sector of the disk, in ascending order, then
+ *        flush the backend
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int sector_sync(const struct unix_filesystem *u);
+
+/**
+ * @brief choose how the sectors of the given disk are read and written;
+ *        puts sector_file_backend under it if it has no backend yet.
+ *        SECTOR_IO_PREAD must be selected before any stdio access to u->f.
+ * @param u the filesystem, with u->f open
+ * @param io the access method
+ * @return 0 on success; <0 on error
+ */
+int sector_set_io(struct unix_filesystem *u, enum sector_io io);
+
+/**
+ * @brief memory-map the whole disk, read-only; puts sector_file_backend
+ *        under it if it has no backend yet. Afterwards sector_read()
+ *        copies from the mapping and sector_write() fails with ERR_READ_ONLY.
+ * @param u the filesystem, with u->f open
+ * @return 0 on success; <0 on error
+ */
+int sector_map(struct unix_filesystem *u);
+
+/**
+ * @brief access a sector in place, without any copy nor system call
+ * @param u the mounted filesystem
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @return a pointer to the 512 bytes of the sector; NULL if the disk of u
+ *         is not memory-mapped or if the sector is outside of the disk
+ */
+const void *sector_get(const struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief read count consecutive sectors from the disk of a mounted
+ *        filesystem; the sectors missing from the cache are read with
+ *        one system call per contiguous run
+ * @param u the mounted filesystem
+ * @param first the first sector to read
+ * @param count the number of sectors to read
+ * @param buf a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read_range(const struct unix_filesystem *u, uint32_t first, uint32_t count, void *buf);
+
+/**
+ * @brief tell if several threads may read a disk at the same time with
+ *        sector_read_range_shared(): a file under sector_file_backend,
+ *        memory-mapped or read with SECTOR_IO_PREAD or SECTOR_IO_DIRECT,
+ *        and without sector cache
+ * @param u the mounted filesystem
+ * @return 1 if they may; 0 otherwise
+ */
+int sector_can_share_reads(const struct unix_filesystem *u);
+
+/**
+ * @brief sector_read_range() that may run in several threads at once, on
+ *        a disk for which sector_can_share_reads() is true. The request is
+ *        not counted: the caller records it with iostat_record_class().
+ * @param u the mounted filesystem
+ * @param first the first sector to read
+ * @param count the number of sectors to read
+ * @param buf a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; ERR_BAD_PARAMETER if the reads of the disk can't
+ *         be shared; <0 on other errors
+ */
+int sector_read_range_shared(const struct unix_filesystem *u, uint32_t first, uint32_t count, void *buf);
+
+/**
+ * @brief read a list of sectors, in any order, each in its own buffer.
+ *        The list is sorted, adjacent sectors are merged and every run
+ *        is read with one vectored system call.
+ * @param u the mounted filesystem
+ * @param sectors the sectors to read
+ * @param count the number of sectors in the list
+ * @param bufs bufs[i] points to 512 bytes of memory receiving sectors[i] (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read_list(const struct unix_filesystem *u, const uint32_t *sectors, size_t count, void * const *bufs);
+
+/**
+ * @brief copy a sector if it is already in memory (mapping or cache)
+ * @param u the mounted filesystem
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 1 if the sector was copied; 0 if it must be read from the disk
+ */
+int sector_lookup(const struct unix_filesystem *u, uint32_t sector, void *data);
+
+/**
+ * @brief record in the cache a sector that was read or written without
+ *        going through sector_read()/sector_write()
+ * @param u the mounted filesystem
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ */
+void sector_update(const struct unix_filesystem *u, uint32_t sector, const void *data);
+
+/**
+ * @brief give the file descriptor to use for positional I/O on the disk
+ *        of u; pending stdio writes are flushed first
+ * @param u the mounted filesystem
+ * @param write 1 if the descriptor is used to write: only allowed with
+ *        SECTOR_IO_PREAD, since stdio could keep a stale copy of the sector.
+ *        The dirty sectors of a write-back cache are written first.
+ * @return the file descriptor; <0 on error or if positional I/O is not allowed
+ */
+int sector_fileno(const struct unix_filesystem *u, int write);
+
+/**
+ * @brief close the backend of the disk and forget it (u->cache, u->stats
+ *        and u->f are not freed)
+ * @param u the filesystem
+ */
+void sector_detach(struct unix_filesystem *u);
 
 #ifdef __cplusplus
 }
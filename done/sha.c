@@ -7,6 +7,8 @@
 #include "inode.h"
 #include "error.h"
 #include "sector.h"
+#include "aio.h"
+#include <stdlib.h>
 
 
 
@@ -45,6 +47,36 @@ void print_sha_from_content(const unsigned char *content, size_t length) {
 
 
 
+/**
+ * @brief read a whole file with asynchronous I/O, many sectors in flight
+ * @param fv6 the opened file
+ * @param data enough memory for all the sectors of the file (OUT)
+ * @return 0 on success; <0 on error
+ */
+static int read_file_async(struct filev6 *fv6, unsigned char *data) {
+  int nb_sectors = (inode_getsize(&(fv6->i_node)) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  if (nb_sectors == 0) return 0;
+
+  uint32_t *sectors = malloc(nb_sectors * sizeof(uint32_t));
+  void **bufs = malloc(nb_sectors * sizeof(void *));
+  int result = (sectors == NULL || bufs == NULL) ? ERR_NOMEM : 0;
+
+  // Find where every sector of the file is at once, then read them all
+  if (result == 0) {
+    int found = inode_map_range(fv6->u, &(fv6->i_node), 0, nb_sectors, sectors, NULL);
+    // Short of the end of the file: the first sector not found gives the error
+    if (found >= 0 && found < nb_sectors) found = inode_map_range(fv6->u, &(fv6->i_node), found, 1, sectors + found, NULL);
+    if (found < 0) result = found;
+  }
+  for (int i = 0; result == 0 && i < nb_sectors; ++i) bufs[i] = data + i * SECTOR_SIZE;
+  iostat_tag(fv6->u->stats, IOSTAT_FILE);
+  if (result == 0) result = aio_read_all(fv6->u->aio, sectors, nb_sectors, bufs);
+
+  free(sectors);
+  free(bufs);
+  return result;
+}
+
 /**
  * @brief print the sha of the content of an inode
  * @param u the filesystem
@@ -73,18 +105,24 @@ void print_sha_inode(struct unix_filesystem *u, struct inode inode, int inr) {
 
         int fileRead;
 
-        do {
-          fileRead = filev6_readblock(&stv6, ptr);
+        if (u->aio != NULL) {
+          if (read_file_async(&stv6, data) < 0) {
+            fprintf(stderr, "Error while reading block for inode");
+          }
+        }
+        else do {
+          fileRead = filev6_readblocks(&stv6, ptr, FILEV6_MAX_EXTENT);
           if (fileRead < 0) {
             fprintf(stderr, "Error while reading block for inode");
           }
-          ptr += SECTOR_SIZE;
+          else ptr += fileRead;
         } while (fileRead > 0);
         data[inode_size] = '\0';
 
 
         print_sha_from_content(data, inode_size);
         ptr = NULL;
+        filev6_close(u, &stv6);
 
       }
     }
@@ -11,7 +11,7 @@
 #include "sha.h"
 #include <inttypes.h>
 #include "filev6.h"
-#define CMD_NB 13
+#define CMD_NB 18
 
 //MAX_ARGS = 5 : name_of_function + max_3_args (in the function with the most args) + 1 (to check if there isn't any 5th or more arg)
 #define MAX_ARGS 5
@@ -45,6 +45,11 @@ int do_istat(const char** c);
 int do_inode(const char** c);
 int do_sha(const char** c);
 int do_psb(const char** c);
+int do_sync(const char** c);
+int do_iostat(const char** c);
+int do_iostat_reset(const char** c);
+int do_df(const char** c);
+int do_layout(const char** c);
 
 struct unix_filesystem u = {0};
 int FS_mounted = 0;
@@ -62,7 +67,12 @@ struct shell_map shell_cmds[CMD_NB] = {
 	{"istat", do_istat, "display information about the provided inode", 1, "<inode_nr>"},
 	{"inode", do_inode, "display the inode number of a file", 1, "<pathname>"},
 	{"sha", do_sha, "display the SHA of a file", 1, "<pathname>"},
-	{"psb", do_psb, "Print superBlock of the currently mounted filesystem", 0, ""}
+	{"psb", do_psb, "Print superBlock of the currently mounted filesystem", 0, ""},
+	{"sync", do_sync, "write the modified sectors to the disk", 0, ""},
+	{"iostat", do_iostat, "display the sector I/O of the currently mounted filesystem, by subsystem, and the inode cache", 0, ""},
+	{"iostat", do_iostat_reset, "clear the sector I/O statistics", 1, "reset"},
+	{"df", do_df, "display the used and free blocks and inodes of the currently mounted filesystem", 0, ""},
+	{"layout", do_layout, "display how far apart the consecutive sectors of the files are on the disk", 0, ""}
 };
 
 // Separate all arguments of our command
@@ -105,16 +115,16 @@ int main(void) {
 
 		if (found == -1) printf("ERROR SHELL: invalid command\n");
 		else{
-			// Go through all comands
-			while (i < CMD_NB && found == 0) {
+			// Go through all comands (a name may appear once per number of arguments)
+			while (i < CMD_NB && found != 1) {
 				// If we found a command with the correct name
 				if (strcmp(args[0], shell_cmds[i].name) == 0) {
-					// Update found so we know we don't need to look through other commands
-					found = 1;
-					// If we don't have the correct number of argumenets, error SHELL
-					if(shell_cmds[i].argc != args_n) printf("ERROR SHELL: wrong number of arguments\n");
+					// If we don't have the correct number of argumenets, look for another one
+					if(shell_cmds[i].argc != args_n) found = 2;
 
 					else {
+						// Update found so we know we don't need to look through other commands
+						found = 1;
 						// Create an pointer to the corresponding function
 						shell_fct my_fct = shell_cmds[i].fct;
 						// Call the function with all the args (we do +1 because the first arg is the comand name)
@@ -135,8 +145,12 @@ int main(void) {
 		}
 		// If we didn't found any correponding command, error shell
 		if (found == 0) printf("ERROR SHELL: invalid command\n");
+		else if (found == 2) printf("ERROR SHELL: wrong number of arguments\n");
 	}
 
+	// End of input without quit: the modified sectors must still reach the disk
+	if (running && FS_mounted) umountv6(&u);
+
 	return 0;
 }
 int do_help(const char** c) {
@@ -151,8 +165,13 @@ int do_mount(const char** c) {
 	if (FS_mounted) umountv6(&u);
 
 	FS_mounted = 0;
-	// Try to mount with first arg == address of .uv6
-    int tryMount = mountv6(c[0], &u);
+	// Try to mount with first arg == address of .uv6, writes are absorbed by the cache
+	struct mount_options opts;
+	mountv6_default_options(&opts);
+	opts.dirty_sectors = MOUNT_WRITE_BACK_SECTORS;
+	opts.dirty_inodes = MOUNT_WRITE_BACK_INODES;
+	opts.io_stats = 1;
+    int tryMount = mountv6_opts(c[0], &opts, &u);
     // If we can't error
     if (tryMount < 0)return tryMount;
     // New all other functions know that the filesystem if ready to be used
@@ -203,6 +222,75 @@ int do_istat(const char** c){
 	return 0;
 }
 
+int do_sync(const char** c) {
+	// Check that filesystem is mounted
+	if (!FS_mounted) {
+		return ERR_NOT_MOUNTED;
+	}
+	// Write every dirty sector of the cache
+	return mountv6_sync(&u);
+}
+
+int do_iostat(const char** c) {
+	// Check that filesystem is mounted
+	if (!FS_mounted) {
+		return ERR_NOT_MOUNTED;
+	}
+	// Print the requests of every subsystem, and what the inode cache saved
+	iostat_print(u.stats);
+	icache_print_stats(u.icache);
+	return 0;
+}
+
+int do_iostat_reset(const char** c) {
+	// Check that filesystem is mounted
+	if (!FS_mounted) {
+		return ERR_NOT_MOUNTED;
+	}
+	if (strcmp(c[0], "reset") != 0) return ERR_NON_VALID_ARG;
+
+	// Start a new measurement
+	iostat_reset(u.stats);
+	return 0;
+}
+
+/**
+ * @brief print one line of do_df(): the size of a bitmap, used and unused bits
+ */
+static void print_df(const char* name, const struct bmblock_array* bm) {
+	uint64_t total = bm->max - bm->min + 1;
+	printf("%-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", name, total, total - bm->free_count, bm->free_count);
+}
+
+int do_df(const char** c) {
+	// Check that filesystem is mounted
+	if (!FS_mounted) {
+		return ERR_NOT_MOUNTED;
+	}
+	// The bitmaps keep their number of unused bits up to date
+	printf("%-8s %10s %10s %10s\n", "", "total", "used", "free");
+	print_df("blocks", u.fbm);
+	print_df("inodes", u.ibm);
+	return 0;
+}
+
+int do_layout(const char** c) {
+	// Check that filesystem is mounted
+	if (!FS_mounted) {
+		return ERR_NOT_MOUNTED;
+	}
+	struct filev6_layout layout;
+	int measure = filev6_layout(&u, &layout);
+	if (measure < 0) return measure;
+
+	// Seek distance between every sector of a file and the next one
+	uint64_t pairs = layout.sectors - layout.files;
+	printf("files: %" PRIu64 ", sectors: %" PRIu64 "\n", layout.files, layout.sectors);
+	printf("non-adjacent: %" PRIu64 " of %" PRIu64 ", average seek distance: %.2f sectors\n",
+	       layout.seeks, pairs, pairs > 0 ? (double) layout.distance / pairs : 0.0);
+	return 0;
+}
+
 int do_exit(const char** c){
 	if (FS_mounted) {
 		int umount = umountv6(&u);
@@ -261,6 +349,7 @@ int do_add(const char** c){
 
 	// Write averything in the file
 	filev6_writebytes(&u, &fv6, data, length+1);	
+	filev6_close(&u, &fv6);
 	
 	return 0;
 }
@@ -295,24 +384,29 @@ int do_cat(const char** c){
 	if(inodeOpen < 0) return inodeOpen;
 	else {
 		// If the inode is a directory, error
-		if (((stv6.i_node).i_mode & IFDIR)) return ERR_CAT_DIR;
+		if (((stv6.i_node).i_mode & IFDIR)) {
+			filev6_close(&u, &stv6);
+			return ERR_CAT_DIR;
+		}
 		else {
-			// Prepare an array to save data
-			unsigned char data[SECTOR_SIZE + 1];
+			// Prepare an array to save data, big enough for a whole extent
+			unsigned char data[FILEV6_MAX_EXTENT * SECTOR_SIZE];
 
 			int fileRead = 1;
 			// While there is something to read
 			while(fileRead > 0){
-				// Try too read it
-				fileRead = filev6_readblock(&stv6, &data);
-				// Set last char to \0 to end the string
-				data[SECTOR_SIZE] = '\0';
+				// Try too read as many sectors as possible
+				fileRead = filev6_readblocks(&stv6, data, FILEV6_MAX_EXTENT);
 				// If eror return it
-				if(fileRead < 0) return fileRead;
-				// If fileRead > 0 => we did read successfully => print what we read
-				if(fileRead > 0) printf("%s", data);
+				if(fileRead < 0) {
+					filev6_close(&u, &stv6);
+					return fileRead;
+				}
+				// If fileRead > 0 => we did read successfully => print every byte we read, even a \0
+				if(fileRead > 0) fwrite(data, 1, fileRead, stdout);
 				// If fileRead == 0, we're at the end of the file => the loop will end
 			}
+			filev6_close(&u, &stv6);
 		}
     }
     return 0;
@@ -0,0 +1,148 @@
+/**
+ * @file test-bitmap-large.c
+ * @brief checks a compressed bitmap (at least BM_COMPRESSED_MIN_BITS values)
+ *        against a plain array of bytes, through the same changes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bmblock.h"
+#include "bmchunk.h"
+#include "error.h"
+
+#define TEST_MIN 7
+#define TEST_MAX (TEST_MIN + 2 * BM_COMPRESSED_MIN_BITS + 12345)  // several containers, the last one partial
+#define TEST_STEPS 20000
+
+struct test {
+  struct bmblock_array *bm;
+  unsigned char *flat;      // the expected bit of every value
+  unsigned long errors;
+};
+
+/**
+ * @brief a random value between TEST_MIN and TEST_MAX
+ */
+static uint64_t pick(unsigned *seed) {
+  uint64_t r = ((uint64_t) rand_r(seed) << 16) ^ (uint64_t) rand_r(seed);
+  return TEST_MIN + r % (TEST_MAX - TEST_MIN + 1);
+}
+
+/**
+ * @brief set or clear one value in both, checking the result
+ */
+static void change(struct test *t, uint64_t x, int value) {
+  int result = value ? bm_set(t->bm, x) : bm_clear(t->bm, x);
+  if (result != 0) ++t->errors;
+  else t->flat[x - TEST_MIN] = (unsigned char) value;
+}
+
+/**
+ * @brief set or clear a range in both; it may go past the end of the array
+ */
+static void change_range(struct test *t, uint64_t first, uint64_t last, int value) {
+  int result = value ? bm_set_range(t->bm, first, last) : bm_clear_range(t->bm, first, last);
+  if (result != 0) ++t->errors;
+  for (uint64_t x = first; x <= last && x <= TEST_MAX; ++x) {
+    if (x >= TEST_MIN) t->flat[x - TEST_MIN] = (unsigned char) value;
+  }
+}
+
+/**
+ * @brief the first value at or after from whose expected bit is value
+ */
+static uint64_t flat_find(const struct test *t, uint64_t from, int value) {
+  for (uint64_t x = from; x <= TEST_MAX; ++x) {
+    if (t->flat[x - TEST_MIN] == value) return x;
+  }
+  return TEST_MAX + 1;
+}
+
+/**
+ * @brief compare every bit, the free count and the searches with the flat array
+ * @return the number of differences
+ */
+static unsigned long compare(struct test *t, unsigned *seed) {
+  unsigned long wrong = 0;
+  uint64_t freeCount = 0;
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; ++x) {
+    if (bm_get(t->bm, x) != t->flat[x - TEST_MIN]) ++wrong;
+    freeCount += t->flat[x - TEST_MIN] == 0;
+  }
+  if (t->bm->free_count != freeCount || bm_count_free(t->bm) != freeCount) ++wrong;
+
+  // Every value before the cursor is used, so the next one is the first unused
+  uint64_t first = flat_find(t, TEST_MIN, 0);
+  int next = bm_find_next(t->bm);
+  if (first > TEST_MAX ? next != ERR_BITMAP_FULL : next != (int) first) ++wrong;
+
+  for (int i = 0; i < 50; ++i) {
+    uint64_t from = pick(seed);
+    if (bm_find_value(t->bm, from, 0) != flat_find(t, from, 0)) ++wrong;
+    if (bm_find_value(t->bm, from, 1) != flat_find(t, from, 1)) ++wrong;
+  }
+  return wrong;
+}
+
+int main(void) {
+  struct test t = {bm_alloc(TEST_MIN, TEST_MAX), calloc(TEST_MAX - TEST_MIN + 1, 1), 0};
+  if (t.bm == NULL || t.flat == NULL) return 1;
+  int failed = t.bm->chunks == NULL;
+  printf("compressed: %s\n", t.bm->chunks != NULL ? "yes" : "no");
+  unsigned seed = 42;
+
+  // Out of range values are refused
+  failed |= bm_set(t.bm, TEST_MIN - 1) != ERR_BAD_PARAMETER || bm_clear(t.bm, TEST_MAX + 1) != ERR_BAD_PARAMETER;
+  failed |= bm_get(t.bm, TEST_MAX + 1) >= 0;
+
+  // Scattered values, then runs of every size, some across containers
+  for (int i = 0; i < TEST_STEPS; ++i) change(&t, pick(&seed), 1);
+  for (int i = 0; i < TEST_STEPS / 4; ++i) change(&t, pick(&seed), 0);
+  for (int i = 0; i < 200; ++i) {
+    uint64_t first = pick(&seed);
+    uint64_t length = 1 + (uint64_t) rand_r(&seed) % (i % 10 == 0 ? 3 * BM_CHUNK_BITS : 5000);
+    change_range(&t, first, first + length - 1, rand_r(&seed) % 3 != 0);
+  }
+  unsigned long wrong = compare(&t, &seed);
+  printf("random: errors %lu, differences %lu\n", t.errors, wrong);
+  failed |= t.errors != 0 || wrong != 0;
+
+  // A whole container used, a hole in it, then every other value in the next one
+  change_range(&t, TEST_MIN, TEST_MIN + 2 * BM_CHUNK_BITS - 1, 1);
+  change(&t, TEST_MIN + 1000, 0);
+  for (uint64_t x = TEST_MIN + BM_CHUNK_BITS; x < TEST_MIN + 2 * BM_CHUNK_BITS; x += 2) change(&t, x, 0);
+  wrong = compare(&t, &seed);
+  printf("dense: errors %lu, differences %lu\n", t.errors, wrong);
+  failed |= t.errors != 0 || wrong != 0;
+
+  // Runs are found where the flat array has them, and marked used
+  for (int i = 0; i < 20; ++i) {
+    uint64_t start;
+    size_t n = 1 + (size_t) rand_r(&seed) % 300;
+    int found = bm_find_run_near(t.bm, pick(&seed), n, &start);
+    if (found <= 0) {
+      ++wrong;
+      continue;
+    }
+    for (uint64_t x = start; x < start + (uint64_t) found; ++x) {
+      if (t.flat[x - TEST_MIN] != 0) ++wrong;
+      t.flat[x - TEST_MIN] = 1;
+    }
+  }
+  wrong += compare(&t, &seed);
+  printf("runs: differences %lu\n", wrong);
+  failed |= wrong != 0;
+
+  // Full, then empty again
+  change_range(&t, 0, TEST_MAX, 1);
+  wrong = compare(&t, &seed);
+  change_range(&t, TEST_MIN, TEST_MAX + 10, 0);
+  wrong += compare(&t, &seed);
+  printf("full and empty: errors %lu, differences %lu\n", t.errors, wrong);
+  failed |= t.errors != 0 || wrong != 0 || t.bm->free_count != TEST_MAX - TEST_MIN + 1;
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  free(t.flat);
+  bm_free(t.bm);
+  return failed;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file test-bitmap-mt.c
+ * @brief checks bm_claim_next(), bm_claim() and bm_release() from many
+ *        threads, and that the summary still matches the bits afterwards
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "bmblock.h"
+#include "error.h"
+
+#define TEST_THREADS 4
+#define TEST_MIN 1
+#define TEST_MAX 300000     // enough rows for every level of summary, not compressed
+#define TEST_ROUNDS 20
+
+struct test {
+  struct bmblock_array *bm;
+  unsigned char *owners;    // number of threads holding every value
+  unsigned long errors;
+};
+
+struct worker {
+  struct test *t;
+  unsigned seed;
+  unsigned long claimed;
+};
+
+/**
+ * @brief record that the calling thread holds a value
+ */
+static void own(struct test *t, int x) {
+  if (x < TEST_MIN || x > TEST_MAX || __atomic_fetch_add(&t->owners[x], 1, __ATOMIC_RELAXED) != 0) {
+    __atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @brief claim until the bitmap is full
+ */
+static void *fill(void *arg) {
+  struct worker *w = arg;
+  int x;
+  while ((x = bm_claim_next(w->t->bm)) >= 0) {
+    own(w->t, x);
+    ++w->claimed;
+  }
+  if (x != ERR_BITMAP_FULL) __atomic_fetch_add(&w->t->errors, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/**
+ * @brief release values spread over the whole bitmap, then claim as many
+ *        again, round after round, so that rows become free and full again
+ */
+static void *churn(void *arg) {
+  struct worker *w = arg;
+  struct test *t = w->t;
+  for (int r = 0; r < TEST_ROUNDS; ++r) {
+    unsigned long released = 0;
+    for (int x = TEST_MIN + (int) (rand_r(&w->seed) % 4096); x <= TEST_MAX; x += 64 + (int) (rand_r(&w->seed) % 4096)) {
+      // Only the values this thread took from the bitmap are its own to give back
+      if (__atomic_load_n(&t->owners[x], __ATOMIC_RELAXED) == 1 && rand_r(&w->seed) % 2 == 0
+          && __atomic_exchange_n(&t->owners[x], 0, __ATOMIC_RELAXED) == 1) {
+        bm_release(t->bm, x);
+        ++released;
+      }
+    }
+    // The last round leaves the bitmap with unused values everywhere
+    if (r == TEST_ROUNDS - 1) break;
+
+    // Claim as many again: one by its number, the others from the cursor
+    int y = TEST_MIN + (int) (rand_r(&w->seed) % (TEST_MAX - TEST_MIN + 1));
+    if (released > 0 && bm_claim(t->bm, y) == 1) {
+      own(t, y);
+      --released;
+    }
+    for (; released > 0; --released) {
+      int x = bm_claim_next(t->bm);
+      if (x < 0) break;
+      own(t, x);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief run a function in TEST_THREADS threads
+ */
+static void run(struct test *t, void *(*fn)(void *), unsigned long *claimed) {
+  pthread_t ids[TEST_THREADS];
+  struct worker workers[TEST_THREADS];
+  for (int i = 0; i < TEST_THREADS; ++i) {
+    workers[i].t = t;
+    workers[i].seed = 1234u + (unsigned) i;
+    workers[i].claimed = 0;
+    pthread_create(&ids[i], NULL, fn, &workers[i]);
+  }
+  *claimed = 0;
+  for (int i = 0; i < TEST_THREADS; ++i) {
+    pthread_join(ids[i], NULL);
+    *claimed += workers[i].claimed;
+  }
+}
+
+/**
+ * @brief check every level of the summary against the bits: a row or word
+ *        with an unused bit must be marked; if exact, a marked one must
+ *        have an unused bit too
+ * @return the number of wrong summary bits
+ */
+static unsigned long check_summary(struct bmblock_array *bm, int exact) {
+  unsigned long wrong = 0;
+  size_t under = bm->length;
+  for (int l = 0; l < BM_SUMMARY_LEVELS && bm->summary[l] != NULL; ++l) {
+    for (size_t i = 0; i < under; ++i) {
+      int free = (l == 0) ? bm->bm[i] != UINT64_MAX : bm->summary[l - 1][i] != 0;
+      int marked = (bm->summary[l][i / 64] >> (i % 64)) & 1;
+      if ((free && !marked) || (exact && marked && !free)) ++wrong;
+    }
+    printf("summary level %d: %zu words\n", l, (under + 63) / 64);
+    under = (under + 63) / 64;
+  }
+  return wrong;
+}
+
+int main(void) {
+  struct test t = {bm_alloc(TEST_MIN, TEST_MAX), calloc(TEST_MAX + 1, 1), 0};
+  if (t.bm == NULL || t.owners == NULL) return 1;
+  int failed = 0;
+
+  // Every value is claimed exactly once, and the summary then says the bitmap is full
+  unsigned long claimed;
+  run(&t, fill, &claimed);
+  unsigned long wrong = check_summary(t.bm, 1);
+  printf("fill: claimed %lu of %d, errors %lu, free_count %llu, wrong summary bits %lu\n",
+         claimed, TEST_MAX - TEST_MIN + 1, t.errors, (unsigned long long) t.bm->free_count, wrong);
+  failed |= claimed != TEST_MAX - TEST_MIN + 1 || t.errors != 0 || t.bm->free_count != 0 || wrong != 0;
+  printf("find_next() = %d\n", bm_find_next(t.bm));
+  failed |= bm_find_next(t.bm) != ERR_BITMAP_FULL;
+
+  // Release and claim again at the same time; the summary may only miss nothing
+  run(&t, churn, &claimed);
+  unsigned long held = 0;
+  for (int x = TEST_MIN; x <= TEST_MAX; ++x) {
+    held += t.owners[x];
+    if ((t.owners[x] != 0) != (bm_get(t.bm, x) == 1)) ++t.errors;
+  }
+  wrong = check_summary(t.bm, 0);
+  printf("churn: held %lu, errors %lu, free_count %s, wrong summary bits %lu\n", held, t.errors,
+         t.bm->free_count == bm_count_free(t.bm) ? "ok" : "wrong", wrong);
+  failed |= t.errors != 0 || t.bm->free_count != bm_count_free(t.bm) || wrong != 0;
+
+  // The first unused value is found through the summary
+  uint64_t first = TEST_MAX + 1;
+  for (int x = TEST_MAX; x >= TEST_MIN; --x) {
+    if (t.owners[x] == 0) first = x;
+  }
+  uint64_t found = bm_find_value(t.bm, TEST_MIN, 0);
+  printf("find_value(%d, 0) %s\n", TEST_MIN, found == first ? "ok" : "wrong");
+  failed |= found != first;
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  free(t.owners);
+  bm_free(t.bm);
+  return failed;
+}
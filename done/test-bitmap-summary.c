@@ -0,0 +1,153 @@
+/**
+ * @file test-bitmap-summary.c
+ * @brief checks bm_find_next() on a bitmap large enough for every level of
+ *        summary, against a plain array of bytes: on a nearly full bitmap,
+ *        after ranges are set and cleared, and after bm_rebuild(); and that
+ *        the summary and the free count stay right
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bmblock.h"
+#include "error.h"
+
+#define TEST_MIN 3
+#define TEST_MAX 300000      // enough rows for every level of summary, not compressed
+#define TEST_HOLES 60
+#define TEST_STEPS 3000
+
+struct test {
+  struct bmblock_array *bm;
+  unsigned char used[TEST_MAX + 1];    // the expected bit of every value
+  unsigned long errors;
+};
+
+/**
+ * @brief set or clear a range in both; a single value with bm_set() or bm_clear()
+ */
+static void change_range(struct test *t, uint64_t first, uint64_t last, int value) {
+  int result;
+  if (first == last) result = value ? bm_set(t->bm, first) : bm_clear(t->bm, first);
+  else result = value ? bm_set_range(t->bm, first, last) : bm_clear_range(t->bm, first, last);
+  if (result != 0) ++t->errors;
+  for (uint64_t x = first; x <= last; ++x) t->used[x] = (unsigned char) value;
+}
+
+/**
+ * @brief the first unused value, TEST_MAX + 1 if there is none
+ */
+static uint64_t flat_first(const struct test *t) {
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; ++x) {
+    if (!t->used[x]) return x;
+  }
+  return TEST_MAX + 1;
+}
+
+/**
+ * @brief check every level of the summary: a row or word with an unused
+ *        bit must be marked in the level above
+ * @return the number of wrong summary bits
+ */
+static unsigned long check_summary(const struct bmblock_array *bm) {
+  unsigned long wrong = 0;
+  size_t under = bm->length;
+  for (int l = 0; l < BM_SUMMARY_LEVELS && bm->summary[l] != NULL; ++l) {
+    for (size_t i = 0; i < under; ++i) {
+      int unused = (l == 0) ? bm->bm[i] != UINT64_MAX : bm->summary[l - 1][i] != 0;
+      if (unused && !((bm->summary[l][i / 64] >> (i % 64)) & 1)) ++wrong;
+    }
+    under = (under + 63) / 64;
+  }
+  return wrong;
+}
+
+/**
+ * @brief compare bm_find_next(), the free count and the summary with the array
+ * @return the number of differences
+ */
+static unsigned long compare(struct test *t) {
+  unsigned long wrong = check_summary(t->bm);
+  uint64_t freeCount = 0;
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; ++x) freeCount += !t->used[x];
+  if (t->bm->free_count != freeCount || bm_count_free(t->bm) != freeCount) ++wrong;
+
+  uint64_t first = flat_first(t);
+  int next = bm_find_next(t->bm);
+  if (first > TEST_MAX ? next != ERR_BITMAP_FULL : next != (int) first) ++wrong;
+  return wrong;
+}
+
+/**
+ * @brief sort values, for qsort()
+ */
+static int cmp_values(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+int main(void) {
+  struct test *t = calloc(1, sizeof(struct test));
+  if (t == NULL) return 1;
+  t->bm = bm_alloc(TEST_MIN, TEST_MAX);
+  if (t->bm == NULL) return 1;
+  int failed = t->bm->summary[BM_SUMMARY_LEVELS - 1] == NULL;
+  unsigned seed = 5;
+
+  // Nearly full: every hole is found in order, through the summary, then nothing
+  change_range(t, TEST_MIN, TEST_MAX, 1);
+  uint64_t holes[TEST_HOLES];
+  for (int i = 0; i < TEST_HOLES; ++i) {
+    holes[i] = TEST_MIN + (uint64_t) rand_r(&seed) % (TEST_MAX - TEST_MIN + 1);
+    change_range(t, holes[i], holes[i], 0);
+  }
+  qsort(holes, TEST_HOLES, sizeof(uint64_t), cmp_values);
+  unsigned long wrong = 0;
+  int found = 0;
+  for (int next; (next = bm_find_next(t->bm)) >= 0; ++found) {
+    // The same value may be a hole twice
+    while (found > 0 && found < TEST_HOLES && holes[found] == holes[found - 1]) ++found;
+    if (found >= TEST_HOLES || next != (int) holes[found]) ++wrong;
+    change_range(t, (uint64_t) next, (uint64_t) next, 1);
+  }
+  wrong += compare(t);
+  printf("nearly full: %d holes found, differences %lu\n", found, wrong);
+  failed |= wrong != 0 || t->errors != 0;
+
+  // A value cleared before the cursor is found again first
+  change_range(t, TEST_MAX - 5, TEST_MAX, 0);
+  wrong = compare(t);
+  change_range(t, TEST_MIN + 1000, TEST_MIN + 1000, 0);
+  wrong += compare(t);
+  printf("cleared before the cursor: differences %lu\n", wrong);
+  failed |= wrong != 0;
+
+  // Ranges of every size, some across rows and words of the summary
+  wrong = 0;
+  for (int i = 0; i < TEST_STEPS; ++i) {
+    uint64_t first = TEST_MIN + (uint64_t) rand_r(&seed) % (TEST_MAX - TEST_MIN + 1);
+    uint64_t length = 1 + (uint64_t) rand_r(&seed) % (i % 20 == 0 ? 64 * 64 * 3 : 200);
+    uint64_t last = first + length - 1 <= TEST_MAX ? first + length - 1 : TEST_MAX;
+    // Mostly used, so that the unused values are far apart
+    change_range(t, first, last, rand_r(&seed) % 5 != 0);
+    if (i % 50 == 0) wrong += compare(t);
+  }
+  wrong += compare(t);
+  printf("ranges: errors %lu, differences %lu\n", t->errors, wrong);
+  failed |= wrong != 0 || t->errors != 0;
+
+  // Words changed behind its back, then rebuilt
+  for (size_t w = 0; w < t->bm->length; w += 37) {
+    t->bm->bm[w] = UINT64_MAX;
+    for (uint64_t x = t->bm->min + w * 64; x < t->bm->min + (w + 1) * 64 && x <= TEST_MAX; ++x) t->used[x] = 1;
+  }
+  bm_rebuild(t->bm);
+  wrong = compare(t);
+  printf("rebuilt: differences %lu\n", wrong);
+  failed |= wrong != 0;
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  bm_free(t->bm);
+  free(t);
+  return failed;
+}
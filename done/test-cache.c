@@ -0,0 +1,67 @@
+#include "cache.h"
+#include "unixv6fs.h"
+#include <stdio.h>
+#include <string.h>
+
+// cache_writer printing what would be written
+static int print_write(void *arg, uint32_t sector, const void *data) {
+  printf("write(%u) content = %d\n", (unsigned) sector, ((const uint8_t *) data)[0]);
+  return 0;
+}
+
+int main(void){
+  struct sector_cache *c = cache_alloc(4);
+  uint8_t data[SECTOR_SIZE];
+
+  // Fill the cache with sectors 10 to 13, the content is the sector number
+  for (uint32_t s = 10; s < 14; ++s) {
+    memset(data, s, SECTOR_SIZE);
+    cache_store(c, s, data);
+  }
+  cache_print_stats(c);
+
+  // 10 becomes the most recently used, so 11 is the next to go
+  printf("read(10) = %d", cache_read(c, 10, data));
+  printf(" content = %d\n", data[0]);
+  memset(data, 14, SECTOR_SIZE);
+  cache_store(c, 14, data);
+  printf("read(11) = %d\n", cache_read(c, 11, data));
+  printf("read(10) = %d\n", cache_read(c, 10, data));
+
+  // Update in place, then invalidate
+  memset(data, 42, SECTOR_SIZE);
+  cache_store(c, 12, data);
+  printf("read(12) = %d", cache_read(c, 12, data));
+  printf(" content = %d\n", data[0]);
+  cache_invalidate(c, 12);
+  printf("read(12) = %d\n", cache_read(c, 12, data));
+  printf("read(13) = %d", cache_read(c, 13, data));
+  printf(" content = %d\n", data[0]);
+  printf("read(14) = %d", cache_read(c, 14, data));
+  printf(" content = %d\n", data[0]);
+  cache_print_stats(c);
+
+  // Write-back: dirty entries are kept and flushed in sector order
+  memset(data, 7, SECTOR_SIZE);
+  printf("write(20) = %d\n", cache_write(c, 20, data));
+  printf("write(15) = %d\n", cache_write(c, 15, data));
+  memset(data, 8, SECTOR_SIZE);
+  printf("write(20) = %d\n", cache_write(c, 20, data));
+  printf("write(16) = %d\n", cache_write(c, 16, data));
+  printf("write(17) = %d\n", cache_write(c, 17, data));
+  printf("write(18) = %d\n", cache_write(c, 18, data));
+  cache_store(c, 19, data);
+  printf("read(19) = %d\n", cache_read(c, 19, data));
+
+  // A read completing after the write must not replace the dirty content
+  memset(data, 3, SECTOR_SIZE);
+  cache_store(c, 20, data);
+  printf("read(20) = %d", cache_read(c, 20, data));
+  printf(" content = %d\n", data[0]);
+  printf("flush = %d\n", cache_flush(c, print_write, NULL));
+  printf("write(18) = %d\n", cache_write(c, 18, data));
+  cache_print_stats(c);
+
+  cache_free(c);
+  return 0;
+}
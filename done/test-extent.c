@@ -0,0 +1,220 @@
+/**
+ * @file test-extent.c
+ * @brief checks extent_best_fit(), extent_next_fit() and extent_largest()
+ *        against a search of a plain array of bytes, while values are taken
+ *        from and given back to the free extents of a bitmap
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bmblock.h"
+#include "extent.h"
+#include "error.h"
+
+#define TEST_MIN 5
+#define TEST_MAX 20000
+#define TEST_STEPS 4000
+#define TEST_QUERIES 40
+
+struct test {
+  struct bmblock_array *bm;
+  struct extent_index *index;
+  unsigned char used[TEST_MAX + 2];     // the expected bit of every value, used[TEST_MAX + 1] = 1
+  unsigned long errors;
+};
+
+/**
+ * @brief the end (excluded) of the run of values starting at x whose bit is value
+ */
+static uint64_t run_end(const struct test *t, uint64_t x, int value) {
+  while (x <= TEST_MAX && t->used[x] == value) ++x;
+  return x;
+}
+
+/**
+ * @brief what extent_best_fit() should find, by going through every extent
+ * @return 0 on success; ERR_BITMAP_FULL if there is none
+ */
+static int flat_best_fit(const struct test *t, uint64_t n, uint64_t *start, uint64_t *length) {
+  int found = ERR_BITMAP_FULL;
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; ) {
+    if (t->used[x]) {
+      ++x;
+      continue;
+    }
+    uint64_t end = run_end(t, x, 0);
+    if (end - x >= n && (found != 0 || end - x < *length)) {
+      found = 0;
+      *start = x;
+      *length = end - x;
+    }
+    x = end;
+  }
+  return found;
+}
+
+/**
+ * @brief what extent_largest() should find
+ * @return 0 on success; ERR_BITMAP_FULL if there is no free value
+ */
+static int flat_largest(const struct test *t, uint64_t *start, uint64_t *length) {
+  int found = ERR_BITMAP_FULL;
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; ) {
+    if (t->used[x]) {
+      ++x;
+      continue;
+    }
+    uint64_t end = run_end(t, x, 0);
+    if (found != 0 || end - x > *length) {
+      found = 0;
+      *start = x;
+      *length = end - x;
+    }
+    x = end;
+  }
+  return found;
+}
+
+/**
+ * @brief what extent_next_fit() should find
+ * @return 0 on success; ERR_BITMAP_FULL if there is none
+ */
+static int flat_next_fit(const struct test *t, uint64_t goal, uint64_t n, uint64_t *start) {
+  if (goal >= TEST_MIN && goal <= TEST_MAX && !t->used[goal] && run_end(t, goal, 0) - goal >= n) {
+    *start = goal;
+    return 0;
+  }
+  for (uint64_t x = goal + 1; x <= TEST_MAX; ) {
+    if (t->used[x] || (x > TEST_MIN && !t->used[x - 1])) {
+      ++x;
+      continue;
+    }
+    uint64_t end = run_end(t, x, 0);
+    if (end - x >= n) {
+      *start = x;
+      return 0;
+    }
+    x = end;
+  }
+  return ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief compare every search, the count and the free values with the array
+ * @return the number of differences
+ */
+static unsigned long compare(struct test *t, unsigned *seed) {
+  unsigned long wrong = 0;
+  size_t count = 0;
+  uint64_t freeValues = 0;
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; ++x) {
+    freeValues += !t->used[x];
+    count += !t->used[x] && (x == TEST_MIN || t->used[x - 1]);
+  }
+  if (t->index->count != count || t->index->free != freeValues) ++wrong;
+
+  uint64_t start, length, expectedStart, expectedLength;
+  int found = extent_largest(t->index, &start, &length);
+  int expected = flat_largest(t, &expectedStart, &expectedLength);
+  if (found != expected || (found == 0 && (start != expectedStart || length != expectedLength))) ++wrong;
+
+  for (int i = 0; i < TEST_QUERIES; ++i) {
+    uint64_t n = 1 + (uint64_t) rand_r(seed) % (i % 4 == 0 ? 400 : 20);
+    found = extent_best_fit(t->index, n, &start, &length);
+    expected = flat_best_fit(t, n, &expectedStart, &expectedLength);
+    if (found != expected || (found == 0 && (start != expectedStart || length != expectedLength))) ++wrong;
+
+    uint64_t goal = TEST_MIN - 2 + (uint64_t) rand_r(seed) % (TEST_MAX - TEST_MIN + 5);
+    found = extent_next_fit(t->index, goal, n, &start);
+    expected = flat_next_fit(t, goal, n, &expectedStart);
+    if (found != expected || (found == 0 && start != expectedStart)) ++wrong;
+  }
+  return wrong;
+}
+
+/**
+ * @brief take part of a free extent, or give back part of a used run, in
+ *        the bitmap, the index and the array
+ */
+static void change(struct test *t, unsigned *seed) {
+  uint64_t x = TEST_MIN + (uint64_t) rand_r(seed) % (TEST_MAX - TEST_MIN + 1);
+  int value = t->used[x];
+  uint64_t end = run_end(t, x, value);
+  uint64_t count = 1 + (uint64_t) rand_r(seed) % (end - x);
+  if (rand_r(seed) % 2 == 0) count = end - x;
+
+  int result = value ? bm_clear_range(t->bm, x, x + count - 1) : bm_set_range(t->bm, x, x + count - 1);
+  if (result == 0) result = value ? extent_give(t->index, x, count) : extent_take(t->index, x, count);
+  if (result != 0) ++t->errors;
+  for (uint64_t y = x; y < x + count; ++y) t->used[y] = !value;
+}
+
+int main(void) {
+  struct test *t = calloc(1, sizeof(struct test));
+  if (t == NULL) return 1;
+  t->used[TEST_MAX + 1] = 1;
+  t->bm = bm_alloc(TEST_MIN, TEST_MAX);
+  if (t->bm == NULL) return 1;
+  unsigned seed = 11;
+  int failed = 0;
+
+  // Runs of every length, used and unused
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; ) {
+    uint64_t length = 1 + (uint64_t) rand_r(&seed) % (rand_r(&seed) % 8 == 0 ? 300 : 12);
+    int value = rand_r(&seed) % 2;
+    for (uint64_t y = x; y < x + length && y <= TEST_MAX; ++y) {
+      t->used[y] = (unsigned char) value;
+      if (value) bm_set(t->bm, y);
+    }
+    x += length;
+  }
+  t->index = extent_index_build(t->bm);
+  if (t->index == NULL) return 1;
+  unsigned long wrong = compare(t, &seed);
+  printf("built: %zu extents, %llu free values, differences %lu\n", t->index->count,
+         (unsigned long long) t->index->free, wrong);
+  failed |= wrong != 0;
+
+  // Taken and given back, the extents split and merge
+  for (int i = 0; i < TEST_STEPS; ++i) {
+    change(t, &seed);
+    if (i % 100 == 0) wrong += compare(t, &seed);
+  }
+  wrong += compare(t, &seed);
+  printf("changed: %zu extents, errors %lu, differences %lu\n", t->index->count, t->errors, wrong);
+  failed |= t->errors != 0 || wrong != 0;
+
+  // Values not all in one free extent are refused, and nothing changes
+  uint64_t start, length;
+  int refused = 0;
+  if (extent_largest(t->index, &start, &length) == 0) {
+    size_t count = t->index->count;
+    refused = extent_take(t->index, start, length + 1) < 0 && extent_give(t->index, start, 1) < 0
+              && t->index->count == count && compare(t, &seed) == 0;
+  }
+  printf("bad take and give: %s\n", refused ? "refused" : "NOT REFUSED");
+  failed |= !refused;
+
+  // Everything taken, then everything given back as one extent
+  while (extent_largest(t->index, &start, &length) == 0) {
+    bm_set_range(t->bm, start, start + length - 1);
+    if (extent_take(t->index, start, length) != 0) ++t->errors;
+    for (uint64_t y = start; y < start + length; ++y) t->used[y] = 1;
+  }
+  wrong = compare(t, &seed);
+  for (uint64_t x = TEST_MIN; x <= TEST_MAX; x += 1000) {
+    uint64_t last = x + 999 < TEST_MAX ? x + 999 : TEST_MAX;
+    bm_clear_range(t->bm, x, last);
+    if (extent_give(t->index, x, last - x + 1) != 0) ++t->errors;
+    for (uint64_t y = x; y <= last; ++y) t->used[y] = 0;
+  }
+  wrong += compare(t, &seed);
+  printf("full and empty: %zu extents, errors %lu, differences %lu\n", t->index->count, t->errors, wrong);
+  failed |= t->errors != 0 || wrong != 0 || t->index->count != 1;
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  extent_index_free(t->index);
+  bm_free(t->bm);
+  free(t);
+  return failed;
+}
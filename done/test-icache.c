@@ -0,0 +1,196 @@
+/**
+ * @file test-icache.c
+ * @brief checks that the inode cache never evicts a held or dirty entry,
+ *        and that icache_flush() writes the dirty inodes once per sector
+ *        of the inode table; then, on a disk, that the inodes written back
+ *        by a write-back mount are the ones a plain mount reads
+ *
+ * Usage: test-icache [disk]; the disk is changed, and must have 16 free inodes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "icache.h"
+#include "mount.h"
+#include "inode.h"
+#include "error.h"
+
+#define TEST_CAPACITY 4
+#define TEST_FILES 16
+#define TEST_MAX_CALLS 8
+
+struct calls {
+  uint32_t index[TEST_MAX_CALLS];   // sector of the inode table of every call
+  size_t n[TEST_MAX_CALLS];         // number of inodes given to every call
+  size_t count;
+  int ordered;                      // the inodes of every call were in ascending order
+  uint32_t fail;                    // sector whose write fails, UINT32_MAX if none
+};
+
+/**
+ * @brief icache_writer recording its calls instead of writing
+ */
+static int record(void *arg, uint32_t index, struct icache_entry *const *entries, size_t n) {
+  struct calls *calls = arg;
+  if (index == calls->fail) return ERR_IO;
+  if (calls->count < TEST_MAX_CALLS) {
+    calls->index[calls->count] = index;
+    calls->n[calls->count] = n;
+  }
+  ++calls->count;
+  for (size_t i = 0; i < n; ++i) {
+    if (entries[i]->inr / INODES_PER_SECTOR != index || (i > 0 && entries[i - 1]->inr >= entries[i]->inr)) {
+      calls->ordered = 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief an inode whose size tells its number
+ */
+static struct inode make(uint16_t inr) {
+  struct inode inode;
+  memset(&inode, 0, sizeof(inode));
+  inode.i_mode = IALLOC;
+  inode_setsize(&inode, inr);
+  return inode;
+}
+
+/**
+ * @brief tell if an inode is in the cache, with the content make() gave it
+ */
+static int cached(struct inode_cache *c, uint16_t inr) {
+  struct inode inode;
+  return icache_read(c, inr, &inode) && inode_getsize(&inode) == inr;
+}
+
+/**
+ * @brief the part of the test without disk
+ * @return 1 if it failed
+ */
+static int test_cache(void) {
+  int failed = 0;
+  struct inode_cache *c = icache_alloc(TEST_CAPACITY);
+  if (c == NULL) return 1;
+  c->dirty_limit = TEST_CAPACITY;
+
+  // Held and dirty entries stay, the others make room
+  struct inode inode = make(1);
+  icache_store(c, 1, &inode);
+  struct icache_entry *held = icache_hold(c, 1);
+  inode = make(2);
+  icache_write(c, 2, &inode);
+  for (uint16_t inr = 3; inr < 20; ++inr) {
+    inode = make(inr);
+    icache_store(c, inr, &inode);
+  }
+  int kept = held != NULL && cached(c, 1) && cached(c, 2) && cached(c, 19) && !cached(c, 3);
+  printf("held and dirty entries kept: %s, evictions %llu\n", kept ? "yes" : "NO", (unsigned long long) c->evictions);
+  failed |= !kept;
+
+  // Once every entry is held or dirty, nothing more is stored
+  inode = make(17);
+  icache_write(c, 17, &inode);
+  inode = make(40);
+  icache_write(c, 40, &inode);
+  inode = make(50);
+  icache_store(c, 50, &inode);
+  int full = !cached(c, 50) && icache_write(c, 51, &inode) == 0 && cached(c, 1) && cached(c, 2);
+  printf("full of held and dirty entries: %s\n", full ? "nothing stored" : "STORED");
+  failed |= !full;
+
+  // A failed write stops the flush: the inodes of the next sectors stay dirty
+  inode = make(2);
+  icache_write(c, 2, &inode);
+  struct calls calls = {{0}, {0}, 0, 1, 1};
+  int flush = icache_flush(c, record, &calls);
+  int stopped = flush == ERR_IO && calls.count == 1 && calls.index[0] == 0 && c->dirty == 2;
+  printf("failed write: %s, %zu dirty left\n", stopped ? "stopped there" : "NOT STOPPED", c->dirty);
+  failed |= !stopped;
+
+  // Released, an entry may go; then the writes to one sector cost one write
+  icache_release(c, held);
+  inode = make(18);
+  icache_write(c, 18, &inode);
+  calls.count = 0;
+  calls.fail = UINT32_MAX;
+  flush = icache_flush(c, record, &calls);
+  int grouped = flush == 0 && calls.count == 2 && calls.ordered && calls.index[0] == 1 && calls.n[0] == 2
+                && calls.index[1] == 2 && calls.n[1] == 1 && c->dirty == 0;
+  printf("flush: %zu calls, %s, flushed %llu, avoided %llu\n", calls.count, grouped ? "grouped by sector" : "NOT GROUPED",
+         (unsigned long long) c->flushed, (unsigned long long) c->avoided);
+  failed |= !grouped || c->flushed != 3 || c->avoided != 2;
+
+  // Released and clean, the entries leave the cache again
+  for (uint16_t inr = 60; inr < 60 + TEST_CAPACITY; ++inr) {
+    inode = make(inr);
+    icache_store(c, inr, &inode);
+  }
+  int evicted = !cached(c, 1) && !cached(c, 2) && !cached(c, 17) && cached(c, 60 + TEST_CAPACITY - 1);
+  printf("released and flushed entries evicted: %s\n", evicted ? "yes" : "NO");
+  failed |= !evicted;
+
+  icache_free(c);
+  return failed;
+}
+
+/**
+ * @brief change the size of TEST_FILES free inodes through a write-back
+ *        mount, then check them with a plain one and free them again
+ * @return 1 if it failed
+ */
+static int test_disk(const char *filename) {
+  struct mount_options opts;
+  mountv6_default_options(&opts);
+  opts.dirty_inodes = 2 * TEST_FILES;
+  struct unix_filesystem u;
+  if (mountv6_opts(filename, &opts, &u) != 0) return 1;
+
+  // The first free inodes, most of them in the same sectors
+  uint16_t inrs[TEST_FILES];
+  int n = 0;
+  for (uint64_t inr = u.ibm->min; inr <= u.ibm->max && n < TEST_FILES; ++inr) {
+    if (bm_get(u.ibm, inr) == 0) inrs[n++] = (uint16_t) inr;
+  }
+  int error = n == TEST_FILES ? 0 : ERR_BITMAP_FULL;
+  for (int i = 0; i < n && error == 0; ++i) {
+    struct inode inode = make(inrs[i]);
+    error = inode_write(&u, inrs[i], &inode);
+  }
+  uint64_t avoided = u.icache->avoided;
+  int sync = inode_sync(&u);
+  avoided = u.icache->avoided - avoided;
+  int umount = umountv6(&u);
+  if (error == 0) error = sync != 0 ? sync : umount;
+  printf("write-back: %s, %llu sector writes avoided\n", error == 0 ? "ok" : ERR_MESSAGES[error - ERR_FIRST],
+         (unsigned long long) avoided);
+  if (error != 0 || avoided == 0) return 1;
+
+  // Without any cache, every inode comes from the disk
+  mountv6_default_options(&opts);
+  opts.cache_inodes = 0;
+  opts.cache_sectors = 0;
+  if (mountv6_opts(filename, &opts, &u) != 0) return 1;
+  int wrong = 0;
+  for (int i = 0; i < n; ++i) {
+    struct inode inode;
+    if (inode_read(&u, inrs[i], &inode) != 0 || inode_getsize(&inode) != inrs[i]) ++wrong;
+
+    // Give them back
+    memset(&inode, 0, sizeof(inode));
+    if (inode_write(&u, inrs[i], &inode) != 0) ++wrong;
+  }
+  umountv6(&u);
+  printf("read by a plain mount: %d of %d wrong\n", wrong, n);
+  return wrong != 0;
+}
+
+int main(int argc, char *argv[]) {
+  int failed = test_cache();
+  if (argc > 1) failed |= test_disk(argv[1]);
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
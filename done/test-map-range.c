@@ -0,0 +1,114 @@
+/**
+ * @file test-map-range.c
+ * @brief checks inode_map_range() against inode_findsector(), sector by
+ *        sector, on a large file of a RAM disk whose indirect sectors give
+ *        runs of every length; and that it gives the sectors found before
+ *        an indirect sector that can't be read
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mount.h"
+#include "inode.h"
+#include "sector.h"
+#include "error.h"
+
+#define TEST_BLOCKS 8192
+#define TEST_INODES 64
+#define TEST_INDIRECT 4                                      // indirect sectors of the file
+#define TEST_SECTORS ((TEST_INDIRECT - 1) * ADDRESSES_PER_SECTOR + 100)
+#define TEST_UNREADABLE 2                                    // slot of the indirect sector past the disk
+#define TEST_RANGES 2000
+
+/**
+ * @brief check one range against inode_findsector() and the runs it gives
+ * @return the number of differences
+ */
+static unsigned long check_range(const struct unix_filesystem *u, const struct inode *inode, int32_t first, int32_t count) {
+  uint32_t sectors[TEST_SECTORS];
+  uint32_t runs[TEST_SECTORS];
+  int n = inode_map_range(u, inode, first, count, sectors, runs);
+
+  // As many as the file has, or up to the unreadable indirect sector
+  int32_t end = first + count < TEST_SECTORS ? first + count : TEST_SECTORS;
+  if (first / ADDRESSES_PER_SECTOR <= TEST_UNREADABLE && end > TEST_UNREADABLE * ADDRESSES_PER_SECTOR) {
+    end = TEST_UNREADABLE * ADDRESSES_PER_SECTOR;
+  }
+  int32_t expected = end > first ? end - first : 0;
+  if (first / ADDRESSES_PER_SECTOR == TEST_UNREADABLE && first < TEST_SECTORS) return n >= 0;
+  if (n != expected) return 1;
+
+  unsigned long wrong = 0;
+  for (int k = 0; k < n; ++k) {
+    if ((int) sectors[k] != inode_findsector(u, inode, first + k)) ++wrong;
+    int run = 1;
+    while (k + run < n && sectors[k + run] == sectors[k] + run) ++run;
+    if ((int) runs[k] != run) ++wrong;
+  }
+  return wrong;
+}
+
+int main(void) {
+  struct unix_filesystem u;
+  if (mountv6_mkfs_ram(TEST_BLOCKS, TEST_INODES, NULL, &u) != 0) return 1;
+  int failed = 0;
+
+  // Runs of 1, 2, 3... sectors, each after a hole of one sector
+  struct inode inode;
+  memset(&inode, 0, sizeof(inode));
+  inode.i_mode = IALLOC;
+  inode_setsize(&inode, (TEST_SECTORS - 1) * SECTOR_SIZE + 17);
+  uint16_t addresses[ADDRESSES_PER_SECTOR];
+  uint32_t next = 1000;
+  int run = 1, inRun = 0;
+  for (int slot = 0; slot < TEST_INDIRECT; ++slot) {
+    for (int a = 0; a < ADDRESSES_PER_SECTOR; ++a) {
+      addresses[a] = (uint16_t) next++;
+      if (++inRun == run) {
+        ++next;
+        ++run;
+        inRun = 0;
+      }
+    }
+    inode.i_address[slot] = (uint16_t) (100 + slot);
+    if (sector_write(&u, inode.i_address[slot], addresses) != 0) failed = 1;
+  }
+  inode.i_address[TEST_UNREADABLE] = TEST_BLOCKS + 10;
+
+  // Every range starting in the first sectors, then random ones
+  unsigned long wrong = 0;
+  for (int32_t first = 0; first < 300; ++first) wrong += check_range(&u, &inode, first, 300);
+  unsigned seed = 7;
+  for (int i = 0; i < TEST_RANGES; ++i) {
+    int32_t first = rand_r(&seed) % (TEST_SECTORS + 10);
+    wrong += check_range(&u, &inode, first, 1 + rand_r(&seed) % TEST_SECTORS);
+  }
+  printf("ranges: %lu differences with inode_findsector()\n", wrong);
+  failed |= wrong != 0;
+
+  // Up to the unreadable indirect sector: the sectors before it, then the error
+  uint32_t sectors[TEST_SECTORS];
+  int partial = inode_map_range(&u, &inode, 10, TEST_SECTORS, sectors, NULL);
+  int error = inode_map_range(&u, &inode, TEST_UNREADABLE * ADDRESSES_PER_SECTOR + 3, 10, sectors, NULL);
+  printf("unreadable indirect sector: %d sectors before it, then %s\n", partial, error < 0 ? "an error" : "NO ERROR");
+  failed |= partial != TEST_UNREADABLE * ADDRESSES_PER_SECTOR - 10 || error >= 0;
+
+  // Past the end of the file, nothing; a small file, straight from the inode
+  int after = inode_map_range(&u, &inode, TEST_SECTORS, 5, sectors, NULL);
+  struct inode small;
+  memset(&small, 0, sizeof(small));
+  small.i_mode = IALLOC;
+  inode_setsize(&small, 3 * SECTOR_SIZE + 1);
+  for (int a = 0; a < ADDR_SMALL_LENGTH; ++a) small.i_address[a] = (uint16_t) (500 + a);
+  small.i_address[2] = 900;
+  uint32_t runs[ADDR_SMALL_LENGTH];
+  int n = inode_map_range(&u, &small, 0, ADDR_SMALL_LENGTH, sectors, runs);
+  int direct = n == 4 && sectors[0] == 500 && sectors[2] == 900 && sectors[3] == 503 && runs[0] == 2 && runs[2] == 1;
+  printf("end of file: %d; small file: %s\n", after, direct ? "ok" : "WRONG");
+  failed |= after != 0 || !direct;
+
+  umountv6(&u);
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
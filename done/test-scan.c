@@ -0,0 +1,196 @@
+/**
+ * @file test-scan.c
+ * @brief checks that inode_scan() calls back once for every inode, with
+ *        the same inodes whatever the number of threads, in order with
+ *        one thread, and that a callback can stop it; on a RAM disk, then
+ *        on a given disk with every I/O method, then on the same inodes
+ *        as the RAM disk in a file whose threads read at the same time
+ *
+ * Usage: test-scan [disk]; the file disk is written next to it, in <disk>.scan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mount.h"
+#include "inode.h"
+#include "sector.h"
+#include "error.h"
+
+#define TEST_BLOCKS 16384
+#define TEST_INODES 8192        // several chunks of INODE_SCAN_CHUNK_SECTORS for the threads
+#define TEST_STOP 77            // returned by the callback to stop the scan
+
+struct seen {
+  uint32_t calls[UINT16_MAX + 1];    // calls back for every inode
+  int32_t size[UINT16_MAX + 1];      // size of every inode, -1 for an unreadable one
+  uint16_t last;                     // inode of the previous call back
+  int ordered;                       // every call back came after the one of a smaller inode
+  uint16_t stop;                     // inode at which the scan is stopped, 0 for none
+};
+
+/**
+ * @brief inode_scan_callback recording what it is given
+ */
+static int record(void *ctx, uint16_t inr, const struct inode *inode) {
+  struct seen *seen = ctx;
+  __atomic_fetch_add(&seen->calls[inr], 1, __ATOMIC_RELAXED);
+  seen->size[inr] = inode != NULL ? inode_getsize(inode) : -1;
+  // Several threads may call back at the same time
+  if (inr <= __atomic_exchange_n(&seen->last, inr, __ATOMIC_RELAXED)) __atomic_store_n(&seen->ordered, 0, __ATOMIC_RELAXED);
+  return seen->stop != 0 && inr == seen->stop ? TEST_STOP : 0;
+}
+
+/**
+ * @brief scan with the given number of threads and compare with a first scan
+ * @param ref the first scan, with one thread; NULL to only check the calls
+ * @return the number of differences
+ */
+static unsigned long scan(const struct unix_filesystem *u, int flags, int nthreads, const struct seen *ref, struct seen *seen) {
+  memset(seen, 0, sizeof(*seen));
+  seen->ordered = 1;
+  if (inode_scan(u, flags, record, seen, nthreads) != 0) return 1;
+
+  unsigned long wrong = 0;
+  for (size_t inr = 0; inr <= UINT16_MAX; ++inr) {
+    if (seen->calls[inr] > 1) ++wrong;
+    if (ref != NULL && (seen->calls[inr] != ref->calls[inr] || seen->size[inr] != ref->size[inr])) ++wrong;
+  }
+  return wrong;
+}
+
+/**
+ * @brief compare the scans with 1 and more threads of a filesystem
+ * @param name printed with the results
+ * @param allocated the number of allocated inodes, 0 if unknown
+ * @return 1 if it failed
+ */
+static int test_scans(const char *name, const struct unix_filesystem *u, unsigned long allocated, struct seen *ref, struct seen *seen) {
+  int failed = 0;
+  unsigned long wrong = scan(u, 0, 1, NULL, ref);
+  unsigned long found = 0;
+  for (size_t inr = 0; inr <= UINT16_MAX; ++inr) found += ref->calls[inr];
+  printf("%s, 1 thread: %lu inodes, %s\n", name, found, ref->ordered ? "in order" : "NOT IN ORDER");
+  failed |= wrong != 0 || !ref->ordered || found == 0 || (allocated != 0 && found != allocated);
+
+  for (int nthreads = 2; nthreads <= INODE_SCAN_MAX_THREADS; nthreads *= 2) {
+    wrong = scan(u, 0, nthreads, ref, seen);
+    printf("%s, %d threads: %lu differences\n", name, nthreads, wrong);
+    failed |= wrong != 0;
+  }
+
+  // Every inode of the table, once, whatever the threads
+  unsigned long all = 0;
+  wrong = scan(u, INODE_SCAN_ALL, 4, NULL, seen);
+  for (size_t inr = 0; inr <= UINT16_MAX; ++inr) all += seen->calls[inr];
+  printf("%s, all inodes: %lu\n", name, all);
+  failed |= wrong != 0 || all < found;
+
+  // The callback stops the scan, and its value is returned
+  uint16_t last = 0;
+  for (size_t inr = 0; inr <= UINT16_MAX; ++inr) {
+    if (ref->calls[inr] != 0) last = (uint16_t) inr;
+  }
+  for (int nthreads = 1; nthreads <= 4; nthreads *= 4) {
+    memset(seen, 0, sizeof(*seen));
+    seen->stop = last;
+    int stop = inode_scan(u, 0, record, seen, nthreads);
+    printf("%s, stopped with %d threads: %s\n", name, nthreads, stop == TEST_STOP ? "ok" : "NOT STOPPED");
+    failed |= stop != TEST_STOP;
+  }
+  return failed;
+}
+
+/**
+ * @brief allocate inodes of every size here and there, more and more of
+ *        them along the table, always the same ones
+ * @return the number of allocated inodes, with the root; 0 on error
+ */
+static unsigned long fill(struct unix_filesystem *u) {
+  unsigned long allocated = 1;
+  unsigned seed = 3;
+  for (uint16_t inr = ROOT_INUMBER + 1; inr < TEST_INODES; ++inr) {
+    if ((unsigned) rand_r(&seed) % TEST_INODES >= inr) continue;
+    struct inode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.i_mode = IALLOC;
+    inode_setsize(&inode, rand_r(&seed) % (ADDR_SMALL_LENGTH * SECTOR_SIZE));
+    if (inode_write(u, inr, &inode) != 0) return 0;
+    ++allocated;
+  }
+  return allocated;
+}
+
+/**
+ * @brief scan the inodes of fill() in a file, read at the same time by the
+ *        threads: with pread(), O_DIRECT and from a mapping
+ * @return 1 if it failed
+ */
+static int test_shared(const char *filename, struct seen *ref, struct seen *seen) {
+  struct unix_filesystem u;
+  if (mountv6_mkfs(filename, TEST_BLOCKS, TEST_INODES) != 0 || mountv6(filename, &u) != 0) return 1;
+  unsigned long allocated = fill(&u);
+  if (umountv6(&u) != 0 || allocated == 0) return 1;
+
+  int failed = 0;
+  static const char * const names[] = {"shared pread", "shared direct", "shared map"};
+  for (int m = 0; m < 3; ++m) {
+    struct mount_options opts;
+    mountv6_default_options(&opts);
+    opts.cache_sectors = 0;
+    opts.io = m == 1 ? SECTOR_IO_DIRECT : SECTOR_IO_PREAD;
+    opts.read_only = m == 2;
+    if (mountv6_opts(filename, &opts, &u) != 0) {
+      printf("%s: mount failed\n", names[m]);
+      failed = 1;
+      continue;
+    }
+    int shared = sector_can_share_reads(&u) == 1;
+    if (!shared) printf("%s: READS NOT SHARED\n", names[m]);
+    failed |= !shared || test_scans(names[m], &u, allocated, ref, seen);
+    umountv6(&u);
+  }
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  struct seen *ref = malloc(sizeof(struct seen));
+  struct seen *seen = malloc(sizeof(struct seen));
+  if (ref == NULL || seen == NULL) return 1;
+  int failed = 0;
+
+  struct unix_filesystem u;
+  if (mountv6_mkfs_ram(TEST_BLOCKS, TEST_INODES, NULL, &u) != 0) return 1;
+  unsigned long allocated = fill(&u);
+  failed |= allocated == 0 || test_scans("ram disk", &u, allocated, ref, seen);
+  umountv6(&u);
+
+  // The same disk read through every I/O method
+  static const char * const names[] = {"stdio", "pread", "direct"};
+  static const enum sector_io methods[] = {SECTOR_IO_STDIO, SECTOR_IO_PREAD, SECTOR_IO_DIRECT};
+  for (size_t m = 0; argc > 1 && m < sizeof(methods) / sizeof(methods[0]); ++m) {
+    struct mount_options opts;
+    mountv6_default_options(&opts);
+    opts.io = methods[m];
+    if (mountv6_opts(argv[1], &opts, &u) != 0) {
+      printf("%s: mount failed\n", names[m]);
+      failed = 1;
+      continue;
+    }
+    failed |= test_scans(names[m], &u, 0, ref, seen);
+    umountv6(&u);
+  }
+
+  // A disk of several chunks whose reads are shared
+  if (argc > 1) {
+    char filename[FILENAME_MAX];
+    snprintf(filename, sizeof(filename), "%s.scan", argv[1]);
+    failed |= test_shared(filename, ref, seen);
+    remove(filename);
+  }
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  free(ref);
+  free(seen);
+  return failed;
+}
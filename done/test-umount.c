@@ -0,0 +1,183 @@
+/**
+ * @file test-umount.c
+ * @brief checks that umountv6() leaves a disk the mount did not change as
+ *        it was, and that the bitmaps it keeps on a changed one are the
+ *        ones fill_ibm() and fill_fbm() rebuild from the inodes, even with
+ *        a file left open
+ *
+ * Usage: test-umount <disk>; the disk is changed, and must have room for
+ * its bitmaps (s_fbm_start, s_ibm_start), as first.uv6 does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mount.h"
+#include "direntv6.h"
+#include "filev6.h"
+#include "error.h"
+
+void fill_fbm(struct unix_filesystem* ufs);
+
+#define TEST_FILE_BYTES 3000
+#define TEST_NO_MOUNT 1000000UL
+
+/**
+ * @brief read a whole file in memory
+ * @param size its size (OUT)
+ * @return the content, NULL on failure
+ */
+static unsigned char *slurp(const char *filename, long *size) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) return NULL;
+  unsigned char *data = NULL;
+  if (fseek(f, 0, SEEK_END) == 0 && (*size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+    data = malloc(*size);
+    if (data != NULL && fread(data, 1, *size, f) != (size_t) *size) {
+      free(data);
+      data = NULL;
+    }
+  }
+  fclose(f);
+  return data;
+}
+
+/**
+ * @brief mount and umount without changing anything
+ * @return 1 if the disk has exactly the same bytes afterwards
+ */
+static int unchanged(const char *filename) {
+  long before, after;
+  unsigned char *old = slurp(filename, &before);
+  struct unix_filesystem u;
+  int error = mountv6(filename, &u);
+  if (error == 0) error = umountv6(&u);
+  unsigned char *new = slurp(filename, &after);
+  int same = error == 0 && old != NULL && new != NULL && before == after && memcmp(old, new, before) == 0;
+  free(old);
+  free(new);
+  return same;
+}
+
+/**
+ * @brief the flag of the superblock telling the bitmaps on the disk are right
+ */
+static int marked_clean(const char *filename) {
+  long size;
+  unsigned char *data = slurp(filename, &size);
+  if (data == NULL || size < (SUPERBLOCK_SECTOR + 1) * SECTOR_SIZE) {
+    free(data);
+    return 0;
+  }
+  struct superblock su;
+  memcpy(&su, data + SUPERBLOCK_SECTOR * SECTOR_SIZE, sizeof(su));
+  free(data);
+  return su.pad[0] == MOUNT_CLEAN_MAGIC;
+}
+
+/**
+ * @brief create a file of TEST_FILE_BYTES bytes in the root directory
+ * @param close 0 to leave it open, with the rest of its allocation window reserved
+ * @return 0 on success; <0 on error
+ */
+static int add_file(struct unix_filesystem *u, const char *name, int close) {
+  unsigned char data[TEST_FILE_BYTES];
+  for (size_t i = 0; i < sizeof(data); ++i) data[i] = (unsigned char) (i * 7);
+
+  int inr = direntv6_create(u, name, IALLOC);
+  if (inr == 0) inr = direntv6_dirlookup(u, ROOT_INUMBER, name);
+  if (inr < 0) return inr;
+  struct filev6 fv6;
+  int error = filev6_open(u, (uint16_t) inr, &fv6);
+  if (error != 0) return error;
+  error = filev6_writebytes(u, &fv6, data, sizeof(data));
+  if (close) filev6_close(u, &fv6);
+  return error;
+}
+
+/**
+ * @brief count the values whose bits differ between two bitmaps of the same range
+ */
+static unsigned long differences(struct bmblock_array *a, struct bmblock_array *b) {
+  unsigned long wrong = 0;
+  for (uint64_t x = a->min; x <= a->max; ++x) wrong += bm_get(a, x) != bm_get(b, x);
+  return wrong;
+}
+
+/**
+ * @brief mount, then compare the bitmaps of the mount with a rebuild from the inodes
+ * @return the number of wrong bits, TEST_NO_MOUNT if the mount failed
+ */
+static unsigned long compare_rebuild(const char *filename) {
+  struct unix_filesystem u;
+  if (mountv6(filename, &u) != 0) return TEST_NO_MOUNT;
+
+  struct bmblock_array *fbm = u.fbm;
+  struct bmblock_array *ibm = u.ibm;
+  u.fbm = bm_alloc(fbm->min, fbm->max);
+  u.ibm = bm_alloc(ibm->min, ibm->max);
+  unsigned long wrong = TEST_NO_MOUNT;
+  if (u.fbm != NULL && u.ibm != NULL) {
+    fill_ibm(&u);
+    fill_fbm(&u);
+    wrong = differences(ibm, u.ibm) + differences(fbm, u.fbm);
+  }
+  bm_free(u.fbm);
+  bm_free(u.ibm);
+  u.fbm = fbm;
+  u.ibm = ibm;
+  umountv6(&u);
+  return wrong;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fputs("Usage: test-umount <disk>\n", stderr);
+    return 1;
+  }
+  const char *disk = argv[1];
+  int failed = 0;
+
+  // A mount that only reads leaves every byte as it was
+  int same = unchanged(disk);
+  printf("unchanged mount: %s\n", same ? "same bytes" : "CHANGED");
+  failed |= !same;
+
+  // A changed disk is marked clean, with the bitmaps a rebuild would give
+  struct unix_filesystem u;
+  int error = mountv6(disk, &u);
+  if (error == 0) {
+    error = add_file(&u, "/umount1", 1);
+    int umount = umountv6(&u);
+    if (error == 0) error = umount;
+  }
+  int clean = marked_clean(disk);
+  printf("changed mount: %s, %s\n", error == 0 ? "ok" : ERR_MESSAGES[error - ERR_FIRST],
+         clean ? "marked clean" : "NOT marked clean");
+  failed |= error != 0 || !clean;
+
+  unsigned long wrong = compare_rebuild(disk);
+  printf("bitmaps read at mount: %lu bits differ from a rebuild\n", wrong);
+  failed |= wrong != 0;
+
+  // A file never closed keeps sectors reserved, which must not stay used on the disk
+  error = mountv6(disk, &u);
+  if (error == 0) {
+    error = add_file(&u, "/umount2", 0);
+    int umount = umountv6(&u);
+    if (error == 0) error = umount;
+  }
+  wrong = compare_rebuild(disk);
+  printf("file left open: %s, %lu bits differ from a rebuild\n", error == 0 ? "ok" : ERR_MESSAGES[error - ERR_FIRST], wrong);
+  failed |= error != 0 || wrong != 0;
+
+  // Mounting the clean disk again changes nothing, not even the flag
+  same = unchanged(disk);
+  clean = marked_clean(disk);
+  printf("clean disk mounted again: %s, %s\n", same ? "same bytes" : "CHANGED",
+         clean ? "still clean" : "NOT clean");
+  failed |= !same || !clean;
+
+  printf("%s\n", failed ? "FAILED" : "OK");
+  return failed;
+}